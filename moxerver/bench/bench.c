@@ -0,0 +1,669 @@
+/*
+ * End-to-end benchmark of the moxerver forwarding path.
+ * Starts moxerver on a pseudo-terminal standing in for a serial device and
+ * talks to it through a local TCP client, measuring tty to client throughput
+ * and client to tty to client echo latency. Results are written as tab
+ * separated lines "case metric value unit" and can be compared with an
+ * earlier run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BENCH_PORT 17400		/* first TCP port used, every run takes the next one */
+#define BENCH_CASE_LEN 128		/* length of a case name */
+#define BENCH_MAX_RESULTS 256	/* results kept for the comparison */
+#define BENCH_TIMEOUT_MSEC 30000/* longest wait for data from moxerver */
+#define BENCH_BURST 4096		/* bytes per burst of the bursty pattern */
+#define BENCH_BURST_PAUSE_USEC 10000 /* pause between bursts */
+
+#define TELNET_IAC 0xFF
+
+/* payload patterns */
+typedef enum
+{
+	PATTERN_ASCII,	/* printable text lines */
+	PATTERN_BINARY,	/* pseudo random bytes, 0xFF included */
+	PATTERN_BURSTY,	/* text sent in bursts with pauses in between */
+} pattern_t;
+
+static const char *pattern_names[] = { "ascii", "binary", "bursty" };
+
+/* one measured value */
+typedef struct
+{
+	char name[BENCH_CASE_LEN];	/* case name */
+	char metric[32];			/* metric name */
+	double value;				/* measured value */
+	char unit[8];				/* unit of the value */
+} result_t;
+
+/* a running moxerver with its tty and client */
+typedef struct
+{
+	pid_t pid;			/* moxerver process */
+	int tty;			/* pseudo-terminal master, the device side */
+	int client;			/* TCP client socket */
+	int iac;			/* > 0 if the last received byte was an IAC */
+} bench_t;
+
+/* tty side of a throughput run, runs in its own thread */
+typedef struct
+{
+	bench_t *bench;
+	pattern_t pattern;
+	long baud;			/* bits per second to pace the writes at, 0 if unpaced */
+	size_t total;		/* bytes to write */
+} writer_t;
+
+static const char *moxerver_path = "build.dir/moxerver";
+static int quick;
+static int next_port = BENCH_PORT;
+static result_t results[BENCH_MAX_RESULTS];
+static int result_count;
+
+/* ========================================================================== */
+
+/* Returns the monotonic clock in nanoseconds. */
+static uint64_t now_nsec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns byte i of a pattern, both sides compute the stream this way. */
+static unsigned char pattern_byte(pattern_t pattern, uint64_t i)
+{
+	static const char text[] = "The quick brown fox jumps over the lazy dog 0123456789\n";
+	uint64_t x;
+
+	if (pattern == PATTERN_BINARY)
+	{
+		/* a cheap hash, every byte value shows up, 0xFF included */
+		x = (i + 1) * 0x9E3779B97F4A7C15ULL;
+		x ^= x >> 29;
+		return (unsigned char) (x >> 32);
+	}
+	return text[i % (sizeof(text) - 1)];
+}
+
+/* Writes a whole buffer, waiting while the descriptor is full. */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *) buf;
+	ssize_t ret;
+
+	while (len > 0)
+	{
+		ret = write(fd, p, len);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -errno;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Reads from the client socket with a timeout. Returns the number of bytes,
+ * 0 on timeout or a negative errno value. */
+static int read_client(bench_t *bench, unsigned char *buf, size_t len, int timeout_msec)
+{
+	struct pollfd pfd = { bench->client, POLLIN, 0 };
+	ssize_t ret;
+
+	if (poll(&pfd, 1, timeout_msec) <= 0)
+	{
+		return 0;
+	}
+	ret = recv(bench->client, buf, len, 0);
+	if (ret == 0)
+	{
+		return -ECONNRESET;
+	}
+	return (ret < 0) ? -errno : (int) ret;
+}
+
+/* Undoes the telnet escaping of received data in place, IAC IAC becomes one
+ * 0xFF byte. Returns the unescaped length. */
+static int unescape(bench_t *bench, unsigned char *buf, int len)
+{
+	int i, n = 0;
+
+	for (i = 0; i < len; i++)
+	{
+		if (bench->iac)
+		{
+			bench->iac = 0;
+			buf[n++] = buf[i];
+		}
+		else if (buf[i] == TELNET_IAC)
+		{
+			bench->iac = 1;
+		}
+		else
+		{
+			buf[n++] = buf[i];
+		}
+	}
+	return n;
+}
+
+/* Reads from the client until the given text arrived. */
+static int wait_for(bench_t *bench, const char *text, size_t text_len)
+{
+	unsigned char buf[1024];
+	size_t matched = 0;
+	int i, len;
+
+	while (matched < text_len)
+	{
+		len = read_client(bench, buf, sizeof(buf), 3000);
+		if (len <= 0)
+		{
+			return -ETIMEDOUT;
+		}
+		for (i = 0; i < len && matched < text_len; i++)
+		{
+			matched = (buf[i] == (unsigned char) text[matched]) ? matched + 1 :
+					  (buf[i] == (unsigned char) text[0]) ? 1 : 0;
+		}
+	}
+	return 0;
+}
+
+/* ========================================================================== */
+
+/* Stops moxerver and closes the descriptors. */
+static void bench_stop(bench_t *bench)
+{
+	if (bench->client != -1)
+	{
+		close(bench->client);
+	}
+	if (bench->pid > 0)
+	{
+		kill(bench->pid, SIGTERM);
+		waitpid(bench->pid, NULL, 0);
+	}
+	if (bench->tty != -1)
+	{
+		close(bench->tty);
+	}
+}
+
+/* Starts moxerver on a new pseudo-terminal and logs in with a telnet client. */
+static int bench_start(bench_t *bench, long baud, const char *option)
+{
+	struct sockaddr_in address;
+	struct termios tio;
+	char port[8], baudrate[24];
+	const char *tty_path;
+	int opt = 1;
+	int i;
+
+	memset(bench, 0, sizeof(*bench));
+	bench->client = -1;
+	bench->tty = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (bench->tty == -1 || grantpt(bench->tty) == -1 || unlockpt(bench->tty) == -1)
+	{
+		fprintf(stderr, "error creating a pseudo-terminal: %s\n", strerror(errno));
+		return -errno;
+	}
+	tty_path = ptsname(bench->tty);
+	/* the device side passes bytes unchanged */
+	tcgetattr(bench->tty, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(bench->tty, TCSANOW, &tio);
+
+	snprintf(port, sizeof(port), "%d", next_port);
+	snprintf(baudrate, sizeof(baudrate), "%ld", baud > 0 ? baud : 115200);
+	bench->pid = fork();
+	if (bench->pid == 0)
+	{
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		dup2(null_fd, STDERR_FILENO);
+		execl(moxerver_path, moxerver_path, "-p", port, "-t", tty_path, "-b", baudrate,
+			  "-o", option, "-l", "error", (char *) NULL);
+		_exit(127);
+	}
+	if (bench->pid == -1)
+	{
+		fprintf(stderr, "error starting %s: %s\n", moxerver_path, strerror(errno));
+		return -errno;
+	}
+
+	/* wait until the server listens */
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(next_port++);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (i = 0; i < 200; i++)
+	{
+		bench->client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (connect(bench->client, (struct sockaddr *) &address, sizeof(address)) == 0)
+		{
+			break;
+		}
+		close(bench->client);
+		bench->client = -1;
+		usleep(10000);
+	}
+	if (bench->client == -1)
+	{
+		fprintf(stderr, "error connecting to %s on port %s\n", moxerver_path, port);
+		return -ECONNREFUSED;
+	}
+	setsockopt(bench->client, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+	/* log in, character mode (IAC WONT LINEMODE) ends the dialog */
+	if (wait_for(bench, "> ", 2) < 0 ||
+		write_all(bench->client, "bench\r\n", 7) < 0 ||
+		wait_for(bench, "\xff\xfc\x22", 3) < 0)
+	{
+		fprintf(stderr, "error logging in to %s on port %s\n", moxerver_path, port);
+		return -EPROTO;
+	}
+	return 0;
+}
+
+/* ========================================================================== */
+
+/* Thread function writing the pattern into the tty, paced at the baud rate. */
+static void* throughput_writer(void *args)
+{
+	writer_t *w = (writer_t *) args;
+	unsigned char buf[BENCH_BURST];
+	uint64_t start = now_nsec();
+	uint64_t due;
+	size_t chunk, i;
+	uint64_t pos = 0;
+
+	while (pos < w->total)
+	{
+		chunk = (w->baud > 0) ? (size_t) (w->baud / 10 / 100) : sizeof(buf);
+		if (chunk == 0 || chunk > sizeof(buf))
+		{
+			chunk = sizeof(buf);
+		}
+		if (chunk > w->total - pos)
+		{
+			chunk = w->total - pos;
+		}
+		for (i = 0; i < chunk; i++)
+		{
+			buf[i] = pattern_byte(w->pattern, pos + i);
+		}
+		if (write_all(w->bench->tty, buf, chunk) < 0)
+		{
+			break;
+		}
+		pos += chunk;
+
+		/* a serial line carries 10 bits per byte */
+		if (w->baud > 0)
+		{
+			due = start + pos * 10 * 1000000000ULL / w->baud;
+			while (now_nsec() < due)
+			{
+				usleep((due - now_nsec()) / 1000 + 1);
+			}
+		}
+		else if (w->pattern == PATTERN_BURSTY && pos % BENCH_BURST == 0)
+		{
+			usleep(BENCH_BURST_PAUSE_USEC);
+		}
+	}
+	return (void *) 0;
+}
+
+/* Measures how fast the pattern gets from the tty to the client.
+ * Returns the throughput in bytes per second, negative if the data was wrong. */
+static double run_throughput(bench_t *bench, pattern_t pattern, long baud)
+{
+	writer_t w;
+	pthread_t thread;
+	unsigned char buf[65536];
+	uint64_t start, pos = 0;
+	double seconds;
+	int i, len, ok = 1;
+
+	/* unpaced runs move a fixed amount, paced runs a fixed time */
+	w.bench = bench;
+	w.pattern = pattern;
+	w.baud = baud;
+	w.total = (baud > 0) ? (size_t) (baud / 10 * (quick ? 1 : 3)) : (quick ? 4 : 32) << 20;
+	if (pattern == PATTERN_BURSTY && baud == 0)
+	{
+		w.total /= 8;
+	}
+
+	start = now_nsec();
+	if (pthread_create(&thread, NULL, throughput_writer, &w) != 0)
+	{
+		return -1;
+	}
+	while (pos < w.total)
+	{
+		len = read_client(bench, buf, sizeof(buf), BENCH_TIMEOUT_MSEC);
+		if (len <= 0)
+		{
+			ok = 0;
+			break;
+		}
+		len = unescape(bench, buf, len);
+		for (i = 0; i < len; i++)
+		{
+			if (buf[i] != pattern_byte(pattern, pos + i))
+			{
+				ok = 0;
+			}
+		}
+		pos += len;
+	}
+	seconds = (now_nsec() - start) / 1e9;
+	if (!ok)
+	{
+		/* the writer may wait for a tty moxerver stopped reading */
+		pthread_cancel(thread);
+	}
+	pthread_join(thread, NULL);
+	return ok ? w.total / seconds : -1;
+}
+
+/* Thread function echoing everything from the client back, like a device in
+ * echo mode would. */
+static void* echo_device(void *args)
+{
+	bench_t *bench = (bench_t *) args;
+	unsigned char buf[4096];
+	ssize_t len;
+
+	while ((len = read(bench->tty, buf, sizeof(buf))) > 0)
+	{
+		if (write_all(bench->tty, buf, len) < 0)
+		{
+			break;
+		}
+	}
+	return (void *) 0;
+}
+
+/* Compares values for sorting. */
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Measures round trips client to tty to client with the echoing device.
+ * Fills in the round trip times in usec, sorted. Returns 0 on success. */
+static int run_latency(bench_t *bench, pattern_t pattern, uint64_t *rtt, int count)
+{
+	unsigned char msg[256], wire[512], buf[1024];
+	pthread_t thread;
+	uint64_t start;
+	int msg_len, wire_len, got, len;
+	int i, j, ret = 0;
+
+	/* a keystroke, an escaped 0xFF, or a burst of text */
+	msg_len = (pattern == PATTERN_BURSTY) ? (int) sizeof(msg) : 1;
+	for (i = 0; i < msg_len; i++)
+	{
+		msg[i] = pattern_byte(pattern == PATTERN_BINARY ? PATTERN_BINARY : PATTERN_ASCII, i);
+	}
+	if (pattern == PATTERN_BINARY)
+	{
+		msg[0] = 0xFF;
+	}
+	for (i = 0, wire_len = 0; i < msg_len; i++)
+	{
+		if (msg[i] == TELNET_IAC)
+		{
+			wire[wire_len++] = TELNET_IAC;
+		}
+		wire[wire_len++] = msg[i];
+	}
+
+	if (pthread_create(&thread, NULL, echo_device, bench) != 0)
+	{
+		return -1;
+	}
+	for (i = 0; i < count && ret == 0; i++)
+	{
+		start = now_nsec();
+		if (write_all(bench->client, wire, wire_len) < 0)
+		{
+			ret = -1;
+			break;
+		}
+		for (got = 0; got < msg_len; got += len)
+		{
+			len = read_client(bench, buf, sizeof(buf), BENCH_TIMEOUT_MSEC);
+			if (len <= 0)
+			{
+				ret = -1;
+				break;
+			}
+			len = unescape(bench, buf, len);
+			for (j = 0; j < len; j++)
+			{
+				if (got + j >= msg_len || buf[j] != msg[got + j])
+				{
+					ret = -1;
+				}
+			}
+		}
+		rtt[i] = (now_nsec() - start) / 1000;
+	}
+	/* the echo thread waits in read(), a cancellation point */
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+	qsort(rtt, count, sizeof(uint64_t), compare_u64);
+	return ret;
+}
+
+/* ========================================================================== */
+
+/* Records and prints one measured value. */
+static void add_result(FILE *out, const char *name, const char *metric, double value, const char *unit)
+{
+	result_t *r;
+
+	fprintf(out, "%s\t%s\t%.6g\t%s\n", name, metric, value, unit);
+	fflush(out);
+	if (out != stdout)
+	{
+		printf("%-45s %-15s %12.6g %s\n", name, metric, value, unit);
+	}
+	if (result_count < BENCH_MAX_RESULTS)
+	{
+		r = &results[result_count++];
+		snprintf(r->name, sizeof(r->name), "%s", name);
+		snprintf(r->metric, sizeof(r->metric), "%s", metric);
+		snprintf(r->unit, sizeof(r->unit), "%s", unit);
+		r->value = value;
+	}
+}
+
+/* Prints the change of every result against an earlier run. Throughput should
+ * not drop and latency should not rise by more than 10%. */
+static int compare_results(const char *path)
+{
+	char line[512], name[BENCH_CASE_LEN], metric[32];
+	double value;
+	int i, worse = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+	{
+		fprintf(stderr, "error opening baseline %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	printf("\ncompared with %s:\n", path);
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		if (line[0] == '#' || sscanf(line, "%127[^\t]\t%31[^\t]\t%lf", name, metric, &value) != 3)
+		{
+			continue;
+		}
+		for (i = 0; i < result_count; i++)
+		{
+			if (strcmp(results[i].name, name) == 0 && strcmp(results[i].metric, metric) == 0)
+			{
+				double change = (value != 0) ? (results[i].value - value) / value * 100 : 0;
+				int higher_better = (strcmp(results[i].unit, "MB/s") == 0);
+				int regressed = higher_better ? change < -10 : change > 10;
+				printf("%-45s %-15s %12.6g -> %12.6g %+7.1f%%%s\n", name, metric, value,
+					   results[i].value, change, regressed ? "  WORSE" : "");
+				worse += regressed;
+			}
+		}
+	}
+	fclose(f);
+	printf("%d of %d results got worse by more than 10%%\n", worse, result_count);
+	return worse;
+}
+
+/* Prints the help message. */
+static void usage()
+{
+	fprintf(stdout, "Usage: moxerver_bench [-m moxerver] [-o results] [-b baseline] [-q]\n");
+	fprintf(stdout, "\t-m\tmoxerver binary to measure (default build.dir/moxerver)\n");
+	fprintf(stdout, "\t-o\tfile receiving the results, one \"case metric value unit\" per line\n");
+	fprintf(stdout, "\t-b\tresults of an earlier run to compare with\n");
+	fprintf(stdout, "\t-q\tquick run with fewer samples\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const long bauds[] = { 115200, 921600, 0 };
+	/* data buffer sizes of the default latency profile, the bulk profile and
+	 * the low latency busy polling */
+	static const char *setups[] = { "buffer=128", "buffer=4096", "buffer=16384", "profile=bulk",
+									"busy_poll=200" };
+	const char *results_path = NULL;
+	const char *baseline_path = NULL;
+	char name[BENCH_CASE_LEN];
+	uint64_t rtt[1000];
+	bench_t bench;
+	double rate;
+	FILE *out = stdout;
+	int samples;
+	int b, p, t, ret;
+
+	while ((ret = getopt(argc, argv, "m:o:b:qh")) != -1)
+	{
+		switch (ret)
+		{
+			case 'm':
+				moxerver_path = optarg;
+				break;
+			case 'o':
+				results_path = optarg;
+				break;
+			case 'b':
+				baseline_path = optarg;
+				break;
+			case 'q':
+				quick = 1;
+				break;
+			case 'h':
+				usage();
+				return 0;
+			default:
+				usage();
+				return -1;
+		}
+	}
+	if (results_path != NULL)
+	{
+		out = fopen(results_path, "w");
+		if (out == NULL)
+		{
+			fprintf(stderr, "error opening %s: %s\n", results_path, strerror(errno));
+			return -1;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+	samples = quick ? 200 : 1000;
+	fprintf(out, "# moxerver bench of %s, %d latency samples per case\n", moxerver_path, samples);
+
+	for (p = 0; p < (int) (sizeof(setups) / sizeof(setups[0])); p++)
+	{
+		for (t = PATTERN_ASCII; t <= PATTERN_BURSTY; t++)
+		{
+			/* tty to client throughput, paced like a serial line or unpaced */
+			for (b = 0; b < 3; b++)
+			{
+				snprintf(name, sizeof(name), "%s pattern=%s baud=%s%.0ld",
+						 setups[p], pattern_names[t], bauds[b] ? "" : "unpaced", bauds[b]);
+				if (bench_start(&bench, bauds[b], setups[p]) < 0)
+				{
+					bench_stop(&bench);
+					return -1;
+				}
+				rate = run_throughput(&bench, t, bauds[b]);
+				bench_stop(&bench);
+				if (rate < 0)
+				{
+					fprintf(stderr, "%s: data went missing or arrived corrupted\n", name);
+					return -1;
+				}
+				add_result(out, name, "throughput", rate / 1e6, "MB/s");
+			}
+
+			/* echo round trips on an idle line */
+			snprintf(name, sizeof(name), "%s pattern=%s", setups[p], pattern_names[t]);
+			if (bench_start(&bench, 115200, setups[p]) < 0)
+			{
+				bench_stop(&bench);
+				return -1;
+			}
+			ret = run_latency(&bench, t, rtt, samples);
+			bench_stop(&bench);
+			if (ret < 0)
+			{
+				fprintf(stderr, "%s: echo went missing or arrived corrupted\n", name);
+				return -1;
+			}
+			add_result(out, name, "echo_p50", rtt[samples / 2], "usec");
+			add_result(out, name, "echo_p99", rtt[samples * 99 / 100], "usec");
+			add_result(out, name, "echo_p999", rtt[samples * 999 / 1000], "usec");
+		}
+	}
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+
+	if (baseline_path != NULL)
+	{
+		compare_results(baseline_path);
+	}
+	return 0;
+}
@@ -0,0 +1,495 @@
+/*
+ * End-to-end regression checks of moxerver.
+ * Most checks start moxerver on a pseudo-terminal standing in for a serial
+ * device, drive it through the device side and a local TCP client, and
+ * verify what arrives. Checks that need a failure the kernel doesn't produce
+ * on demand run a session inside this process, which is linked with the
+ * server objects, and fail the system call themselves. Prints one "ok" or
+ * "FAIL" line per check and exits with 1 if any check failed.
+ */
+
+#include <session.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define CHECK_PORT 17600		/* first TCP port used, every run takes the next one */
+#define CHECK_OPTIONS_MAX 8		/* most -o options of one run */
+
+#define TELNET_IAC 0xFF
+
+/* a running moxerver with its tty and client */
+typedef struct
+{
+	pid_t pid;			/* moxerver process */
+	int tty;			/* pseudo-terminal master, the device side */
+	int client;			/* TCP client socket, -1 until connected */
+	int port;			/* TCP port of the server */
+} check_t;
+
+static const char *moxerver_path = "build.dir/moxerver";
+static int next_port = CHECK_PORT;
+static int fail_tty_writes;	/* > 0 makes the tty ioctls writing settings fail */
+
+/* ========================================================================== */
+
+/* Replaces ioctl() for the server objects linked in, tcsetattr() of the C
+ * library is not affected. Fails the 'T' requests writing tty settings, e.g.
+ * TCSETS2, while fail_tty_writes is set. */
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list args;
+	void *arg;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+	if (fail_tty_writes && _IOC_TYPE(request) == 'T' && _IOC_DIR(request) == _IOC_WRITE)
+	{
+		errno = EIO;
+		return -1;
+	}
+	return syscall(SYS_ioctl, fd, request, arg);
+}
+
+/* ========================================================================== */
+
+/* Writes a whole buffer, waiting while the descriptor is full. */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *) buf;
+	ssize_t ret;
+
+	while (len > 0)
+	{
+		ret = write(fd, p, len);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -errno;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Reads from the client socket with a timeout. Returns the number of bytes,
+ * 0 on timeout or a negative errno value. */
+static int read_client(check_t *check, unsigned char *buf, size_t len, int timeout_msec)
+{
+	struct pollfd pfd = { check->client, POLLIN, 0 };
+	ssize_t ret;
+
+	if (poll(&pfd, 1, timeout_msec) <= 0)
+	{
+		return 0;
+	}
+	ret = recv(check->client, buf, len, 0);
+	if (ret == 0)
+	{
+		return -ECONNRESET;
+	}
+	return (ret < 0) ? -errno : (int) ret;
+}
+
+/* Reads from the client until the given text arrived. */
+static int wait_for(check_t *check, const char *text, size_t text_len)
+{
+	unsigned char buf[1];
+	size_t matched = 0;
+
+	/* byte by byte, whatever follows the text stays in the socket */
+	while (matched < text_len)
+	{
+		if (read_client(check, buf, 1, 3000) <= 0)
+		{
+			return -ETIMEDOUT;
+		}
+		matched = (buf[0] == (unsigned char) text[matched]) ? matched + 1 :
+				  (buf[0] == (unsigned char) text[0]) ? 1 : 0;
+	}
+	return 0;
+}
+
+/* Reads escaped telnet data until the client was idle for the timeout and
+ * unescapes it. Once logged in the server sends no telnet commands, so an
+ * IAC followed by anything but another IAC is a broken escape.
+ * Returns the unescaped length or a negative errno value. */
+static int read_unescaped(check_t *check, unsigned char *buf, size_t len, int timeout_msec)
+{
+	unsigned char data[1024];
+	size_t n = 0;
+	int iac = 0;
+	int i, ret;
+
+	while ((ret = read_client(check, data, sizeof(data), timeout_msec)) > 0)
+	{
+		for (i = 0; i < ret; i++)
+		{
+			if (iac)
+			{
+				if (data[i] != TELNET_IAC)
+				{
+					return -EPROTO;
+				}
+				iac = 0;
+			}
+			else if (data[i] == TELNET_IAC)
+			{
+				iac = 1;
+				continue;
+			}
+			if (n == len)
+			{
+				return -EOVERFLOW;
+			}
+			buf[n++] = data[i];
+		}
+	}
+	if (ret < 0)
+	{
+		return ret;
+	}
+	return iac ? -EPROTO : (int) n;
+}
+
+/* ========================================================================== */
+
+/* Stops moxerver and closes the descriptors. */
+static void check_stop(check_t *check)
+{
+	if (check->client != -1)
+	{
+		close(check->client);
+	}
+	if (check->pid > 0)
+	{
+		kill(check->pid, SIGTERM);
+		waitpid(check->pid, NULL, 0);
+	}
+	if (check->tty != -1)
+	{
+		close(check->tty);
+	}
+}
+
+/* Starts moxerver with the given port options on a new pseudo-terminal,
+ * the option list ends with NULL. */
+static int check_start(check_t *check, const char **options)
+{
+	const char *argv[8 + 2 * CHECK_OPTIONS_MAX];
+	struct termios tio;
+	char port[8];
+	const char *tty_path;
+	int argc = 0;
+	int i;
+
+	memset(check, 0, sizeof(*check));
+	check->client = -1;
+	check->tty = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (check->tty == -1 || grantpt(check->tty) == -1 || unlockpt(check->tty) == -1)
+	{
+		fprintf(stderr, "error creating a pseudo-terminal: %s\n", strerror(errno));
+		return -errno;
+	}
+	tty_path = ptsname(check->tty);
+	/* the device side passes bytes unchanged */
+	tcgetattr(check->tty, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(check->tty, TCSANOW, &tio);
+
+	check->port = next_port++;
+	snprintf(port, sizeof(port), "%d", check->port);
+	argv[argc++] = moxerver_path;
+	argv[argc++] = "-p";
+	argv[argc++] = port;
+	argv[argc++] = "-t";
+	argv[argc++] = tty_path;
+	argv[argc++] = "-b";
+	argv[argc++] = "115200";
+	for (i = 0; options[i] != NULL && i < CHECK_OPTIONS_MAX; i++)
+	{
+		argv[argc++] = "-o";
+		argv[argc++] = options[i];
+	}
+	argv[argc] = NULL;
+
+	check->pid = fork();
+	if (check->pid == 0)
+	{
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		dup2(null_fd, STDERR_FILENO);
+		execv(moxerver_path, (char **) argv);
+		_exit(127);
+	}
+	if (check->pid == -1)
+	{
+		fprintf(stderr, "error starting %s: %s\n", moxerver_path, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+/* Connects the client once the server listens and logs in. */
+static int check_login(check_t *check)
+{
+	struct sockaddr_in address;
+	int i;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(check->port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (i = 0; i < 200; i++)
+	{
+		check->client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (connect(check->client, (struct sockaddr *) &address, sizeof(address)) == 0)
+		{
+			break;
+		}
+		close(check->client);
+		check->client = -1;
+		usleep(10000);
+	}
+	if (check->client == -1)
+	{
+		fprintf(stderr, "error connecting to %s on port %d\n", moxerver_path, check->port);
+		return -ECONNREFUSED;
+	}
+
+	/* log in, character mode (IAC WONT LINEMODE) ends the dialog */
+	if (wait_for(check, "> ", 2) < 0 ||
+		write_all(check->client, "check\r\n", 7) < 0 ||
+		wait_for(check, "\xff\xfc\x22", 3) < 0)
+	{
+		fprintf(stderr, "error logging in to %s on port %d\n", moxerver_path, check->port);
+		return -EPROTO;
+	}
+	return 0;
+}
+
+/* Waits until the server listens, without connecting a client. */
+static int check_listening(check_t *check)
+{
+	struct sockaddr_in address;
+	int fd, i;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(check->port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (i = 0; i < 200; i++)
+	{
+		/* a connection attempt would become a client, probe with bind() */
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1 &&
+			errno == EADDRINUSE)
+		{
+			close(fd);
+			return 0;
+		}
+		close(fd);
+		usleep(10000);
+	}
+	return -ETIMEDOUT;
+}
+
+/* ========================================================================== */
+
+/* The history replay starts the configured number of escaped bytes before the
+ * newest data. Starting between the two bytes of an escaped 0xFF would send a
+ * lone IAC that swallows the following byte, the replay has to start after
+ * the pair instead. */
+static int check_history_iac_split()
+{
+	const char *options[] = { "history=64", NULL };
+	unsigned char data[128], buf[256];
+	check_t check;
+	int ret;
+
+	/* 'A', 0xFF escaped to two bytes, then 63 bytes of text: the last 64
+	 * escaped bytes start with the second byte of the escaped 0xFF */
+	data[0] = 'A';
+	data[1] = 0xFF;
+	memset(data + 2, 'x', 63);
+	if (check_start(&check, options) < 0 || check_listening(&check) < 0 ||
+		write_all(check.tty, data, 65) < 0)
+	{
+		check_stop(&check);
+		return -1;
+	}
+	/* let the server record the data before the client connects */
+	usleep(200000);
+	if (check_login(&check) < 0)
+	{
+		check_stop(&check);
+		return -1;
+	}
+	ret = read_unescaped(&check, buf, sizeof(buf), 500);
+	check_stop(&check);
+	if (ret < 0)
+	{
+		fprintf(stderr, "history replay: %s\n", strerror(-ret));
+		return -1;
+	}
+	if (ret != 63 || memcmp(buf, data + 2, 63) != 0)
+	{
+		fprintf(stderr, "history replay: %d bytes, expected the 63 bytes after 0xFF\n", ret);
+		return -1;
+	}
+	return 0;
+}
+
+/* A reload applies a new baud rate and flow control in two steps, tcsetattr()
+ * and the termios2 ioctl for rates without a speed_t constant. When the second
+ * step fails the first one already changed the device, which has to go back
+ * to the settings the session still reports. */
+static int check_reconfigure_rollback()
+{
+	port_config_t old_config, new_config;
+	struct termios tio;
+	session_t *session;
+	reactor_t reactor;
+	char line[CONFIG_LINE_LEN];
+	int tty, ret;
+
+	tty = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (tty == -1 || grantpt(tty) == -1 || unlockpt(tty) == -1)
+	{
+		fprintf(stderr, "error creating a pseudo-terminal: %s\n", strerror(errno));
+		return -1;
+	}
+	snprintf(line, sizeof(line), "tcp=%d tty=%s baud=9600", next_port, ptsname(tty));
+	if (config_parse_line(line, &old_config) < 0)
+	{
+		close(tty);
+		return -1;
+	}
+	snprintf(line, sizeof(line), "tcp=%d tty=%s baud=250000 flow=rtscts", next_port++,
+			 ptsname(tty));
+	if (config_parse_line(line, &new_config) < 0 || reactor_init(&reactor) < 0)
+	{
+		close(tty);
+		return -1;
+	}
+	session = calloc(1, sizeof(session_t));
+	if (session == NULL || session_setup(session, &old_config, &reactor) < 0 ||
+		session->tty_dev.fd == -1)
+	{
+		fprintf(stderr, "reconfigure: error setting up the session\n");
+		ret = -1;
+		goto out;
+	}
+
+	fail_tty_writes = 1;
+	ret = session_reconfigure(session, &new_config);
+	fail_tty_writes = 0;
+	if (ret >= 0)
+	{
+		fprintf(stderr, "reconfigure: succeeded although termios2 failed\n");
+		ret = -1;
+		goto out;
+	}
+	ret = -1;
+	if (tcgetattr(session->tty_dev.fd, &tio) < 0)
+	{
+		fprintf(stderr, "reconfigure: %s\n", strerror(errno));
+	}
+	else if ((tio.c_cflag & CRTSCTS) || cfgetospeed(&tio) != B9600)
+	{
+		fprintf(stderr, "reconfigure: device left with%s RTS/CTS at speed %o, "
+				"expected 9600 baud without flow control\n",
+				(tio.c_cflag & CRTSCTS) ? "" : "out", (unsigned int) cfgetospeed(&tio));
+	}
+	else if (session->config.baud != 9600 || session->config.flow != TTY_FLOW_NONE)
+	{
+		fprintf(stderr, "reconfigure: session reports settings it doesn't run with\n");
+	}
+	else
+	{
+		ret = 0;
+	}
+
+out:
+	if (session != NULL)
+	{
+		session_close(session);
+		session_free(session);
+	}
+	reactor_close(&reactor);
+	close(tty);
+	return ret;
+}
+
+/* ========================================================================== */
+
+/* one regression check */
+typedef struct
+{
+	const char *name;
+	int (*run)();
+} check_case_t;
+
+static const check_case_t cases[] =
+{
+	{ "history replay starting inside an escaped IAC", check_history_iac_split },
+	{ "reload rolling back a half applied tty setting", check_reconfigure_rollback },
+};
+
+static void usage()
+{
+	fprintf(stdout, "Usage: moxerver_check [-m moxerver]\n");
+	fprintf(stdout, "\t-m\tmoxerver binary to check (default build.dir/moxerver)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int failed = 0;
+	int i, ret;
+
+	while ((ret = getopt(argc, argv, "m:h")) != -1)
+	{
+		switch (ret)
+		{
+			case 'm':
+				moxerver_path = optarg;
+				break;
+			case 'h':
+				usage();
+				return 0;
+			default:
+				usage();
+				return -1;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+	/* sessions run in this process only log errors */
+	log_level = LOG_LEVEL_ERROR;
+
+	for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++)
+	{
+		ret = cases[i].run();
+		fprintf(stdout, "%s: %s\n", ret == 0 ? "ok" : "FAIL", cases[i].name);
+		failed += (ret != 0);
+	}
+	return failed > 0 ? 1 : 0;
+}
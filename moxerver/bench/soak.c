@@ -0,0 +1,812 @@
+/*
+ * Port density and soak test of moxerver.
+ * Creates pseudo-terminals standing in for serial devices, writes a matching
+ * configuration file and starts the servers with moxerverctl, one process per
+ * port (or one process for all ports with -1). Every port then carries paced
+ * traffic from its tty to a TCP client while the resources of every server
+ * process and the tty to client latency of every port are sampled.
+ *
+ * The tty data is a stream of numbered records, so the clients find every
+ * record that went missing. With a slow client (-s) the receiving side reads
+ * less than the tty sends, which shows where and how data gets lost under
+ * the configured overflow policy.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define SOAK_RECORD_LEN 16		/* bytes per record, 15 digits and a newline */
+#define SOAK_TICK_MSEC 10		/* pacing interval of the tty writers */
+#define SOAK_MARKS 256			/* records in flight a port measures latency for */
+#define SOAK_SAMPLES 4096		/* latency samples kept per port and interval */
+#define SOAK_PATH_LEN 512		/* length of file paths */
+
+/* a port with its pseudo-terminal and client */
+typedef struct
+{
+	int index;					/* port number in the configuration, from 1 */
+	int tcp_port;				/* TCP port of the server */
+	int tty;					/* pseudo-terminal master, the device side */
+	int client;					/* TCP client socket */
+	pid_t pid;					/* server process */
+
+	/* tty side */
+	double credit;				/* bytes the pacing allows to write */
+	uint64_t next_record;		/* number of the next record to write */
+	char pending[SOAK_RECORD_LEN * 64];	/* records the tty did not take yet */
+	size_t pending_len;
+	uint64_t written_bytes;		/* bytes written to the tty */
+	uint64_t stalled_bytes;		/* bytes the tty did not take in time, an
+								   overrun on a real serial line */
+
+	/* client side */
+	char line[SOAK_RECORD_LEN];	/* record being received */
+	size_t line_len;
+	uint64_t expected_record;	/* number of the next record in order */
+	uint64_t received_bytes;	/* bytes received by the client */
+	uint64_t lost_records;		/* records that never arrived */
+	uint64_t broken_records;	/* records that arrived cut */
+	int closed;					/* > 0 if the server closed the connection */
+
+	/* latency of records from the tty write until the client got them */
+	struct
+	{
+		uint64_t record;		/* last record of a write */
+		uint64_t nsec;			/* time of the write */
+	} marks[SOAK_MARKS];
+	unsigned int mark_head;
+	unsigned int mark_tail;
+	uint32_t samples[SOAK_SAMPLES];	/* latencies of this interval in usec */
+	int sample_count;
+
+	/* server process resources at the last sample */
+	uint64_t cpu_ticks;
+} port_t;
+
+/* settings */
+static int port_count = 64;
+static int duration_sec = 600;
+static int interval_sec = 10;
+static double rate = 11520;		/* tty bytes per second, 115200 baud */
+static double slow_rate;		/* client bytes per second, 0 reads all */
+static int base_port = 20000;
+static int single_process;
+static const char *options[16];
+static int option_count;
+static const char *work_dir = "/tmp/moxerver_soak";
+static const char *ctl_path = "../moxerverctl/moxerverctl";
+static const char *moxerver_path = "build.dir/moxerver";
+static const char *results_path;
+
+static port_t *ports;
+static pid_t single_pid;
+static volatile sig_atomic_t stop;
+
+/* ========================================================================== */
+
+/* Returns the monotonic clock in nanoseconds. */
+static uint64_t now_nsec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Stops the soak early. */
+static void handle_signal(int signum)
+{
+	stop = 1;
+}
+
+/* Compares values for sorting. */
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Runs moxerverctl with a command for all servers. */
+static int run_ctl(const char *command)
+{
+	char cmd[SOAK_PATH_LEN * 3];
+
+	snprintf(cmd, sizeof(cmd), "MOXERVER_ROOT='%s' MOXERVER_BINARY='%s' bash '%s' %s 0 > /dev/null",
+			 work_dir, moxerver_path, ctl_path, command);
+	return system(cmd);
+}
+
+/* Reads from a socket until the given text arrived. */
+static int wait_for(int fd, const char *text, size_t text_len)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	char buf[256];
+	size_t matched = 0;
+	ssize_t len, i;
+
+	while (matched < text_len)
+	{
+		if (poll(&pfd, 1, 5000) <= 0 || (len = recv(fd, buf, sizeof(buf), 0)) <= 0)
+		{
+			return -ETIMEDOUT;
+		}
+		for (i = 0; i < len && matched < text_len; i++)
+		{
+			matched = (buf[i] == text[matched]) ? matched + 1 : (buf[i] == text[0]) ? 1 : 0;
+		}
+	}
+	return 0;
+}
+
+/* ========================================================================== */
+
+/* Creates the pseudo-terminals and the configuration file. */
+static int setup_ports()
+{
+	char path[SOAK_PATH_LEN];
+	struct termios tio;
+	FILE *cfg;
+	int i, j;
+
+	snprintf(path, sizeof(path), "mkdir -p '%s/etc' '%s/var/log' '%s/var/run'",
+			 work_dir, work_dir, work_dir);
+	if (system(path) != 0)
+	{
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/etc/moxerver.cfg", work_dir);
+	cfg = fopen(path, "w");
+	if (cfg == NULL)
+	{
+		fprintf(stderr, "error creating %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	fprintf(cfg, "# generated by moxerver_soak for %d ports\n", port_count);
+
+	for (i = 0; i < port_count; i++)
+	{
+		port_t *port = &ports[i];
+
+		port->index = i + 1;
+		port->tcp_port = base_port + i;
+		port->client = -1;
+		port->tty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+		if (port->tty == -1 || grantpt(port->tty) == -1 || unlockpt(port->tty) == -1)
+		{
+			fprintf(stderr, "error creating pseudo-terminal %d: %s\n", i + 1, strerror(errno));
+			fclose(cfg);
+			return -1;
+		}
+		tcgetattr(port->tty, &tio);
+		cfmakeraw(&tio);
+		tcsetattr(port->tty, TCSANOW, &tio);
+
+		fprintf(cfg, "tcp=%d tty=%s baud=115200", port->tcp_port, ptsname(port->tty));
+		for (j = 0; j < option_count; j++)
+		{
+			fprintf(cfg, " %s", options[j]);
+		}
+		fprintf(cfg, "\n");
+	}
+	fclose(cfg);
+	return 0;
+}
+
+/* Starts the servers, with moxerverctl or as one process serving all ports. */
+static int start_servers()
+{
+	char path[SOAK_PATH_LEN];
+	int null_fd;
+
+	if (!single_process)
+	{
+		return run_ctl("start");
+	}
+	snprintf(path, sizeof(path), "%s/etc/moxerver.cfg", work_dir);
+	single_pid = fork();
+	if (single_pid == 0)
+	{
+		null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		execl(moxerver_path, moxerver_path, "-c", path, "-l", "warning", (char *) NULL);
+		_exit(127);
+	}
+	return (single_pid == -1) ? -1 : 0;
+}
+
+/* Stops the servers and waits until they are gone. */
+static void stop_servers()
+{
+	int i, j;
+
+	if (!single_process)
+	{
+		run_ctl("stop");
+		for (i = 0; i < port_count; i++)
+		{
+			for (j = 0; j < 500 && ports[i].pid > 0 && kill(ports[i].pid, 0) == 0; j++)
+			{
+				usleep(10000);
+			}
+		}
+	}
+	else if (single_pid > 0)
+	{
+		kill(single_pid, SIGTERM);
+		waitpid(single_pid, NULL, 0);
+	}
+}
+
+/* Finds the server process of every port by its command line. */
+static void find_pids()
+{
+	char path[300], cmdline[4096];
+	struct dirent *entry;
+	DIR *proc;
+	ssize_t len;
+	char *arg;
+	int fd, tcp_port;
+
+	proc = opendir("/proc");
+	while (proc != NULL && (entry = readdir(proc)) != NULL)
+	{
+		if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+		{
+			continue;
+		}
+		snprintf(path, sizeof(path), "/proc/%s/cmdline", entry->d_name);
+		fd = open(path, O_RDONLY);
+		if (fd == -1)
+		{
+			continue;
+		}
+		len = read(fd, cmdline, sizeof(cmdline) - 1);
+		close(fd);
+		if (len <= 0 || strstr(cmdline, "moxerver") == NULL)
+		{
+			continue;
+		}
+		cmdline[len] = '\0';
+		/* arguments are separated by NUL, "-p" is followed by the port */
+		for (arg = cmdline; arg < cmdline + len; arg += strlen(arg) + 1)
+		{
+			if (strcmp(arg, "-p") == 0 && arg + 3 < cmdline + len)
+			{
+				tcp_port = atoi(arg + 3);
+				if (tcp_port >= base_port && tcp_port < base_port + port_count)
+				{
+					ports[tcp_port - base_port].pid = atoi(entry->d_name);
+				}
+			}
+		}
+	}
+	if (proc != NULL)
+	{
+		closedir(proc);
+	}
+	if (single_process)
+	{
+		for (fd = 0; fd < port_count; fd++)
+		{
+			ports[fd].pid = single_pid;
+		}
+	}
+}
+
+/* Connects the client of a port and logs in if the port speaks telnet. */
+static int connect_client(port_t *port)
+{
+	struct sockaddr_in address;
+	int opt = 1;
+	int i;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port->tcp_port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (i = 0; i < 1000; i++)
+	{
+		port->client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		/* a slow client doesn't hide the backlog in a large receive buffer */
+		if (slow_rate > 0)
+		{
+			opt = 4096;
+			setsockopt(port->client, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+			opt = 1;
+		}
+		if (connect(port->client, (struct sockaddr *) &address, sizeof(address)) == 0)
+		{
+			break;
+		}
+		close(port->client);
+		port->client = -1;
+		usleep(20000);
+	}
+	if (port->client == -1)
+	{
+		fprintf(stderr, "error connecting to port %d\n", port->tcp_port);
+		return -1;
+	}
+	setsockopt(port->client, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+	/* raw ports start forwarding right away */
+	for (i = 0; i < option_count; i++)
+	{
+		if (strcmp(options[i], "mode=raw") == 0)
+		{
+			break;
+		}
+	}
+	if (i == option_count &&
+		(wait_for(port->client, "> ", 2) < 0 ||
+		 send(port->client, "soak\r\n", 6, MSG_NOSIGNAL) != 6 ||
+		 wait_for(port->client, "\xff\xfc\x22", 3) < 0))
+	{
+		fprintf(stderr, "error logging in to port %d\n", port->tcp_port);
+		return -1;
+	}
+	fcntl(port->client, F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+/* ========================================================================== */
+
+/* Writes the records due on a port to its tty. */
+static void write_tty(port_t *port, double seconds)
+{
+	uint64_t now = now_nsec();
+	ssize_t ret;
+	size_t room;
+
+	port->credit += rate * seconds;
+	/* records the tty can't take are lost like on an overrun serial line */
+	while (port->credit >= SOAK_RECORD_LEN)
+	{
+		room = sizeof(port->pending) - port->pending_len;
+		if (room < SOAK_RECORD_LEN)
+		{
+			port->stalled_bytes += SOAK_RECORD_LEN;
+		}
+		else
+		{
+			snprintf(port->pending + port->pending_len, SOAK_RECORD_LEN + 1, "%015llu\n",
+					 (unsigned long long) port->next_record++);
+			port->pending_len += SOAK_RECORD_LEN;
+		}
+		port->credit -= SOAK_RECORD_LEN;
+	}
+	if (port->pending_len == 0)
+	{
+		return;
+	}
+
+	ret = write(port->tty, port->pending, port->pending_len);
+	if (ret <= 0)
+	{
+		return;
+	}
+	port->written_bytes += ret;
+	port->pending_len -= ret;
+	memmove(port->pending, port->pending + ret, port->pending_len);
+	/* the last complete record written marks this write */
+	if (port->mark_head - port->mark_tail < SOAK_MARKS)
+	{
+		port->marks[port->mark_head % SOAK_MARKS].record =
+			port->next_record - 1 - (port->pending_len + SOAK_RECORD_LEN - 1) / SOAK_RECORD_LEN;
+		port->marks[port->mark_head % SOAK_MARKS].nsec = now;
+		port->mark_head++;
+	}
+}
+
+/* Checks a received record and measures its latency. */
+static void receive_record(port_t *port, uint64_t now)
+{
+	uint64_t record;
+	char *end;
+
+	port->line[port->line_len - 1] = '\0';
+	record = strtoull(port->line, &end, 10);
+	if (port->line_len != SOAK_RECORD_LEN || *end != '\0')
+	{
+		port->broken_records++;
+		return;
+	}
+	if (record > port->expected_record)
+	{
+		port->lost_records += record - port->expected_record;
+	}
+	port->expected_record = record + 1;
+
+	while (port->mark_tail != port->mark_head &&
+		   port->marks[port->mark_tail % SOAK_MARKS].record <= record)
+	{
+		/* writes whose last record went missing are not measured */
+		if (port->marks[port->mark_tail % SOAK_MARKS].record == record &&
+			port->sample_count < SOAK_SAMPLES)
+		{
+			port->samples[port->sample_count++] =
+				(now - port->marks[port->mark_tail % SOAK_MARKS].nsec) / 1000;
+		}
+		port->mark_tail++;
+	}
+}
+
+/* Reads up to limit bytes from a client and checks the records. */
+static void read_client(port_t *port, size_t limit)
+{
+	char buf[65536];
+	uint64_t now;
+	ssize_t ret, i;
+
+	while (limit > 0 && !port->closed)
+	{
+		ret = recv(port->client, buf, limit < sizeof(buf) ? limit : sizeof(buf), 0);
+		if (ret <= 0)
+		{
+			if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			{
+				port->closed = 1;
+			}
+			return;
+		}
+		now = now_nsec();
+		port->received_bytes += ret;
+		limit -= ret;
+		for (i = 0; i < ret; i++)
+		{
+			if (port->line_len < SOAK_RECORD_LEN)
+			{
+				port->line[port->line_len] = buf[i];
+			}
+			port->line_len++;
+			if (buf[i] == '\n')
+			{
+				if (port->line_len > SOAK_RECORD_LEN)
+				{
+					port->broken_records++;
+				}
+				else
+				{
+					receive_record(port, now);
+				}
+				port->line_len = 0;
+			}
+		}
+	}
+}
+
+/* ========================================================================== */
+
+/* Reads a value from /proc/<pid>/status, e.g. "VmRSS:". */
+static long read_status(pid_t pid, const char *key)
+{
+	char path[64], line[256];
+	long value = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+	{
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		if (strncmp(line, key, strlen(key)) == 0)
+		{
+			value = atol(line + strlen(key));
+			break;
+		}
+	}
+	fclose(f);
+	return value;
+}
+
+/* Returns the user and system CPU time of a process in clock ticks. */
+static uint64_t read_cpu_ticks(pid_t pid)
+{
+	char path[64], buf[1024];
+	unsigned long long utime = 0, stime = 0;
+	char *p;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		return 0;
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+	{
+		return 0;
+	}
+	buf[len] = '\0';
+	/* the fields after the command name, utime and stime are the 12th and 13th */
+	p = strrchr(buf, ')');
+	if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+							&utime, &stime) != 2)
+	{
+		return 0;
+	}
+	return utime + stime;
+}
+
+/* Returns the number of open file descriptors of a process. */
+static int count_fds(pid_t pid)
+{
+	char path[64];
+	struct dirent *entry;
+	DIR *dir;
+	int count = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int) pid);
+	dir = opendir(path);
+	if (dir == NULL)
+	{
+		return -1;
+	}
+	while ((entry = readdir(dir)) != NULL)
+	{
+		count += (entry->d_name[0] != '.');
+	}
+	closedir(dir);
+	return count;
+}
+
+/* Samples all ports, one line per port goes to the results file and a summary
+ * to stdout. */
+static void sample(FILE *out, double elapsed, double interval)
+{
+	long ticks_per_sec = sysconf(_SC_CLK_TCK);
+	long rss, threads, rss_total = 0, threads_total = 0;
+	double cpu, cpu_total = 0;
+	uint32_t p50, p99, max, p99_worst = 0, max_worst = 0;
+	uint64_t ticks, received = 0, lost = 0, stalled = 0;
+	int fds, fds_total = 0, alive = 0, closed = 0;
+	int i;
+
+	for (i = 0; i < port_count; i++)
+	{
+		port_t *port = &ports[i];
+		int owner = !single_process || i == 0;
+
+		/* one process serving all ports is counted once */
+		rss = owner ? read_status(port->pid, "VmRSS:") : 0;
+		threads = owner ? read_status(port->pid, "Threads:") : 0;
+		fds = owner ? count_fds(port->pid) : 0;
+		ticks = owner ? read_cpu_ticks(port->pid) : port->cpu_ticks;
+		cpu = (ticks - port->cpu_ticks) * 100.0 / ticks_per_sec / interval;
+		port->cpu_ticks = ticks;
+
+		p50 = p99 = max = 0;
+		if (port->sample_count > 0)
+		{
+			qsort(port->samples, port->sample_count, sizeof(uint32_t), compare_u32);
+			p50 = port->samples[port->sample_count / 2];
+			p99 = port->samples[port->sample_count * 99 / 100];
+			max = port->samples[port->sample_count - 1];
+		}
+		fprintf(out, "%.0f\t%d\t%d\t%ld\t%.2f\t%ld\t%d\t%llu\t%llu\t%llu\t%llu\t%llu\t%u\t%u\t%u\n",
+				elapsed, port->tcp_port, (int) port->pid, rss, cpu, threads, fds,
+				(unsigned long long) port->written_bytes,
+				(unsigned long long) port->received_bytes,
+				(unsigned long long) (port->lost_records * SOAK_RECORD_LEN),
+				(unsigned long long) port->broken_records,
+				(unsigned long long) port->stalled_bytes, p50, p99, max);
+		port->sample_count = 0;
+
+		alive += (rss >= 0 || !owner);
+		closed += port->closed;
+		rss_total += (rss > 0) ? rss : 0;
+		threads_total += (threads > 0) ? threads : 0;
+		fds_total += (fds > 0) ? fds : 0;
+		cpu_total += cpu;
+		received += port->received_bytes;
+		lost += port->lost_records * SOAK_RECORD_LEN;
+		stalled += port->stalled_bytes;
+		p99_worst = (p99 > p99_worst) ? p99 : p99_worst;
+		max_worst = (max > max_worst) ? max : max_worst;
+	}
+	fflush(out);
+	printf("%5.0fs alive %d/%d closed %d rss %ldk cpu %.1f%% threads %ld fds %d "
+		   "received %llu lost %llu stalled %llu p99 %uus max %uus\n",
+		   elapsed, alive, port_count, closed, rss_total, cpu_total, threads_total, fds_total,
+		   (unsigned long long) received, (unsigned long long) lost,
+		   (unsigned long long) stalled, p99_worst, max_worst);
+	fflush(stdout);
+}
+
+/* ========================================================================== */
+
+/* Prints the help message. */
+static void usage()
+{
+	fprintf(stdout, "Usage: moxerver_soak [-n ports] [-t seconds] [-i seconds] [-r bytes/s] [-s bytes/s]\n"
+					"                     [-o key=value]... [-1] [-P tcp_port] [-w dir] [-c moxerverctl]\n"
+					"                     [-m moxerver] [-O results]\n");
+	fprintf(stdout, "\t-n\tnumber of ports (default 64)\n");
+	fprintf(stdout, "\t-t\tsoak duration in seconds (default 600)\n");
+	fprintf(stdout, "\t-i\tsampling interval in seconds (default 10)\n");
+	fprintf(stdout, "\t-r\ttty bytes per second and port (default 11520, 115200 baud)\n");
+	fprintf(stdout, "\t-s\tslow client mode, client bytes read per second and port\n");
+	fprintf(stdout, "\t-o\tport option added to every configuration line, e.g. overflow=drop-oldest\n");
+	fprintf(stdout, "\t-1\tone moxerver process serving all ports instead of moxerverctl\n");
+	fprintf(stdout, "\t-P\tfirst TCP port (default 20000)\n");
+	fprintf(stdout, "\t-w\tdirectory for the configuration, logs and control sockets\n");
+	fprintf(stdout, "\t-c\tmoxerverctl script (default ../moxerverctl/moxerverctl)\n");
+	fprintf(stdout, "\t-m\tmoxerver binary (default build.dir/moxerver)\n");
+	fprintf(stdout, "\t-O\tfile receiving one line per port and sample\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event events[256];
+	struct itimerspec tick = { { 0, SOAK_TICK_MSEC * 1000000L }, { 0, SOAK_TICK_MSEC * 1000000L } };
+	struct epoll_event ev;
+	struct rlimit limit;
+	static char binary[SOAK_PATH_LEN];
+	uint64_t start, last_tick, last_sample, now, expirations;
+	FILE *out = stdout;
+	int epoll_fd, timer_fd;
+	int i, n, ret;
+
+	while ((ret = getopt(argc, argv, "n:t:i:r:s:o:1P:w:c:m:O:h")) != -1)
+	{
+		switch (ret)
+		{
+			case 'n': port_count = atoi(optarg); break;
+			case 't': duration_sec = atoi(optarg); break;
+			case 'i': interval_sec = atoi(optarg); break;
+			case 'r': rate = atof(optarg); break;
+			case 's': slow_rate = atof(optarg); break;
+			case 'o':
+				if (option_count < (int) (sizeof(options) / sizeof(options[0])))
+				{
+					options[option_count++] = optarg;
+				}
+				break;
+			case '1': single_process = 1; break;
+			case 'P': base_port = atoi(optarg); break;
+			case 'w': work_dir = optarg; break;
+			case 'c': ctl_path = optarg; break;
+			case 'm': moxerver_path = optarg; break;
+			case 'O': results_path = optarg; break;
+			case 'h': usage(); return 0;
+			default: usage(); return -1;
+		}
+	}
+	if (port_count <= 0 || interval_sec <= 0 || rate < 0)
+	{
+		usage();
+		return -1;
+	}
+	/* moxerverctl finds the servers by their command line, use the full path */
+	if (realpath(moxerver_path, binary) == NULL)
+	{
+		fprintf(stderr, "error finding %s: %s\n", moxerver_path, strerror(errno));
+		return -1;
+	}
+	moxerver_path = binary;
+	if (results_path != NULL)
+	{
+		out = fopen(results_path, "w");
+		if (out == NULL)
+		{
+			fprintf(stderr, "error opening %s: %s\n", results_path, strerror(errno));
+			return -1;
+		}
+	}
+
+	/* every port takes a tty and a client socket here */
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	ports = calloc(port_count, sizeof(port_t));
+	if (ports == NULL || setup_ports() < 0 || start_servers() != 0)
+	{
+		fprintf(stderr, "error starting %d servers\n", port_count);
+		stop_servers();
+		return -1;
+	}
+	for (i = 0; i < port_count && !stop; i++)
+	{
+		if (connect_client(&ports[i]) < 0)
+		{
+			stop_servers();
+			return -1;
+		}
+	}
+	find_pids();
+	printf("%d ports up, %s, %.0f bytes/s per port%s\n", port_count,
+		   single_process ? "one process" : "one process per port", rate,
+		   slow_rate > 0 ? ", slow clients" : "");
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	timerfd_settime(timer_fd, 0, &tick, NULL);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+	/* slow clients are read on the tick, the others as data arrives */
+	for (i = 0; i < port_count && slow_rate <= 0; i++)
+	{
+		ev.data.ptr = &ports[i];
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ports[i].client, &ev);
+	}
+
+	fprintf(out, "# time\tport\tpid\trss_kb\tcpu_pct\tthreads\tfds\twritten\treceived\t"
+				 "lost_bytes\tbroken_records\tstalled_bytes\tp50_usec\tp99_usec\tmax_usec\n");
+	start = last_tick = last_sample = now_nsec();
+	while (!stop && (now = now_nsec()) - start < (uint64_t) duration_sec * 1000000000ULL)
+	{
+		n = epoll_wait(epoll_fd, events, 256, 1000);
+		for (i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr != NULL)
+			{
+				read_client((port_t *) events[i].data.ptr, SIZE_MAX);
+				continue;
+			}
+			if (read(timer_fd, &expirations, sizeof(expirations)) <= 0)
+			{
+				continue;
+			}
+			now = now_nsec();
+			for (ret = 0; ret < port_count; ret++)
+			{
+				write_tty(&ports[ret], (now - last_tick) / 1e9);
+				if (slow_rate > 0)
+				{
+					read_client(&ports[ret], (size_t) (slow_rate * (now - last_tick) / 1e9));
+				}
+			}
+			last_tick = now;
+		}
+		now = now_nsec();
+		if (now - last_sample >= (uint64_t) interval_sec * 1000000000ULL)
+		{
+			sample(out, (now - start) / 1e9, (now - last_sample) / 1e9);
+			last_sample = now;
+		}
+	}
+
+	now = now_nsec();
+	if (now - last_sample >= 1000000000ULL)
+	{
+		sample(out, (now - start) / 1e9, (now - last_sample) / 1e9);
+	}
+	stop_servers();
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+	return 0;
+}
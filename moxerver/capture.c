@@ -0,0 +1,383 @@
+#include <capture.h>
+#include <tuning.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* The writer thread shared by all captures. */
+static struct
+{
+	pthread_mutex_t lock;	/* protects the capture list */
+	pthread_t thread;		/* writer thread */
+	int wake_fd;			/* eventfd waking the writer up early */
+	int running;			/* > 0 while the writer thread runs */
+	capture_t **captures;	/* registered captures */
+	int count;				/* number of registered captures */
+} writer = { PTHREAD_MUTEX_INITIALIZER, 0, -1, 0, NULL, 0 };
+
+/* Opens the current capture file, new data is appended. */
+static int capture_open_file(capture_t *capture)
+{
+	struct stat st;
+
+	capture->file_size = 0;
+	capture->fd = open(capture->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+	if (capture->fd == -1)
+	{
+		LOG("error opening capture file %s: %s", capture->path, strerror(errno));
+		return -errno;
+	}
+	capture->file_size = (fstat(capture->fd, &st) == 0) ? (size_t) st.st_size : 0;
+	capture->opened = time(NULL);
+	return 0;
+}
+
+/* Shifts the rotated files by one, <path> becomes <path>.1 and the oldest
+ * file is removed, then starts a new capture file. */
+static void capture_rotate(capture_t *capture)
+{
+	char from[CONFIG_PATH_LEN + 16];
+	char to[CONFIG_PATH_LEN + 16];
+	int i;
+
+	if (capture->fd != -1)
+	{
+		close(capture->fd);
+		capture->fd = -1;
+	}
+	if (capture->keep == 0)
+	{
+		unlink(capture->path);
+	}
+	for (i = capture->keep - 1; i >= 0; i--)
+	{
+		if (i == 0)
+		{
+			snprintf(from, sizeof(from), "%s", capture->path);
+		}
+		else
+		{
+			snprintf(from, sizeof(from), "%s.%d", capture->path, i);
+		}
+		snprintf(to, sizeof(to), "%s.%d", capture->path, i + 1);
+		/* missing files are expected until enough rotations happened */
+		if (rename(from, to) == -1 && errno != ENOENT)
+		{
+			LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		}
+	}
+	capture_open_file(capture);
+}
+
+/* Writes the queued data of one capture, runs in the writer thread. */
+static void capture_flush(capture_t *capture, time_t now)
+{
+	uint64_t head = atomic_load_explicit(&capture->head, memory_order_acquire);
+	uint64_t tail = atomic_load_explicit(&capture->tail, memory_order_relaxed);
+
+	/* time based rotation doesn't start empty files */
+	if (capture->rotate_sec > 0 && capture->file_size > 0 &&
+		now - capture->opened >= capture->rotate_sec)
+	{
+		capture_rotate(capture);
+	}
+
+	while (tail != head)
+	{
+		struct iovec iov[2];
+		size_t len = head - tail;
+		size_t offset = tail % capture->size;
+		size_t chunk = capture->size - offset;
+		ssize_t ret;
+		int n = 1;
+
+		/* size based rotation splits the data at the size limit */
+		if (capture->max_size > 0)
+		{
+			if (capture->file_size >= capture->max_size)
+			{
+				capture_rotate(capture);
+			}
+			if (len > capture->max_size - capture->file_size)
+			{
+				len = capture->max_size - capture->file_size;
+			}
+		}
+
+		/* write straight from the queue, the wrapped part in the same call */
+		iov[0].iov_base = capture->data + offset;
+		iov[0].iov_len = (chunk < len) ? chunk : len;
+		if (chunk < len)
+		{
+			iov[1].iov_base = capture->data;
+			iov[1].iov_len = len - chunk;
+			n = 2;
+		}
+
+		ret = (capture->fd != -1) ? writev(capture->fd, iov, n) : -1;
+		if (ret <= 0)
+		{
+			if (ret == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			/* don't let a broken disk fill the queue, retry with the next file */
+			if (capture->fd != -1)
+			{
+				LOG("error writing capture file %s: %s", capture->path, strerror(errno));
+				close(capture->fd);
+				capture->fd = -1;
+			}
+			atomic_fetch_add_explicit(&capture->dropped, len, memory_order_relaxed);
+			ret = len;
+		}
+		else
+		{
+			capture->file_size += ret;
+			atomic_fetch_add_explicit(&capture->written, ret, memory_order_relaxed);
+		}
+		tail += ret;
+		atomic_store_explicit(&capture->tail, tail, memory_order_release);
+	}
+
+	/* a file that failed is opened again, at most once per second */
+	if (capture->fd == -1 && capture->opened != now)
+	{
+		capture->opened = now;
+		capture_open_file(capture);
+	}
+}
+
+/* Thread function writing the queued data of all captures. */
+static void* capture_writer_thread(void *args)
+{
+	struct pollfd pfd;
+	uint64_t value;
+	int i;
+
+	/* the thread keeps its own wakeup descriptor, a stopped writer can be
+	 * followed by a new one before this thread noticed */
+	pfd.fd = (int) (intptr_t) args;
+	pfd.events = POLLIN;
+	for (;;)
+	{
+		/* wake up periodically or early when a queue fills up */
+		if (poll(&pfd, 1, CAPTURE_FLUSH_MSEC) > 0)
+		{
+			if (read(pfd.fd, &value, sizeof(value)) != sizeof(value))
+			{
+				LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+			}
+		}
+
+		pthread_mutex_lock(&writer.lock);
+		if (!writer.running || writer.wake_fd != pfd.fd)
+		{
+			pthread_mutex_unlock(&writer.lock);
+			break;
+		}
+		for (i = 0; i < writer.count; i++)
+		{
+			atomic_store_explicit(&writer.captures[i]->kicked, 0, memory_order_relaxed);
+			capture_flush(writer.captures[i], time(NULL));
+		}
+		pthread_mutex_unlock(&writer.lock);
+	}
+	return (void *) 0;
+}
+
+/* Starts the writer thread, the caller holds the writer lock. */
+static int capture_start_writer()
+{
+	pthread_attr_t attr;
+	sigset_t all, mask;
+	int ret;
+
+	/* the first capture may be opened by a pinned realtime event loop, disk
+	 * I/O must not take its core or priority */
+	ret = tuning_helper_attr(&attr);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	writer.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (writer.wake_fd == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		pthread_attr_destroy(&attr);
+		return -errno;
+	}
+	writer.running = 1;
+	/* signals are left to the main program, the thread starts with all blocked */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &mask);
+	ret = pthread_create(&writer.thread, &attr, capture_writer_thread,
+						 (void *) (intptr_t) writer.wake_fd);
+	pthread_sigmask(SIG_SETMASK, &mask, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret != 0)
+	{
+		LOG("problem with starting the capture writer");
+		writer.running = 0;
+		close(writer.wake_fd);
+		writer.wake_fd = -1;
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+/* Wakes the writer thread up. */
+static void capture_wake_writer(int wake_fd)
+{
+	uint64_t value = 1;
+
+	if (write(wake_fd, &value, sizeof(value)) != sizeof(value))
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+	}
+}
+
+int capture_open(capture_t *capture, const port_config_t *config)
+{
+	capture_t **captures;
+	int ret;
+
+	memset(capture, 0, sizeof(*capture));
+	strcpy(capture->path, config->capture);
+	capture->max_size = config->capture_size;
+	capture->rotate_sec = config->capture_rotate;
+	capture->keep = config->capture_keep;
+	capture->fd = -1;
+
+	capture->data = malloc(config->capture_queue);
+	if (capture->data == NULL)
+	{
+		LOG_ERROR("[@%d] out of memory", __LINE__);
+		return -ENOMEM;
+	}
+	capture->size = config->capture_queue;
+
+	ret = capture_open_file(capture);
+	if (ret < 0)
+	{
+		free(capture->data);
+		capture->data = NULL;
+		return ret;
+	}
+
+	pthread_mutex_lock(&writer.lock);
+	captures = realloc(writer.captures, (writer.count + 1) * sizeof(capture_t *));
+	if (captures == NULL)
+	{
+		LOG_ERROR("[@%d] out of memory", __LINE__);
+		ret = -ENOMEM;
+	}
+	else
+	{
+		writer.captures = captures;
+		writer.captures[writer.count++] = capture;
+		ret = writer.running ? 0 : capture_start_writer();
+		if (ret < 0)
+		{
+			writer.count--;
+		}
+	}
+	pthread_mutex_unlock(&writer.lock);
+
+	if (ret < 0)
+	{
+		close(capture->fd);
+		free(capture->data);
+		capture->data = NULL;
+	}
+	return ret;
+}
+
+void capture_write(capture_t *capture, const char *databuf, size_t datalen)
+{
+	uint64_t head = atomic_load_explicit(&capture->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&capture->tail, memory_order_acquire);
+	size_t space = capture->size - (size_t) (head - tail);
+	size_t offset, chunk;
+
+	if (datalen > space)
+	{
+		atomic_fetch_add_explicit(&capture->dropped, datalen - space, memory_order_relaxed);
+		datalen = space;
+	}
+	if (datalen > 0)
+	{
+		offset = head % capture->size;
+		chunk = capture->size - offset;
+		if (chunk > datalen)
+		{
+			chunk = datalen;
+		}
+		memcpy(capture->data + offset, databuf, chunk);
+		memcpy(capture->data, databuf + chunk, datalen - chunk);
+		atomic_store_explicit(&capture->head, head + datalen, memory_order_release);
+	}
+
+	/* a half full queue is written without waiting for the next period */
+	if (head + datalen - tail >= capture->size / 2 &&
+		!atomic_exchange_explicit(&capture->kicked, 1, memory_order_relaxed))
+	{
+		capture_wake_writer(writer.wake_fd);
+	}
+}
+
+void capture_close(capture_t *capture)
+{
+	pthread_t thread;
+	int wake_fd = -1;
+	int i;
+
+	if (capture->data == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&writer.lock);
+	/* the event loop doesn't queue anything anymore, write the rest */
+	capture_flush(capture, time(NULL));
+	for (i = 0; i < writer.count; i++)
+	{
+		if (writer.captures[i] == capture)
+		{
+			writer.captures[i] = writer.captures[--writer.count];
+			break;
+		}
+	}
+	if (writer.count == 0 && writer.running)
+	{
+		writer.running = 0;
+		thread = writer.thread;
+		wake_fd = writer.wake_fd;
+		writer.wake_fd = -1;
+		free(writer.captures);
+		writer.captures = NULL;
+	}
+	pthread_mutex_unlock(&writer.lock);
+
+	/* the last capture stops the writer thread */
+	if (wake_fd != -1)
+	{
+		capture_wake_writer(wake_fd);
+		pthread_join(thread, NULL);
+		close(wake_fd);
+	}
+
+	LOG("capture %s: %llu bytes written, %llu bytes dropped", capture->path,
+		(unsigned long long) atomic_load(&capture->written),
+		(unsigned long long) atomic_load(&capture->dropped));
+	if (capture->fd != -1)
+	{
+		close(capture->fd);
+		capture->fd = -1;
+	}
+	free(capture->data);
+	capture->data = NULL;
+}
@@ -0,0 +1,60 @@
+/* Handles capturing of the tty data stream into rotating files. */
+
+#pragma once
+
+#include <common.h>
+#include <config.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define CAPTURE_FLUSH_MSEC 200 /* longest time captured data waits for the writer */
+
+/*
+ * The event loop only copies tty data into a per-port queue. A single writer
+ * thread shared by all ports empties the queues with large writes, so a slow
+ * disk never delays the event loop. The queue has exactly one producer and one
+ * consumer, the positions are the only shared state. Data that doesn't fit in
+ * a full queue is dropped and counted.
+ */
+typedef struct
+{
+	char path[CONFIG_PATH_LEN];	/* capture file path */
+	size_t max_size;			/* rotate when the file reaches this size, 0 if unused */
+	long rotate_sec;			/* rotate after this many seconds, 0 if unused */
+	int keep;					/* number of rotated files kept */
+
+	char *data;					/* queue storage */
+	size_t size;				/* queue capacity in bytes */
+	_Atomic uint64_t head;		/* queue position written by the event loop */
+	_Atomic uint64_t tail;		/* queue position written by the writer thread */
+	atomic_int kicked;			/* > 0 once the writer was woken up early */
+
+	int fd;						/* capture file, -1 if not open */
+	size_t file_size;			/* bytes in the current file */
+	time_t opened;				/* time the current file was started */
+
+	_Atomic uint64_t written;	/* bytes written to capture files */
+	_Atomic uint64_t dropped;	/* bytes lost to a full queue or write errors */
+} capture_t;
+
+/**
+ * Opens the capture file of a port and registers the port with the writer
+ * thread, which is started with the first capture.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred
+ */
+int capture_open(capture_t *capture, const port_config_t *config);
+
+/**
+ * Queues tty data for the capture file, never blocks. Must only be called by
+ * the thread running the port's session.
+ */
+void capture_write(capture_t *capture, const char *databuf, size_t datalen);
+
+/**
+ * Writes the remaining queued data, closes the capture file and unregisters the
+ * port. The writer thread stops with the last capture.
+ */
+void capture_close(capture_t *capture);
@@ -1,6 +1,21 @@
 #include <client.h>
 #include <telnet.h>
 
+int client_init(client_t *client, size_t data_len)
+{
+	memset(client, 0, sizeof(*client));
+	client->socket = -1;
+	client->telnet = 1;
+	telnet_parser_init(&client->telnet_parser);
+	client->data = malloc(data_len);
+	if (client->data == NULL)
+	{
+		return -ENOMEM;
+	}
+	client->data_len = data_len;
+	return 0;
+}
+
 void client_close(client_t *client)
 {
 	char timestamp[TIMESTAMP_LEN];
@@ -11,20 +26,75 @@ void client_close(client_t *client)
 		close(client->socket);
 	}
 	client->socket = -1;
+	free(client->data);
+	client->data = NULL;
 
 	time2string(time(NULL), timestamp);
 	LOG("socket closed for client %s @ %s", client->ip_string, timestamp);
 }
 
+int client_timestamp_arrivals(client_t *client)
+{
+	int opt = 1;
+
+	if (setsockopt(client->socket, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt)) == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	client->timestamps = 1;
+	return 0;
+}
+
+/* Receives data together with the time the kernel got it. */
+static int client_recv_stamped(client_t *client)
+{
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+	struct iovec iov = { client->data, client->data_len - 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct timespec ts;
+	int len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	len = recvmsg(client->socket, &msg, 0);
+
+	client->arrival = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msg); len > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			client->arrival = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		}
+	}
+	return len;
+}
+
 int client_read(client_t *client)
 {
 	int len;
 	
 	/* read data from the client */
-	len = recv(client->socket, client->data, sizeof(client->data)-1, 0);
+	if (client->timestamps)
+	{
+		len = client_recv_stamped(client);
+	}
+	else
+	{
+		len = recv(client->socket, client->data, client->data_len - 1, 0);
+	}
 	if (len == -1)
 	{
-		LOG("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		/* a client in the login dialog may have nothing to read yet */
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		}
 		return -errno;
 	}
 	/* a disconnected client socket is ready for reading but read returns 0 */
@@ -34,21 +104,15 @@ int client_read(client_t *client)
 		return -ENODATA;
 	}
 	
-	//TODO let's print received bytes during development phase...
-	if (debug_messages)
-	{
-		int i;
-		for(i = 0; i < len; i++)
-		{
-			LOG("client %s <- %u '%c'",
-				client->ip_string,
-				(unsigned char) client->data[i],
-				(unsigned char) client->data[i]);
-		}	
-	}
+	LOG_DUMP(client->data, len, "client %s <- %d bytes", client->ip_string, len);
 	
 	/* handle special telnet characters coming from the client */
-	telnet_filter_client_read(client->data, &len);
+	if (client->telnet)
+	{
+		telnet_filter_client_read(&client->telnet_parser, client->data, &len);
+	}
+	/* the buffer keeps one byte for terminating the data as a string */
+	client->data[len] = '\0';
 	
 	/* grab current time and store it as client's last activity */
 	client->last_active = time(NULL);
@@ -60,105 +124,147 @@ int client_write(client_t *client, char *databuf, int datalen)
 {
 	int len;
 	
-	/* handle special telnet characters to display them correctly on client */
-	//telnet_filter_client_write(databuf, &datalen);
-	
-	//TODO let's print received bytes during development phase...
-	if (debug_messages)
-	{
-		int i;
-		for(i = 0; i < datalen; i++)
-		{
-			LOG("client %s -> %u '%c'",
-				client->ip_string,
-				(unsigned char) databuf[i],
-				(unsigned char) databuf[i]);
-		}	
-	}
-	
 	/* send data to the client */
 	len = send(client->socket, databuf, datalen, 0);
 	if (len == -1)
 	{
-		LOG("[@%d] error %d: %s", __LINE__,	errno, strerror(errno));
+		/* a full socket buffer is expected with slow clients */
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			LOG_ERROR("[@%d] error %d: %s", __LINE__,	errno, strerror(errno));
+		}
 		return -errno;
 	}
+	LOG_DUMP(databuf, len, "client %s -> %d bytes", client->ip_string, len);
 	
 	return len;
 }
 
-int client_wait_line(client_t *client)
+int client_writev(client_t *client, const struct iovec *iov, int iovcnt)
 {
-	fd_set read_fds;
-	struct timeval tv;
-	
-	client->data[0] = '\0';
-	/* loop waiting for client input */
-	while (client->data[0] == '\0')
-	{
-		/* setup select() parameters */
-		tv.tv_sec = 15; /* 15 second timeout */
-		tv.tv_usec = 0;
-		FD_ZERO(&read_fds);
-		FD_SET(client->socket, &read_fds);
-		/* send prompt character to the client */
-		client_write(client, "> ", 2);
-		/* block until input arrives */
-		if (select((client->socket)+1, &read_fds, NULL, NULL, &tv) <= 0)
+	ssize_t len;
+	size_t sent;
+	int i;
+
+	/* send all buffers to the client at once */
+	len = writev(client->socket, iov, iovcnt);
+	if (len == -1)
+	{
+		/* a full socket buffer is expected with slow clients */
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		}
+		return -errno;
+	}
+
+	/* trace what was sent, one dump per buffer */
+	for (i = 0, sent = 0; i < iovcnt && sent < (size_t) len; i++)
+	{
+		size_t part = (iov[i].iov_len < len - sent) ? iov[i].iov_len : len - sent;
+		LOG_DUMP(iov[i].iov_base, (int) part, "client %s -> %zu bytes", client->ip_string, part);
+		sent += part;
+	}
+
+	return (int) len;
+}
+
+/* Checks if a byte ends a line, telnet clients send CR LF or CR NUL. */
+static int client_is_line_end(char c)
+{
+	return c == '\r' || c == '\n' || c == '\0';
+}
+
+/* Looks for a complete line at the start of the line buffer, the input after
+ * it stays in the buffer. Returns 1 if a line was found, 0 otherwise. */
+static int client_find_line(client_t *client, char *line, size_t *line_len, size_t line_size)
+{
+	size_t i;
+
+	/* we don't want empty lines, ask again */
+	while (*line_len > 0 && client_is_line_end(line[0]))
+	{
+		if (line[0] == '\n')
 		{
-			return -1;
+			client_write(client, "> ", 2);
 		}
-		if (FD_ISSET(client->socket, &read_fds))
+		memmove(line, line + 1, --(*line_len));
+	}
+
+	for (i = 0; i < *line_len; i++)
+	{
+		if (client_is_line_end(line[i]))
 		{
-			/* read client input */
-			if (client_read(client) == -1)
-			{
-				return -1;
-			}
-			/* we don't want empty data so ignore data starting with \r or \n */
-			if ( (client->data[0] == '\r') || (client->data[0] == '\n') )
-			{
-				client->data[0] = '\0';
-			}
+			line[i] = '\0';
+			return 1;
 		}
 	}
+	/* a line filling the whole buffer ends there */
+	line[*line_len] = '\0';
+	return (*line_len == line_size - 1) ? 1 : 0;
+}
+
+int client_read_line(client_t *client, char *line, size_t *line_len, size_t line_size)
+{
+	size_t space = line_size - 1 - *line_len;
+	int len;
+
+	len = client_read(client);
+	if (len == -EAGAIN || len == -EWOULDBLOCK)
+	{
+		return 0;
+	}
+	if (len < 0)
+	{
+		return -1;
+	}
 
-	return 0;
+	/* input that doesn't fit into the line buffer is discarded */
+	if ((size_t) len > space)
+	{
+		len = (int) space;
+	}
+	memcpy(line + *line_len, client->data, len);
+	*line_len += len;
+
+	return client_find_line(client, line, line_len, line_size);
 }
 
-int client_ask_username(client_t *client)
+int client_next_line(client_t *client, char *line, size_t *line_len, size_t line_size)
+{
+	size_t used = strlen(line);
+
+	/* drop the answered line and its line end, if it had one */
+	if (used < *line_len)
+	{
+		used++;
+	}
+	*line_len -= used;
+	memmove(line, line + used, *line_len);
+
+	return client_find_line(client, line, line_len, line_size);
+}
+
+void client_ask_username(client_t *client)
 {
-	int i;
 	char msg[BUFFER_LEN];
-	
+
 	/* show username request to the client */
 	snprintf(msg, BUFFER_LEN,
 			 "\nPlease provide a username to identify yourself to "
-			 "other users (max %d characters):\n", USERNAME_LEN);
+			 "other users (max %d characters):\n> ", USERNAME_LEN - 1);
 	client_write(client, msg, strlen(msg));
-	
-	/* wait for client input */
-	if (client_wait_line(client) != 0)
-	{
-		return -1;
-	}
-	
-	/* save received data as client username */
-	for (i = 0; i < USERNAME_LEN; i++)
-	{
-		if ( (client->data[i] == '\r') || (client->data[i] == '\n') )
-		{
-			/* don't include \r or \n in the username */
-			client->username[i] = '\0';
-			break;
-		}
-		client->username[i] = client->data[i];
-	}
-	
+}
+
+void client_set_username(client_t *client, const char *line)
+{
+	char msg[BUFFER_LEN];
+
+	/* save received line as client username, the line has no \r or \n */
+	snprintf(client->username, USERNAME_LEN, "%s", line);
+
 	/* show welcome message to client */
 	snprintf(msg, BUFFER_LEN,
 			 "\nWelcome %s!\n\n", client->username);
 	client_write(client, msg, strlen(msg));
-	
-	return 0;
 }
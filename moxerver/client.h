@@ -3,6 +3,9 @@
 #pragma once
 
 #include <common.h>
+#include <telnet.h>
+#include <sys/uio.h>
+#include <stdint.h>
 #include <netinet/in.h>
 
 #define USERNAME_LEN 32
@@ -14,11 +17,27 @@ typedef struct
 	char ip_string[INET_ADDRSTRLEN]; /* client IP address as a string */
 	time_t last_active;				 /* time of client's last activity */
 	char username[USERNAME_LEN];	 /* username for human identification */
-	char data[BUFFER_LEN];			 /* buffer for received data */
+	char *data;						 /* buffer for received data */
+	size_t data_len;				 /* length of the data buffer */
+	uint64_t output_pos;			 /* next byte to send from the session output */
+	int telnet;						 /* > 0 if telnet commands are filtered */
+	int timestamps;					 /* > 0 if reads record when the data arrived */
+	uint64_t arrival;				 /* CLOCK_REALTIME nsec the last read data reached
+										the socket, 0 if unknown */
+	telnet_parser_t telnet_parser;	 /* telnet command state between reads */
 } client_t;
 
 /**
- * Closes a client connection.
+ * Prepares a client structure and allocates its data buffer.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative ENOMEM value (-ENOMEM) if the buffer can't be allocated
+ */
+int client_init(client_t *client, size_t data_len);
+
+/**
+ * Closes a client connection and releases the data buffer.
  */
 void client_close(client_t *client);
 
@@ -33,31 +52,70 @@ void client_close(client_t *client);
  */
 int client_read(client_t *client);
 
+/**
+ * Makes client_read() record the time the kernel received the data, to
+ * measure how long it waited for the event loop.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred
+ */
+int client_timestamp_arrivals(client_t *client);
+
 /**
  * Sends data from a buffer to the client.
  *
  * Returns:
- * - number of sent bytes on success,
- * - negative errno value set by an error while sending
+ * - number of sent bytes on success, can be less than requested
+ * - negative errno value set by an error while sending, -EAGAIN if the
+ *   client socket can't take more data right now
  */
 int client_write(client_t *client, char *databuf, int datalen);
 
 /**
- * Waits for input from the client in "line mode" (client sends a whole line of
- * characters). The function blocks until input arrives.
+ * Sends data from several buffers to the client with a single system call.
  *
  * Returns:
- * - 0 on success
- * - negative value if an error occurred
+ * - number of sent bytes on success, can be less than requested
+ * - negative errno value set by an error while sending, -EAGAIN if the
+ *   client socket can't take more data right now
  */
-int client_wait_line(client_t *client);
+int client_writev(client_t *client, const struct iovec *iov, int iovcnt);
 
 /**
- * Asks the client to provide a username.
- * Blocks until a string is provided.
+ * Reads client input into a line buffer without blocking, for answers to
+ * prompts. Empty lines are ignored and answered with a new prompt. A line
+ * longer than the buffer ends at the buffer size. Input following a complete
+ * line, e.g. the next answer typed ahead, stays in the buffer behind it until
+ * client_next_line() is called.
  *
  * Returns:
- * - 0 on success
- * - negative value if an error occurred
+ * - 1 if a line is complete, it starts the buffer and is terminated without
+ *   CR or LF
+ * - 0 if more input is needed
+ * - negative value if the client has disconnected or an error occurred
+ */
+int client_read_line(client_t *client, char *line, size_t *line_len, size_t line_size);
+
+/**
+ * Drops the line returned by client_read_line() or client_next_line() from
+ * the line buffer and looks for the next one in the input received after it,
+ * without reading.
+ *
+ * Returns:
+ * - 1 if the next line is complete, see client_read_line()
+ * - 0 if more input is needed
+ */
+int client_next_line(client_t *client, char *line, size_t *line_len, size_t line_size);
+
+/**
+ * Asks the client to provide a username, the answer is read with
+ * client_read_line().
+ */
+void client_ask_username(client_t *client);
+
+/**
+ * Stores the answer to client_ask_username() as the client's username and
+ * welcomes the client.
  */
-int client_ask_username(client_t *client);
+void client_set_username(client_t *client, const char *line);
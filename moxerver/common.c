@@ -0,0 +1,9 @@
+#include <common.h>
+
+void time2string(time_t time, char* timestamp)
+{
+	struct tm tm;
+
+	/* called by all workers, localtime() shares its result */
+	strftime(timestamp, TIMESTAMP_LEN, TIMESTAMP_FORMAT, localtime_r(&time, &tm));
+}
@@ -18,19 +18,8 @@
 
 /* ========================================================================== */
 
-int debug_messages;	/* if > 0 debug messages will be printed */
-
-/**
- * Wrapper for printing a log message to stderr.
- * Uses a "printf" syntax with format and arguments. The newline character '\n'
- * is appended to the message.
- */
-#define LOG(...) \
-	do { \
-		fprintf(stderr, "[%s][%s] ", APPNAME, __func__); \
-		fprintf(stderr, __VA_ARGS__); \
-		fprintf(stderr, "\n"); \
-	} while(0)
+/* log messages are written with LOG(), see log.h for the other levels */
+#include <log.h>
 
 /* ========================================================================== */
 
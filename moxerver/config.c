@@ -0,0 +1,674 @@
+#include <config.h>
+#include <telnet.h>
+#include <stamp.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sched.h>
+
+/* Checks if a line carries no configuration (empty or a comment). */
+static int config_line_is_empty(const char *line)
+{
+	while (*line == ' ' || *line == '\t')
+	{
+		line++;
+	}
+	return (*line == '\0' || *line == '\n' || *line == '\r' || *line == '#');
+}
+
+int config_parse_number(const char *value, long min, long max, long *number)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(value, &end, 10);
+	if (end == value || *end != '\0' || errno == ERANGE || n < min || n > max)
+	{
+		return -EINVAL;
+	}
+	*number = n;
+	return 0;
+}
+
+/* Parses a size in bytes with an optional k or m suffix. */
+static int config_parse_size(const char *value, size_t *size)
+{
+	unsigned long long multiplier = 1;
+	unsigned long long n;
+	char *end;
+
+	/* strtoull() would take a negative size and wrap it around */
+	while (*value == ' ' || *value == '\t')
+	{
+		value++;
+	}
+	if (*value == '-')
+	{
+		return -EINVAL;
+	}
+	errno = 0;
+	n = strtoull(value, &end, 10);
+	if (end == value || errno == ERANGE)
+	{
+		return -EINVAL;
+	}
+	if (*end == 'k' || *end == 'K')
+	{
+		multiplier = 1024;
+		end++;
+	}
+	else if (*end == 'm' || *end == 'M')
+	{
+		multiplier = 1024 * 1024;
+		end++;
+	}
+	if (*end != '\0' || n == 0 || n > SIZE_MAX / multiplier)
+	{
+		return -EINVAL;
+	}
+	*size = (size_t) (n * multiplier);
+	return 0;
+}
+
+/* Parses an on/off switch. */
+static int config_parse_switch(const char *value, int *flag)
+{
+	if (strcmp(value, "on") == 0)
+	{
+		*flag = 1;
+	}
+	else if (strcmp(value, "off") == 0)
+	{
+		*flag = 0;
+	}
+	else
+	{
+		return -EINVAL;
+	}
+	return 0;
+}
+
+void config_set_defaults(port_config_t *port)
+{
+	memset(port, 0, sizeof(*port));
+	port->ring_size = CONFIG_RING_SIZE;
+	port->overflow = OVERFLOW_BLOCK;
+	port->flow = TTY_FLOW_NONE;
+	port->profile = PROFILE_LATENCY;
+	port->observers = CONFIG_OBSERVERS;
+	port->capture_keep = CONFIG_CAPTURE_KEEP;
+	port->capture_queue = CONFIG_CAPTURE_QUEUE;
+	port->coalesce = COALESCE_OFF;
+	port->coalesce_bytes = CONFIG_COALESCE_BYTES;
+	port->coalesce_usec = CONFIG_COALESCE_USEC;
+	port->cpu = -1;
+	/* taken from the profile unless set explicitly */
+	port->buffer_len = 0;
+	port->batch_usec = -1;
+}
+
+int config_apply_profile(port_config_t *port)
+{
+	if (port->buffer_len == 0)
+	{
+		port->buffer_len = (port->profile == PROFILE_BULK) ?
+						   PROFILE_BULK_BUFFER_LEN : BUFFER_LEN;
+	}
+	if (port->batch_usec < 0)
+	{
+		port->batch_usec = (port->profile == PROFILE_BULK) ?
+						   PROFILE_BULK_BATCH_USEC : 0;
+	}
+	/* splicing skips user space, so it can't serve telnet clients */
+	if (port->zerocopy && port->mode != MODE_RAW)
+	{
+		LOG("zerocopy requires mode=raw");
+		return -EINVAL;
+	}
+	/* the history is kept in the output ring */
+	if (port->history > port->ring_size)
+	{
+		port->ring_size = port->history;
+	}
+	if (port->history > 0 && port->zerocopy)
+	{
+		LOG("history can't be recorded with zerocopy, spliced data skips the ring");
+		return -EINVAL;
+	}
+	if (port->capture[0] != '\0' && port->zerocopy)
+	{
+		LOG("capture doesn't work with zerocopy, spliced data skips user space");
+		return -EINVAL;
+	}
+	if (port->history_file[0] != '\0' && port->history == 0)
+	{
+		LOG("history_file requires history");
+		return -EINVAL;
+	}
+	if ((port->crlf || port->backspace) && port->mode != MODE_TELNET)
+	{
+		LOG("crlf and backspace require mode=telnet");
+		return -EINVAL;
+	}
+	if (port->timestamp && port->zerocopy)
+	{
+		LOG("timestamp doesn't work with zerocopy, spliced data skips user space");
+		return -EINVAL;
+	}
+	/* gathered output waits in the ring, a larger amount would never be sent
+	 * before the deadline */
+	if (port->coalesce != COALESCE_OFF && port->coalesce_bytes > port->ring_size)
+	{
+		LOG("coalesce_bytes %zu is larger than the ring, %zu bytes",
+			port->coalesce_bytes, port->ring_size);
+		return -EINVAL;
+	}
+	/* a read full of short lines grows a lot, the ring takes at least one */
+	if (port->timestamp && port->ring_size < config_output_max(port))
+	{
+		port->ring_size = config_output_max(port);
+	}
+	/* a blocked tty waits until the output of a full read fits in the ring */
+	if (port->ring_size < config_output_max(port))
+	{
+		LOG("ring size %zu is smaller than the output of one read, %zu bytes",
+			port->ring_size, config_output_max(port));
+		return -EINVAL;
+	}
+	return 0;
+}
+
+size_t config_output_max(const port_config_t *port)
+{
+	size_t len = port->timestamp ? stamp_max(port->buffer_len) : port->buffer_len;
+
+	if (port->mode != MODE_TELNET)
+	{
+		return len;
+	}
+	return telnet_encode_max(len, config_telnet_flags(port));
+}
+
+int config_equal(const port_config_t *a, const port_config_t *b)
+{
+	return a->tcp_port == b->tcp_port &&
+		   strcmp(a->tty_path, b->tty_path) == 0 &&
+		   a->baud == b->baud &&
+		   a->flow == b->flow &&
+		   a->ring_size == b->ring_size &&
+		   a->overflow == b->overflow &&
+		   a->profile == b->profile &&
+		   a->buffer_len == b->buffer_len &&
+		   a->batch_usec == b->batch_usec &&
+		   a->mode == b->mode &&
+		   a->zerocopy == b->zerocopy &&
+		   a->observers == b->observers &&
+		   a->history == b->history &&
+		   strcmp(a->history_file, b->history_file) == 0 &&
+		   strcmp(a->capture, b->capture) == 0 &&
+		   a->capture_size == b->capture_size &&
+		   a->capture_rotate == b->capture_rotate &&
+		   a->capture_keep == b->capture_keep &&
+		   a->capture_queue == b->capture_queue &&
+		   a->crlf == b->crlf &&
+		   a->backspace == b->backspace &&
+		   a->timestamp == b->timestamp &&
+		   a->coalesce == b->coalesce &&
+		   a->coalesce_bytes == b->coalesce_bytes &&
+		   a->coalesce_usec == b->coalesce_usec &&
+		   a->cpu == b->cpu &&
+		   a->priority == b->priority &&
+		   a->busy_poll_usec == b->busy_poll_usec;
+}
+
+int config_telnet_flags(const port_config_t *port)
+{
+	return (port->crlf ? TELNET_ENCODE_CRLF : 0) |
+		   (port->backspace ? TELNET_ENCODE_BACKSPACE : 0);
+}
+
+int config_parse_option(port_config_t *port, const char *option)
+{
+	char key[CONFIG_LINE_LEN];
+	const char *value;
+
+	value = strchr(option, '=');
+	if (value == NULL || (size_t) (value - option) >= sizeof(key))
+	{
+		LOG("invalid configuration token '%s'", option);
+		return -EINVAL;
+	}
+	memcpy(key, option, value - option);
+	key[value - option] = '\0';
+	value++;
+
+	if (strcmp(key, "tcp") == 0)
+	{
+		long tcp_port;
+		if (config_parse_number(value, 1, 65535, &tcp_port) < 0)
+		{
+			LOG("invalid TCP port '%s'", value);
+			return -EINVAL;
+		}
+		port->tcp_port = (unsigned int) tcp_port;
+	}
+	else if (strcmp(key, "tty") == 0)
+	{
+		size_t path_len = strnlen(value, TTY_DEV_PATH_LEN);
+		if ((path_len == 0) || (path_len > (TTY_DEV_PATH_LEN - 1)))
+		{
+			LOG("error with tty path length: should be <%d", TTY_DEV_PATH_LEN);
+			return -EINVAL;
+		}
+		strcpy(port->tty_path, value);
+	}
+	else if (strcmp(key, "baud") == 0)
+	{
+		long baud;
+		if (config_parse_number(value, 1, INT_MAX, &baud) < 0)
+		{
+			LOG("invalid baud rate '%s'", value);
+			return -EINVAL;
+		}
+		port->baud = (int) baud;
+	}
+	else if (strcmp(key, "ring") == 0)
+	{
+		if (config_parse_size(value, &port->ring_size) < 0)
+		{
+			LOG("invalid ring size '%s'", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "overflow") == 0)
+	{
+		if (strcmp(value, "block") == 0)
+		{
+			port->overflow = OVERFLOW_BLOCK;
+		}
+		else if (strcmp(value, "drop-oldest") == 0)
+		{
+			port->overflow = OVERFLOW_DROP_OLDEST;
+		}
+		else if (strcmp(value, "drop-newest") == 0)
+		{
+			port->overflow = OVERFLOW_DROP_NEWEST;
+		}
+		else
+		{
+			LOG("invalid overflow policy '%s'", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "coalesce") == 0)
+	{
+		if (strcmp(value, "off") == 0)
+		{
+			port->coalesce = COALESCE_OFF;
+		}
+		else if (strcmp(value, "on") == 0)
+		{
+			port->coalesce = COALESCE_ON;
+		}
+		else if (strcmp(value, "adaptive") == 0)
+		{
+			port->coalesce = COALESCE_ADAPTIVE;
+		}
+		else
+		{
+			LOG("invalid coalesce policy '%s', expected off, on or adaptive", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "coalesce_bytes") == 0)
+	{
+		if (config_parse_size(value, &port->coalesce_bytes) < 0 ||
+			port->coalesce_bytes == 0)
+		{
+			LOG("invalid coalesce_bytes '%s'", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "coalesce_usec") == 0)
+	{
+		if (config_parse_number(value, 1, 1000000, &port->coalesce_usec) < 0)
+		{
+			LOG("invalid coalesce_usec '%s', expected 1 to 1000000 usec", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "cpu") == 0)
+	{
+		long cpu;
+		if (config_parse_number(value, 0, CPU_SETSIZE - 1, &cpu) < 0)
+		{
+			LOG("invalid cpu '%s', expected 0 to %d", value, CPU_SETSIZE - 1);
+			return -EINVAL;
+		}
+		port->cpu = (int) cpu;
+	}
+	else if (strcmp(key, "priority") == 0)
+	{
+		long priority;
+		if (config_parse_number(value, sched_get_priority_min(SCHED_FIFO),
+			sched_get_priority_max(SCHED_FIFO), &priority) < 0)
+		{
+			LOG("invalid priority '%s', expected %d to %d", value,
+				sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+			return -EINVAL;
+		}
+		port->priority = (int) priority;
+	}
+	else if (strcmp(key, "busy_poll") == 0)
+	{
+		if (config_parse_number(value, 0, CONFIG_MAX_BUSY_POLL_USEC,
+			&port->busy_poll_usec) < 0)
+		{
+			LOG("invalid busy_poll '%s', expected 0 to %d usec", value,
+				CONFIG_MAX_BUSY_POLL_USEC);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "profile") == 0)
+	{
+		if (strcmp(value, "latency") == 0)
+		{
+			port->profile = PROFILE_LATENCY;
+		}
+		else if (strcmp(value, "bulk") == 0)
+		{
+			port->profile = PROFILE_BULK;
+		}
+		else
+		{
+			LOG("invalid I/O profile '%s'", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "buffer") == 0)
+	{
+		if (config_parse_size(value, &port->buffer_len) < 0 ||
+			port->buffer_len < CONFIG_MIN_BUFFER_LEN)
+		{
+			LOG("invalid buffer length '%s', minimum is %d bytes",
+				value, CONFIG_MIN_BUFFER_LEN);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "batch") == 0)
+	{
+		if (config_parse_number(value, 0, 1000000, &port->batch_usec) < 0)
+		{
+			LOG("invalid batch interval '%s', expected 0 to 1000000 usec", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "flow") == 0)
+	{
+		if (strcmp(value, "none") == 0)
+		{
+			port->flow = TTY_FLOW_NONE;
+		}
+		else if (strcmp(value, "rtscts") == 0)
+		{
+			port->flow = TTY_FLOW_RTSCTS;
+		}
+		else if (strcmp(value, "xonxoff") == 0)
+		{
+			port->flow = TTY_FLOW_XONXOFF;
+		}
+		else
+		{
+			LOG("invalid flow control '%s', expected none, rtscts or xonxoff", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "mode") == 0)
+	{
+		if (strcmp(value, "telnet") == 0)
+		{
+			port->mode = MODE_TELNET;
+		}
+		else if (strcmp(value, "raw") == 0)
+		{
+			port->mode = MODE_RAW;
+		}
+		else
+		{
+			LOG("invalid mode '%s'", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "zerocopy") == 0)
+	{
+		if (config_parse_switch(value, &port->zerocopy) < 0)
+		{
+			LOG("invalid zerocopy value '%s', expected on or off", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "crlf") == 0)
+	{
+		if (config_parse_switch(value, &port->crlf) < 0)
+		{
+			LOG("invalid crlf value '%s', expected on or off", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "backspace") == 0)
+	{
+		if (config_parse_switch(value, &port->backspace) < 0)
+		{
+			LOG("invalid backspace value '%s', expected on or off", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "timestamp") == 0)
+	{
+		if (config_parse_switch(value, &port->timestamp) < 0)
+		{
+			LOG("invalid timestamp value '%s', expected on or off", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "observers") == 0)
+	{
+		long observers;
+		if (config_parse_number(value, 0, CONFIG_MAX_OBSERVERS, &observers) < 0)
+		{
+			LOG("invalid number of observers '%s', expected 0 to %d",
+				value, CONFIG_MAX_OBSERVERS);
+			return -EINVAL;
+		}
+		port->observers = (int) observers;
+	}
+	else if (strcmp(key, "history") == 0)
+	{
+		if (config_parse_size(value, &port->history) < 0)
+		{
+			LOG("invalid history size '%s'", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "history_file") == 0)
+	{
+		size_t path_len = strnlen(value, CONFIG_PATH_LEN);
+		if ((path_len == 0) || (path_len > (CONFIG_PATH_LEN - 1)))
+		{
+			LOG("error with history file path length: should be <%d", CONFIG_PATH_LEN);
+			return -EINVAL;
+		}
+		strcpy(port->history_file, value);
+	}
+	else if (strcmp(key, "capture") == 0)
+	{
+		size_t path_len = strnlen(value, CONFIG_PATH_LEN);
+		if ((path_len == 0) || (path_len > (CONFIG_PATH_LEN - 1)))
+		{
+			LOG("error with capture file path length: should be <%d", CONFIG_PATH_LEN);
+			return -EINVAL;
+		}
+		strcpy(port->capture, value);
+	}
+	else if (strcmp(key, "capture_size") == 0)
+	{
+		if (config_parse_size(value, &port->capture_size) < 0)
+		{
+			LOG("invalid capture file size '%s'", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "capture_rotate") == 0)
+	{
+		if (config_parse_number(value, 0, LONG_MAX, &port->capture_rotate) < 0)
+		{
+			LOG("invalid capture rotation interval '%s'", value);
+			return -EINVAL;
+		}
+	}
+	else if (strcmp(key, "capture_keep") == 0)
+	{
+		long keep;
+		if (config_parse_number(value, 0, 1000, &keep) < 0)
+		{
+			LOG("invalid number of capture files '%s', expected 0 to 1000", value);
+			return -EINVAL;
+		}
+		port->capture_keep = (int) keep;
+	}
+	else if (strcmp(key, "capture_queue") == 0)
+	{
+		if (config_parse_size(value, &port->capture_queue) < 0)
+		{
+			LOG("invalid capture queue size '%s'", value);
+			return -EINVAL;
+		}
+	}
+	else
+	{
+		LOG("unknown configuration key '%s'", key);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+int config_parse_line(const char *line, port_config_t *port)
+{
+	char buf[CONFIG_LINE_LEN];
+	char *token, *saveptr;
+
+	config_set_defaults(port);
+
+	if (strlen(line) >= sizeof(buf))
+	{
+		LOG("configuration line too long");
+		return -EINVAL;
+	}
+	strcpy(buf, line);
+
+	/* parse whitespace separated key=value tokens */
+	for (token = strtok_r(buf, " \t\r\n", &saveptr); token != NULL;
+		 token = strtok_r(NULL, " \t\r\n", &saveptr))
+	{
+		if (config_parse_option(port, token) < 0)
+		{
+			return -EINVAL;
+		}
+	}
+
+	if (port->tcp_port == 0 || port->tty_path[0] == '\0')
+	{
+		LOG("configuration line must define tcp and tty");
+		return -EINVAL;
+	}
+	return config_apply_profile(port);
+}
+
+int config_load(const char *path, config_t *config)
+{
+	FILE *file;
+	char line[CONFIG_LINE_LEN];
+	int line_number = 0;
+	int capacity = 0;
+	int i;
+
+	config->ports = NULL;
+	config->count = 0;
+
+	file = fopen(path, "r");
+	if (file == NULL)
+	{
+		LOG("error opening configuration file %s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		port_config_t port;
+
+		line_number++;
+		if (config_line_is_empty(line))
+		{
+			continue;
+		}
+		if (config_parse_line(line, &port) < 0)
+		{
+			LOG("error in %s at line %d", path, line_number);
+			goto error;
+		}
+		/* every TCP port, history and capture file can be used only once */
+		for (i = 0; i < config->count; i++)
+		{
+			if (config->ports[i].tcp_port == port.tcp_port)
+			{
+				LOG("error in %s at line %d: TCP port %u already used",
+					path, line_number, port.tcp_port);
+				goto error;
+			}
+			if (port.history_file[0] != '\0' &&
+				strcmp(config->ports[i].history_file, port.history_file) == 0)
+			{
+				LOG("error in %s at line %d: history file %s already used",
+					path, line_number, port.history_file);
+				goto error;
+			}
+			if (port.capture[0] != '\0' &&
+				strcmp(config->ports[i].capture, port.capture) == 0)
+			{
+				LOG("error in %s at line %d: capture file %s already used",
+					path, line_number, port.capture);
+				goto error;
+			}
+		}
+		/* grow the port array as needed */
+		if (config->count == capacity)
+		{
+			port_config_t *ports;
+			capacity = (capacity == 0) ? 16 : capacity * 2;
+			ports = realloc(config->ports, capacity * sizeof(port_config_t));
+			if (ports == NULL)
+			{
+				LOG_ERROR("[@%d] out of memory", __LINE__);
+				goto error;
+			}
+			config->ports = ports;
+		}
+		config->ports[config->count++] = port;
+	}
+
+	fclose(file);
+	LOG("loaded %d port configurations from %s", config->count, path);
+	return 0;
+
+error:
+	fclose(file);
+	config_free(config);
+	return -EINVAL;
+}
+
+void config_free(config_t *config)
+{
+	free(config->ports);
+	config->ports = NULL;
+	config->count = 0;
+}
@@ -0,0 +1,205 @@
+/* Handles the server configuration file. */
+
+#pragma once
+
+#include <common.h>
+#include <tty.h>
+
+#define CONFIG_LINE_LEN 512 /* maximum length of a configuration line */
+#define CONFIG_RING_SIZE 65536 /* default size of the session output ring */
+
+/* What happens to tty data when the client doesn't keep up. */
+typedef enum
+{
+	OVERFLOW_BLOCK,			/* stop reading the tty device until there is space */
+	OVERFLOW_DROP_OLDEST,	/* overwrite the oldest unsent data */
+	OVERFLOW_DROP_NEWEST	/* discard the newly read data */
+} overflow_policy_t;
+
+/* I/O profiles trading latency for fewer system calls. */
+typedef enum
+{
+	PROFILE_LATENCY,	/* small buffers, data is forwarded as soon as it arrives */
+	PROFILE_BULK		/* large buffers, tty data is collected between reads */
+} io_profile_t;
+
+/* Protocol spoken with the clients. */
+typedef enum
+{
+	MODE_TELNET,	/* interactive telnet clients with a login dialog */
+	MODE_RAW		/* machine clients, data is passed through unchanged */
+} port_mode_t;
+
+/* When tty output is sent to the client. */
+typedef enum
+{
+	COALESCE_OFF,		/* every tty read is sent right away */
+	COALESCE_ON,		/* output is gathered up to a size or a deadline */
+	COALESCE_ADAPTIVE	/* gathers only while tty reads come faster than the deadline */
+} coalesce_policy_t;
+
+#define PROFILE_BULK_BUFFER_LEN 4096 /* data buffer length of the bulk profile */
+#define PROFILE_BULK_BATCH_USEC 10000 /* tty read interval of the bulk profile */
+#define CONFIG_MIN_BUFFER_LEN 64 /* smallest configurable data buffer */
+#define CONFIG_OBSERVERS 32 /* default number of read-only observers per port */
+#define CONFIG_MAX_OBSERVERS 1024 /* largest configurable number of observers */
+#define CONFIG_PATH_LEN 256 /* maximum length of a file path setting */
+#define CONFIG_CAPTURE_QUEUE (1024 * 1024) /* default capture queue size */
+#define CONFIG_CAPTURE_KEEP 5 /* default number of rotated capture files */
+#define CONFIG_COALESCE_BYTES 1460 /* default gathered output, one full Ethernet TCP segment */
+#define CONFIG_COALESCE_USEC 2000 /* default longest time output is held back */
+#define CONFIG_MAX_BUSY_POLL_USEC 100000 /* longest configurable busy polling time */
+
+/* Configuration of a single TCP port and tty device pair. */
+typedef struct
+{
+	unsigned int tcp_port;			 /* TCP port for client connections */
+	char tty_path[TTY_DEV_PATH_LEN]; /* tty device path */
+	int baud;						 /* tty device baud rate */
+	tty_flow_t flow;				 /* flow control with the tty device */
+	size_t ring_size;				 /* bytes queued for a slow client */
+	overflow_policy_t overflow;		 /* policy when the queue is full */
+	io_profile_t profile;			 /* I/O profile */
+	size_t buffer_len;				 /* tty and client data buffer length */
+	long batch_usec;				 /* minimum time between tty reads */
+	port_mode_t mode;				 /* protocol spoken with the clients */
+	int zerocopy;					 /* > 0 to splice raw tty data to the client */
+	int observers;					 /* maximum number of read-only observers */
+	size_t history;					 /* tty output replayed to new clients */
+	char history_file[CONFIG_PATH_LEN]; /* file keeping the history, empty if unused */
+	char capture[CONFIG_PATH_LEN];	 /* tty data capture file, empty if unused */
+	size_t capture_size;			 /* capture file rotation size, 0 if unused */
+	long capture_rotate;			 /* capture file rotation interval in seconds */
+	int capture_keep;				 /* number of rotated capture files kept */
+	size_t capture_queue;			 /* tty data waiting for the capture writer */
+	int crlf;						 /* > 0 to complete a lone CR with LF for telnet clients */
+	int backspace;					 /* > 0 to send DEL as an erasing backspace */
+	int timestamp;					 /* > 0 to prefix tty output lines with the time */
+	coalesce_policy_t coalesce;		 /* when tty output is sent to the client */
+	size_t coalesce_bytes;			 /* gathered output sent at once */
+	long coalesce_usec;				 /* longest time output is held back */
+	int cpu;						 /* core running the port's event loop, -1 for any */
+	int priority;					 /* SCHED_FIFO priority of the event loop, 0 if unused */
+	long busy_poll_usec;			 /* time the event loop polls before sleeping */
+} port_config_t;
+
+typedef struct
+{
+	port_config_t *ports;	/* configured ports */
+	int count;				/* number of configured ports */
+} config_t;
+
+/**
+ * Sets the default values of all optional port settings.
+ */
+void config_set_defaults(port_config_t *port);
+
+/**
+ * Applies one "key=value" port setting, shared by the configuration file and
+ * the command line. Supported keys:
+ * - tcp=<tcp_port>
+ * - tty=<tty_device>
+ * - baud=<tty_baudrate>
+ * - ring=<bytes>, size of the output queue, accepts k and m suffixes
+ * - overflow=block|drop-oldest|drop-newest
+ * - profile=latency|bulk, sets defaults for the two settings below
+ * - buffer=<bytes>, length of the tty and client data buffers
+ * - batch=<usec>, time tty data is collected by the kernel between reads
+ * - mode=telnet|raw, raw clients skip the login dialog and telnet processing
+ * - zerocopy=on|off, moves tty data of raw clients with splice()
+ * - observers=<count>, read-only clients allowed next to the connected client
+ * - history=<bytes>, latest tty output replayed to new clients, the ring is
+ *   enlarged to hold it
+ * - history_file=<path>, keeps the ring in a mapped file across restarts
+ * - capture=<path>, copies all tty data into a capture file
+ * - capture_size=<bytes>, rotates the capture file when it reaches this size
+ * - capture_rotate=<seconds>, rotates the capture file after this time
+ * - capture_keep=<count>, number of rotated capture files kept
+ * - capture_queue=<bytes>, tty data buffered for the capture writer
+ * - crlf=on|off, completes a CR without LF for telnet clients
+ * - backspace=on|off, sends DEL to telnet clients as an erasing backspace
+ * - timestamp=on|off, prefixes every tty output line with the time it was
+ *   read, for clients, history and capture alike
+ * - coalesce=off|on|adaptive, gathers tty output for the client into larger
+ *   sends, adaptive only while tty reads come faster than coalesce_usec
+ * - coalesce_bytes=<bytes>, gathered output that is sent right away
+ * - coalesce_usec=<usec>, longest time gathered output waits
+ * - cpu=<core>, pins the thread running the port's event loop to a core
+ * - priority=<1..99>, runs the event loop thread with SCHED_FIFO realtime
+ *   scheduling at this priority
+ * - busy_poll=<usec>, the event loop keeps polling for events this long
+ *   before it sleeps
+ *
+ * Settings left out take their values from the I/O profile once
+ * config_apply_profile() is called.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative EINVAL value (-EINVAL) if the setting is not valid
+ */
+int config_parse_option(port_config_t *port, const char *option);
+
+/**
+ * Fills the settings not given explicitly from the selected I/O profile and
+ * checks that the resulting settings fit together.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative EINVAL value (-EINVAL) if the settings are not valid
+ */
+int config_apply_profile(port_config_t *port);
+
+/**
+ * Returns the largest amount of client output one tty read can produce,
+ * timestamps and telnet encoding can make it larger than the read itself.
+ */
+size_t config_output_max(const port_config_t *port);
+
+/**
+ * Compares two port configurations setting by setting.
+ *
+ * Returns:
+ * - 1 if all settings are the same
+ * - 0 otherwise
+ */
+int config_equal(const port_config_t *a, const port_config_t *b);
+
+/**
+ * Returns the TELNET_ENCODE_* translations of the port.
+ */
+int config_telnet_flags(const port_config_t *port);
+
+/**
+ * Parses a decimal number that has to be within min and max, nothing else
+ * may follow it. Also used for the command line arguments.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative EINVAL value (-EINVAL) if the value is not a number in range
+ */
+int config_parse_number(const char *value, long min, long max, long *number);
+
+/**
+ * Parses one configuration line in the format:
+ * tcp=<tcp_port> tty=<tty_device> baud=<tty_baudrate> [key=value ...]
+ *
+ * Returns:
+ * - 0 on success
+ * - negative EINVAL value (-EINVAL) if the line is not valid
+ */
+int config_parse_line(const char *line, port_config_t *port);
+
+/**
+ * Loads all port configurations from a configuration file.
+ * Empty lines and lines starting with '#' are ignored.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred
+ */
+int config_load(const char *path, config_t *config);
+
+/**
+ * Releases the loaded configuration.
+ */
+void config_free(config_t *config);
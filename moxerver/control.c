@@ -0,0 +1,323 @@
+#include <control.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define CONTROL_TIMEOUT_SEC 5 /* longest wait of a control client for the reply */
+
+/* Fills in the socket address for a path. */
+static int control_address(struct sockaddr_un *address, const char *path)
+{
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address->sun_path))
+	{
+		LOG_ERROR("control socket path %s is too long", path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(address->sun_path, path);
+	return 0;
+}
+
+/* Closes a control connection and frees its slot. */
+static void control_drop(control_conn_t *conn)
+{
+	reactor_remove(conn->control->reactor, &conn->handle);
+	close(conn->socket);
+	conn->socket = -1;
+	free(conn->reply);
+	conn->reply = NULL;
+}
+
+/* Sends the reply as far as the socket accepts it, the connection is closed
+ * once the reply is complete. */
+static void control_send_reply(control_conn_t *conn)
+{
+	ssize_t ret;
+
+	while (conn->reply_pos < conn->reply_len)
+	{
+		ret = send(conn->socket, conn->reply + conn->reply_pos,
+				   conn->reply_len - conn->reply_pos, MSG_NOSIGNAL);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				/* the rest is sent once the socket is writable */
+				reactor_modify(conn->control->reactor, &conn->handle, REACTOR_WRITE);
+				return;
+			}
+			break;
+		}
+		conn->reply_pos += ret;
+	}
+	control_drop(conn);
+}
+
+/* Executes the received command and starts sending the reply. */
+static void control_execute(control_conn_t *conn)
+{
+	FILE *out;
+
+	out = open_memstream(&conn->reply, &conn->reply_len);
+	if (out == NULL)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		control_drop(conn);
+		return;
+	}
+	conn->control->handler(conn->control->context, conn->command, out);
+	fclose(out);
+	conn->reply_pos = 0;
+	control_send_reply(conn);
+}
+
+/* Handles events of a control connection. */
+static void control_handle_conn(void *context, unsigned int events)
+{
+	control_conn_t *conn = (control_conn_t *) context;
+	char *end;
+	ssize_t ret;
+
+	if (conn->reply != NULL)
+	{
+		control_send_reply(conn);
+		return;
+	}
+
+	ret = recv(conn->socket, conn->command + conn->command_len,
+			   CONTROL_COMMAND_LEN - 1 - conn->command_len, 0);
+	if (ret == -1)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		{
+			control_drop(conn);
+		}
+		return;
+	}
+	if (ret == 0 && conn->command_len == 0)
+	{
+		control_drop(conn);
+		return;
+	}
+	conn->command_len += ret;
+	conn->command[conn->command_len] = '\0';
+
+	/* the command ends with the line, the connection or the buffer */
+	end = strpbrk(conn->command, "\r\n");
+	if (end == NULL && ret > 0 && conn->command_len < CONTROL_COMMAND_LEN - 1)
+	{
+		return;
+	}
+	if (end != NULL)
+	{
+		*end = '\0';
+	}
+	control_execute(conn);
+}
+
+/* Accepts a new control connection. */
+static void control_handle_socket(void *context, unsigned int events)
+{
+	control_t *control = (control_t *) context;
+	control_conn_t *conn = NULL;
+	int fd;
+	int i;
+
+	fd = accept4(control->socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		{
+			LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		}
+		return;
+	}
+
+	for (i = 0; i < CONTROL_CONNECTIONS; i++)
+	{
+		if (control->conns[i].socket == -1)
+		{
+			conn = &control->conns[i];
+			break;
+		}
+	}
+	if (conn == NULL)
+	{
+		LOG("rejected control connection, all %d slots taken", CONTROL_CONNECTIONS);
+		close(fd);
+		return;
+	}
+
+	conn->socket = fd;
+	conn->command_len = 0;
+	conn->reply = NULL;
+	conn->reply_len = 0;
+	conn->reply_pos = 0;
+	if (reactor_add(control->reactor, &conn->handle, fd, REACTOR_READ,
+					control_handle_conn, conn) != 0)
+	{
+		close(fd);
+		conn->socket = -1;
+	}
+}
+
+int control_open(control_t *control, const char *path, reactor_t *reactor,
+				 control_handler_t handler, void *context)
+{
+	struct sockaddr_un address;
+	int fd, ret;
+	int i;
+
+	memset(control, 0, sizeof(*control));
+	control->socket = -1;
+	control->handle.fd = -1;
+	control->reactor = reactor;
+	control->handler = handler;
+	control->context = context;
+	for (i = 0; i < CONTROL_CONNECTIONS; i++)
+	{
+		control->conns[i].control = control;
+		control->conns[i].socket = -1;
+		control->conns[i].handle.fd = -1;
+	}
+
+	ret = control_address(&address, path);
+	if (ret < 0)
+	{
+		return ret;
+	}
+
+	/* a socket file is only replaced if no server answers there anymore */
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	ret = connect(fd, (struct sockaddr *) &address, sizeof(address));
+	close(fd);
+	if (ret == 0)
+	{
+		LOG_ERROR("control socket %s is used by another server", path);
+		return -EADDRINUSE;
+	}
+	unlink(path);
+
+	control->socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (control->socket == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	if (bind(control->socket, (struct sockaddr *) &address, sizeof(address)) == -1)
+	{
+		LOG_ERROR("error creating control socket %s: %s", path, strerror(errno));
+		return -errno;
+	}
+	/* from here on the socket file belongs to this server */
+	strcpy(control->path, path);
+
+	/* only the owner and its group may control the server */
+	if (chmod(path, 0660) == -1 || listen(control->socket, CONTROL_CONNECTIONS) == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	ret = reactor_add(reactor, &control->handle, control->socket, REACTOR_READ,
+					  control_handle_socket, control);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	LOG("control socket is %s", path);
+	return 0;
+}
+
+void control_close(control_t *control)
+{
+	int i;
+
+	/* a zeroed control was never opened */
+	if (control->reactor == NULL)
+	{
+		return;
+	}
+
+	for (i = 0; i < CONTROL_CONNECTIONS; i++)
+	{
+		if (control->conns[i].socket != -1)
+		{
+			control_drop(&control->conns[i]);
+		}
+	}
+	if (control->socket != -1)
+	{
+		reactor_remove(control->reactor, &control->handle);
+		close(control->socket);
+		control->socket = -1;
+	}
+	if (control->path[0] != '\0')
+	{
+		unlink(control->path);
+		control->path[0] = '\0';
+	}
+}
+
+int control_request(const char *path, const char *command)
+{
+	struct sockaddr_un address;
+	struct timeval timeout = { CONTROL_TIMEOUT_SEC, 0 };
+	char buf[4096];
+	ssize_t ret;
+	int fd;
+
+	ret = control_address(&address, path);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	/* a stuck server must not keep the caller waiting forever */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1)
+	{
+		ret = -errno;
+		LOG_ERROR("error connecting to control socket %s: %s", path, strerror(errno));
+		close(fd);
+		return ret;
+	}
+
+	snprintf(buf, sizeof(buf), "%s\n", command);
+	if (send(fd, buf, strlen(buf), MSG_NOSIGNAL) != (ssize_t) strlen(buf))
+	{
+		ret = -errno;
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		close(fd);
+		return ret;
+	}
+
+	/* the reply ends when the server closes the connection */
+	while ((ret = recv(fd, buf, sizeof(buf), 0)) > 0)
+	{
+		fwrite(buf, 1, ret, stdout);
+	}
+	if (ret == -1)
+	{
+		ret = -errno;
+		LOG_ERROR("error reading reply from %s: %s", path, strerror(errno));
+	}
+	fflush(stdout);
+	close(fd);
+	return (int) ret;
+}
@@ -0,0 +1,73 @@
+/* Handles the local control socket used to query and steer a running server. */
+
+#pragma once
+
+#include <common.h>
+#include <config.h>
+#include <reactor.h>
+
+#define CONTROL_CONNECTIONS 8	/* control connections handled at the same time */
+#define CONTROL_COMMAND_LEN (CONFIG_LINE_LEN + 16) /* longest command line, "reload <line>" */
+
+/*
+ * A control connection carries one command line, the server replies with
+ * text and closes the connection. Both sides are handled by the event loop,
+ * a control client never blocks the sessions.
+ */
+
+/* Callback executing a command, the reply is printed to out. */
+typedef void (*control_handler_t)(void *context, const char *command, FILE *out);
+
+struct control;
+
+/* A connected control client. */
+typedef struct
+{
+	struct control *control;			/* control socket the client came from */
+	int socket;							/* client socket, -1 if the slot is free */
+	char command[CONTROL_COMMAND_LEN];	/* command line received so far */
+	size_t command_len;					/* bytes in the command buffer */
+	char *reply;						/* reply being sent, NULL before the command */
+	size_t reply_len;					/* bytes in the reply */
+	size_t reply_pos;					/* reply bytes sent so far */
+	reactor_handle_t handle;			/* event loop handle of the client socket */
+} control_conn_t;
+
+typedef struct control
+{
+	char path[CONFIG_PATH_LEN];			/* socket path */
+	int socket;							/* listening socket, -1 if closed */
+	reactor_t *reactor;					/* event loop handling the socket */
+	reactor_handle_t handle;			/* event loop handle of the listening socket */
+	control_handler_t handler;			/* executes received commands */
+	void *context;						/* argument passed to the handler */
+	control_conn_t conns[CONTROL_CONNECTIONS];
+} control_t;
+
+/**
+ * Creates the control socket at the given path and adds it to the event loop.
+ * A socket file left behind by a server that is gone is replaced.
+ *
+ * Returns:
+ * - 0 on success
+ * - -EADDRINUSE if another server listens at the path
+ * - negative errno value if an error occurred
+ */
+int control_open(control_t *control, const char *path, reactor_t *reactor,
+				 control_handler_t handler, void *context);
+
+/**
+ * Closes the control socket and all control connections, removes the socket
+ * file. Does nothing for a zeroed control that was never opened.
+ */
+void control_close(control_t *control);
+
+/**
+ * Sends a command to the server listening at the given path and prints its
+ * reply to stdout.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred
+ */
+int control_request(const char *path, const char *command);
@@ -0,0 +1,379 @@
+#include <common.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
+#define LOG_DUMP_LINE 16		/* bytes per hexdump line */
+#define LOG_FORMAT_LEN 4096		/* formatted size of one record, at most */
+#define LOG_OUTPUT_LEN 65536	/* formatted records written to stderr at once */
+
+int log_level = LOG_LEVEL_INFO;
+
+/* One queued log message, optionally followed by dumped bytes. */
+struct log_record
+{
+	_Atomic uint64_t seq;		/* ring position the record is ready for */
+	const char *func;			/* function logging the message */
+	int text_len;				/* message text at the start of data */
+	int dump_len;				/* dumped bytes following the text */
+	int dump_offset;			/* offset of the dumped bytes in the whole buffer */
+	char data[LOG_RECORD_LEN];	/* message text and dumped bytes */
+};
+
+/*
+ * Ring of log records with many producers and the drain thread as the only
+ * consumer. Every record carries the ring position it is ready for, so
+ * producers only compete for the enqueue position and never wait for each
+ * other.
+ */
+static struct
+{
+	struct log_record records[LOG_RECORDS];
+	_Atomic uint64_t enqueue_pos;	/* next record taken by a producer */
+	_Atomic uint64_t dequeue_pos;	/* next record written by the drain thread */
+	_Atomic uint64_t dropped;		/* messages lost to a full ring */
+	atomic_int kicked;				/* > 0 once the drain thread was woken up early */
+	atomic_int running;				/* > 0 while the drain thread runs */
+	pthread_t thread;				/* drain thread */
+	int wake_fd;					/* eventfd waking the drain thread up early */
+} logger = { .wake_fd = -1 };
+
+static const char *log_level_names[] = { "error", "warning", "info", "debug", "trace" };
+
+/* Takes the next free record of the ring. Without a drain thread the local
+ * record is used, NULL is returned if the ring is full. */
+static struct log_record* log_reserve(struct log_record *local, uint64_t *pos)
+{
+	struct log_record *record;
+	int64_t diff;
+
+	if (!atomic_load_explicit(&logger.running, memory_order_acquire))
+	{
+		return local;
+	}
+	*pos = atomic_load_explicit(&logger.enqueue_pos, memory_order_relaxed);
+	for (;;)
+	{
+		record = &logger.records[*pos & (LOG_RECORDS - 1)];
+		diff = (int64_t) (atomic_load_explicit(&record->seq, memory_order_acquire) - *pos);
+		if (diff == 0)
+		{
+			/* a failed exchange reloads the position */
+			if (atomic_compare_exchange_weak_explicit(&logger.enqueue_pos, pos, *pos + 1,
+													  memory_order_relaxed, memory_order_relaxed))
+			{
+				return record;
+			}
+		}
+		else if (diff < 0)
+		{
+			/* the record still waits for the drain thread */
+			atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+			return NULL;
+		}
+		else
+		{
+			*pos = atomic_load_explicit(&logger.enqueue_pos, memory_order_relaxed);
+		}
+	}
+}
+
+/* Formats a record into a buffer of at least LOG_FORMAT_LEN bytes.
+ * Returns the formatted length. */
+static int log_format(const struct log_record *record, char *out)
+{
+	const unsigned char *bytes = (const unsigned char *) record->data + record->text_len;
+	static const char hex[] = "0123456789abcdef";
+	int len = 0;
+	int i, j;
+
+	if (record->text_len > 0 || record->dump_offset == 0)
+	{
+		len = snprintf(out, LOG_FORMAT_LEN, "[%s][%s] %.*s\n", APPNAME, record->func,
+					   record->text_len, record->data);
+		if (len >= LOG_FORMAT_LEN)
+		{
+			len = LOG_FORMAT_LEN - 1;
+		}
+	}
+
+	/* "\t0010  xx xx ... xx  |ascii...|" for every 16 bytes */
+	for (i = 0; i < record->dump_len; i += LOG_DUMP_LINE)
+	{
+		len += sprintf(out + len, "\t%04x ", record->dump_offset + i);
+		for (j = 0; j < LOG_DUMP_LINE; j++)
+		{
+			out[len++] = ' ';
+			out[len++] = (i + j < record->dump_len) ? hex[bytes[i + j] >> 4] : ' ';
+			out[len++] = (i + j < record->dump_len) ? hex[bytes[i + j] & 0xF] : ' ';
+		}
+		out[len++] = ' ';
+		out[len++] = ' ';
+		out[len++] = '|';
+		for (j = 0; j < LOG_DUMP_LINE && i + j < record->dump_len; j++)
+		{
+			out[len++] = (bytes[i + j] >= 0x20 && bytes[i + j] < 0x7F) ? bytes[i + j] : '.';
+		}
+		out[len++] = '|';
+		out[len++] = '\n';
+	}
+	return len;
+}
+
+/* Writes formatted records to stderr. */
+static void log_output(const char *out, int len)
+{
+	ssize_t ret;
+
+	while (len > 0)
+	{
+		ret = write(STDERR_FILENO, out, len);
+		if (ret == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret <= 0)
+		{
+			/* nowhere left to report it */
+			return;
+		}
+		out += ret;
+		len -= ret;
+	}
+}
+
+/* Hands a filled record to the drain thread, a local record is written out
+ * directly. */
+static void log_publish(struct log_record *record, struct log_record *local, uint64_t pos)
+{
+	char out[LOG_FORMAT_LEN];
+
+	if (record == local)
+	{
+		log_output(out, log_format(record, out));
+		return;
+	}
+	atomic_store_explicit(&record->seq, pos + 1, memory_order_release);
+
+	/* a half full ring is drained without waiting for the next period */
+	if (pos + 1 - atomic_load_explicit(&logger.dequeue_pos, memory_order_relaxed) >= LOG_RECORDS / 2 &&
+		!atomic_exchange_explicit(&logger.kicked, 1, memory_order_relaxed))
+	{
+		uint64_t value = 1;
+		if (write(logger.wake_fd, &value, sizeof(value)) != sizeof(value))
+		{
+			/* the drain thread wakes up periodically anyway */
+		}
+	}
+}
+
+void log_message(int level, const char *func, const char *format, ...)
+{
+	struct log_record local, *record;
+	uint64_t pos = 0;
+	va_list args;
+	int len;
+
+	record = log_reserve(&local, &pos);
+	if (record == NULL)
+	{
+		return;
+	}
+	va_start(args, format);
+	len = vsnprintf(record->data, LOG_RECORD_LEN, format, args);
+	va_end(args);
+	record->func = func;
+	record->text_len = (len < 0) ? 0 : (len >= LOG_RECORD_LEN) ? LOG_RECORD_LEN - 1 : len;
+	record->dump_len = 0;
+	record->dump_offset = 0;
+	log_publish(record, &local, pos);
+}
+
+void log_dump(const char *func, const void *databuf, int datalen, const char *format, ...)
+{
+	struct log_record local, *record;
+	uint64_t pos = 0;
+	va_list args;
+	int offset = 0;
+	int len;
+
+	record = log_reserve(&local, &pos);
+	if (record == NULL)
+	{
+		return;
+	}
+	va_start(args, format);
+	len = vsnprintf(record->data, LOG_RECORD_LEN, format, args);
+	va_end(args);
+	record->text_len = (len < 0) ? 0 : (len >= LOG_RECORD_LEN) ? LOG_RECORD_LEN - 1 : len;
+
+	/* the bytes fill the rest of the first record and as many more as needed */
+	for (;;)
+	{
+		len = LOG_RECORD_LEN - record->text_len;
+		if (len > datalen - offset)
+		{
+			len = datalen - offset;
+		}
+		memcpy(record->data + record->text_len, (const char *) databuf + offset, len);
+		record->func = func;
+		record->dump_len = len;
+		record->dump_offset = offset;
+		log_publish(record, &local, pos);
+
+		offset += len;
+		if (offset >= datalen)
+		{
+			break;
+		}
+		record = log_reserve(&local, &pos);
+		if (record == NULL)
+		{
+			return;
+		}
+		record->text_len = 0;
+	}
+}
+
+int log_parse_level(const char *name)
+{
+	int i;
+
+	for (i = 0; i < (int) (sizeof(log_level_names) / sizeof(log_level_names[0])); i++)
+	{
+		if (strcmp(name, log_level_names[i]) == 0)
+		{
+			return i;
+		}
+	}
+	return -EINVAL;
+}
+
+/* Writes all ready records to stderr, in large blocks. */
+static void log_drain()
+{
+	static char out[LOG_OUTPUT_LEN];
+	struct log_record *record;
+	uint64_t pos = atomic_load_explicit(&logger.dequeue_pos, memory_order_relaxed);
+	uint64_t dropped;
+	int len = 0;
+
+	for (;;)
+	{
+		record = &logger.records[pos & (LOG_RECORDS - 1)];
+		if (atomic_load_explicit(&record->seq, memory_order_acquire) != pos + 1)
+		{
+			break;
+		}
+		if (len > LOG_OUTPUT_LEN - LOG_FORMAT_LEN)
+		{
+			log_output(out, len);
+			len = 0;
+		}
+		len += log_format(record, out + len);
+		/* the record is free again one lap later */
+		atomic_store_explicit(&record->seq, pos + LOG_RECORDS, memory_order_release);
+		pos++;
+		atomic_store_explicit(&logger.dequeue_pos, pos, memory_order_relaxed);
+	}
+
+	dropped = atomic_exchange_explicit(&logger.dropped, 0, memory_order_relaxed);
+	if (dropped > 0)
+	{
+		if (len > LOG_OUTPUT_LEN - LOG_FORMAT_LEN)
+		{
+			log_output(out, len);
+			len = 0;
+		}
+		len += snprintf(out + len, LOG_FORMAT_LEN, "[%s][%s] %llu log messages dropped\n",
+						APPNAME, __func__, (unsigned long long) dropped);
+	}
+	log_output(out, len);
+}
+
+/* Thread function draining the log ring. */
+static void* log_drain_thread(void *args)
+{
+	struct pollfd pfd;
+	uint64_t value;
+	int stop;
+
+	pfd.fd = logger.wake_fd;
+	pfd.events = POLLIN;
+	do
+	{
+		/* wake up periodically or early when the ring fills up */
+		if (poll(&pfd, 1, LOG_FLUSH_MSEC) > 0)
+		{
+			if (read(pfd.fd, &value, sizeof(value)) != sizeof(value))
+			{
+				/* nothing to read, the next poll tells */
+			}
+		}
+		atomic_store_explicit(&logger.kicked, 0, memory_order_relaxed);
+		/* records published before the stop request are written as well */
+		stop = !atomic_load_explicit(&logger.running, memory_order_acquire);
+		log_drain();
+	} while (!stop);
+	return (void *) 0;
+}
+
+int log_init()
+{
+	sigset_t all, mask;
+	int ret;
+	int i;
+
+	if (atomic_load(&logger.running))
+	{
+		return 0;
+	}
+	for (i = 0; i < LOG_RECORDS; i++)
+	{
+		atomic_init(&logger.records[i].seq, i);
+	}
+	atomic_store(&logger.enqueue_pos, 0);
+	atomic_store(&logger.dequeue_pos, 0);
+
+	logger.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (logger.wake_fd == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	atomic_store(&logger.running, 1);
+	/* signals are left to the main program, the thread starts with all blocked */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &mask);
+	ret = pthread_create(&logger.thread, NULL, log_drain_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &mask, NULL);
+	if (ret != 0)
+	{
+		atomic_store(&logger.running, 0);
+		close(logger.wake_fd);
+		logger.wake_fd = -1;
+		LOG_ERROR("problem with starting the log thread");
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+void log_close()
+{
+	uint64_t value = 1;
+
+	if (!atomic_load(&logger.running))
+	{
+		return;
+	}
+	/* new messages go to stderr directly, the drain thread writes the rest */
+	atomic_store(&logger.running, 0);
+	if (write(logger.wake_fd, &value, sizeof(value)) != sizeof(value))
+	{
+		/* the drain thread notices the stop within its period */
+	}
+	pthread_join(logger.thread, NULL);
+	close(logger.wake_fd);
+	logger.wake_fd = -1;
+}
@@ -0,0 +1,87 @@
+/* Handles logging through an in-process ring drained by a separate thread. */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define LOG_RECORDS 2048		/* log records queued at most, a power of 2 */
+#define LOG_RECORD_LEN 480		/* message text and dumped bytes of one record */
+#define LOG_FLUSH_MSEC 100		/* longest time a record waits for the drain thread */
+
+/* log severity levels, a message is logged if its level is <= log_level */
+typedef enum
+{
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_TRACE,
+} log_level_t;
+
+extern int log_level;	/* highest level being logged, LOG_LEVEL_INFO by default */
+
+/**
+ * Logs a message with the given level. Uses a "printf" syntax with format and
+ * arguments. The newline character '\n' is appended to the message. A disabled
+ * level costs only the comparison.
+ */
+#define LOG_AT(level, ...) \
+	do { \
+		if ((level) <= log_level) \
+			log_message((level), __func__, __VA_ARGS__); \
+	} while(0)
+
+#define LOG(...)		LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_ERROR(...)	LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARNING(...)	LOG_AT(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_DEBUG(...)	LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/**
+ * Logs a data buffer as a hexdump on the trace level, headed by a message in
+ * "printf" syntax. The bytes are copied as they are, formatting is left to
+ * the drain thread.
+ */
+#define LOG_DUMP(databuf, datalen, ...) \
+	do { \
+		if (LOG_LEVEL_TRACE <= log_level) \
+			log_dump(__func__, (databuf), (datalen), __VA_ARGS__); \
+	} while(0)
+
+/**
+ * Queues a log message, use the LOG macros instead. Never blocks, a message
+ * that doesn't fit in a full ring is dropped and counted. Without a running
+ * drain thread the message is written to stderr directly.
+ */
+void log_message(int level, const char *func, const char *format, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/**
+ * Queues a hexdump of a data buffer, use the LOG_DUMP macro instead.
+ */
+void log_dump(const char *func, const void *databuf, int datalen, const char *format, ...)
+	__attribute__((format(printf, 4, 5)));
+
+/**
+ * Converts a level name (error, warning, info, debug, trace) to its value.
+ *
+ * Returns:
+ * - level value on success
+ * - -EINVAL if the name is unknown
+ */
+int log_parse_level(const char *name);
+
+/**
+ * Starts the drain thread writing queued log records to stderr.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred
+ */
+int log_init();
+
+/**
+ * Writes the remaining log records and stops the drain thread, later messages
+ * are written to stderr directly.
+ */
+void log_close();
@@ -0,0 +1,91 @@
+#include <metrics.h>
+
+void metrics_observe(metrics_histogram_t *histogram, uint64_t value)
+{
+	int bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+
+	if (bucket >= METRICS_BUCKETS)
+	{
+		bucket = METRICS_BUCKETS - 1;
+	}
+	metrics_add(&histogram->buckets[bucket], 1);
+	metrics_add(&histogram->count, 1);
+	metrics_add(&histogram->sum, value);
+}
+
+void metrics_track_done(metrics_tracker_t *tracker, uint64_t pos, metrics_histogram_t *histogram)
+{
+	uint64_t now;
+
+	if (tracker->tail == tracker->head || tracker->marks[tracker->tail % METRICS_MARKS].pos > pos)
+	{
+		return;
+	}
+	/* one clock reading serves all buffers completed at once */
+	now = metrics_clock();
+	while (tracker->tail != tracker->head && tracker->marks[tracker->tail % METRICS_MARKS].pos <= pos)
+	{
+		metrics_observe(histogram, (now - tracker->marks[tracker->tail % METRICS_MARKS].nsec) / 1000);
+		tracker->tail++;
+	}
+}
+
+void metrics_track_skip(metrics_tracker_t *tracker, uint64_t pos)
+{
+	while (tracker->tail != tracker->head && tracker->marks[tracker->tail % METRICS_MARKS].pos <= pos)
+	{
+		tracker->tail++;
+	}
+}
+
+void metrics_print_value(FILE *out, const char *name, unsigned int port, uint64_t value)
+{
+	fprintf(out, "%s{port=\"%u\"} %llu\n", name, port, (unsigned long long) value);
+}
+
+void metrics_print_histogram(FILE *out, const char *name, unsigned int port,
+							 const metrics_histogram_t *histogram)
+{
+	uint64_t count;
+	int i;
+
+	/* empty buckets are left out, they would only add noise */
+	for (i = 0; i < METRICS_BUCKETS; i++)
+	{
+		count = metrics_get(&histogram->buckets[i]);
+		if (count > 0)
+		{
+			fprintf(out, "%s_bucket{port=\"%u\",lt=\"%llu\"} %llu\n", name, port,
+					1ULL << i, (unsigned long long) count);
+		}
+	}
+	fprintf(out, "%s_count{port=\"%u\"} %llu\n", name, port,
+			(unsigned long long) metrics_get(&histogram->count));
+	fprintf(out, "%s_sum{port=\"%u\"} %llu\n", name, port,
+			(unsigned long long) metrics_get(&histogram->sum));
+}
+
+void metrics_print_port(FILE *out, unsigned int port, const port_metrics_t *metrics)
+{
+	metrics_print_value(out, "tty_read_bytes", port, metrics_get(&metrics->tty_read_bytes));
+	metrics_print_value(out, "tty_written_bytes", port, metrics_get(&metrics->tty_written_bytes));
+	metrics_print_value(out, "client_read_bytes", port, metrics_get(&metrics->client_read_bytes));
+	metrics_print_value(out, "client_sent_bytes", port, metrics_get(&metrics->client_sent_bytes));
+	metrics_print_value(out, "client_short_writes", port, metrics_get(&metrics->client_short_writes));
+	metrics_print_value(out, "client_eagain", port, metrics_get(&metrics->client_eagain));
+	metrics_print_value(out, "tty_write_stalls", port, metrics_get(&metrics->tty_write_stalls));
+	metrics_print_value(out, "output_dropped_bytes", port, metrics_get(&metrics->output_dropped_bytes));
+	metrics_print_value(out, "observer_sent_bytes", port, metrics_get(&metrics->observer_sent_bytes));
+	metrics_print_value(out, "observer_dropped_bytes", port, metrics_get(&metrics->observer_dropped_bytes));
+	metrics_print_value(out, "client_connects", port, metrics_get(&metrics->client_connects));
+	metrics_print_value(out, "client_reconnects", port, metrics_get(&metrics->client_reconnects));
+	metrics_print_value(out, "client_takeovers", port, metrics_get(&metrics->client_takeovers));
+	metrics_print_value(out, "client_rejects", port, metrics_get(&metrics->client_rejects));
+	metrics_print_value(out, "observer_connects", port, metrics_get(&metrics->observer_connects));
+	metrics_print_histogram(out, "tty_read_size", port, &metrics->tty_read_size);
+	metrics_print_histogram(out, "client_write_size", port, &metrics->client_write_size);
+	metrics_print_histogram(out, "session_seconds", port, &metrics->session_seconds);
+	metrics_print_histogram(out, "tty_to_client_usec", port, &metrics->tty_to_client_usec);
+	metrics_print_histogram(out, "client_to_tty_usec", port, &metrics->client_to_tty_usec);
+	metrics_print_histogram(out, "client_wakeup_usec", port, &metrics->client_wakeup_usec);
+}
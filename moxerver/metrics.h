@@ -0,0 +1,157 @@
+/* Handles counters and histograms describing the traffic of a port. */
+
+#pragma once
+
+#include <common.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define METRICS_BUCKETS 32 /* histogram buckets, values from 2^31 on share the last one */
+#define METRICS_MARKS 64	/* buffers a latency tracker follows at the same time */
+
+/*
+ * Counters have a single writer, the thread running the port's session, and
+ * may be read by any thread. The writer updates them without a locked
+ * instruction, readers always see a complete value.
+ */
+typedef _Atomic uint64_t metrics_counter_t;
+
+/* Histogram with power of 2 buckets, bucket i counts values below 2^i that
+ * don't fit the bucket before. */
+typedef struct
+{
+	metrics_counter_t buckets[METRICS_BUCKETS];
+	metrics_counter_t count;	/* number of values */
+	metrics_counter_t sum;		/* sum of all values */
+} metrics_histogram_t;
+
+/* Counters of one port. */
+typedef struct
+{
+	metrics_counter_t tty_read_bytes;		/* bytes read from the tty device */
+	metrics_counter_t tty_written_bytes;	/* bytes written to the tty device */
+	metrics_counter_t client_read_bytes;	/* bytes received from the client */
+	metrics_counter_t client_sent_bytes;	/* bytes sent to the client */
+	metrics_counter_t client_short_writes;	/* writes the client socket took only partly */
+	metrics_counter_t client_eagain;		/* writes refused by a full client socket */
+	metrics_counter_t tty_write_stalls;		/* client reads paused by a full tty output queue */
+	metrics_counter_t output_dropped_bytes;	/* tty bytes dropped by the overflow policy */
+	metrics_counter_t observer_sent_bytes;	/* bytes sent to observers */
+	metrics_counter_t observer_dropped_bytes;/* tty bytes observers were too slow for */
+	metrics_counter_t client_connects;		/* clients that got the port */
+	metrics_counter_t client_reconnects;	/* clients from the same address as the one before */
+	metrics_counter_t client_takeovers;		/* clients dropped for a new one */
+	metrics_counter_t client_rejects;		/* connection requests that were turned down */
+	metrics_counter_t observer_connects;	/* observers that started watching */
+	metrics_histogram_t tty_read_size;		/* bytes per tty read */
+	metrics_histogram_t client_write_size;	/* bytes the client socket took per write */
+	metrics_histogram_t session_seconds;	/* duration of client sessions */
+	metrics_histogram_t tty_to_client_usec;	/* from tty read until the client took the data */
+	metrics_histogram_t client_to_tty_usec;	/* from client read until the tty took the data */
+	metrics_histogram_t client_wakeup_usec;	/* from client data arrival until it was read */
+} port_metrics_t;
+
+/*
+ * Follows buffers through a queue to measure how long they wait. The queue
+ * position at the end of each buffer is marked with the time it was queued,
+ * once the queue is consumed past that position the waiting time goes into a
+ * histogram. Only the owning thread uses it. A tracker with all marks taken
+ * skips new buffers until the oldest ones are done, so under backpressure
+ * the latency is sampled.
+ */
+typedef struct
+{
+	struct
+	{
+		uint64_t pos;	/* queue position at the end of the buffer */
+		uint64_t nsec;	/* time the buffer was queued */
+	} marks[METRICS_MARKS];
+	unsigned int head;	/* next mark to take */
+	unsigned int tail;	/* oldest mark in use */
+} metrics_tracker_t;
+
+/**
+ * Adds a value to a counter, only the owning thread may do that.
+ */
+static inline void metrics_add(metrics_counter_t *counter, uint64_t value)
+{
+	atomic_store_explicit(counter,
+						  atomic_load_explicit(counter, memory_order_relaxed) + value,
+						  memory_order_relaxed);
+}
+
+/**
+ * Reads a counter, any thread may do that.
+ */
+static inline uint64_t metrics_get(const metrics_counter_t *counter)
+{
+	return atomic_load_explicit((metrics_counter_t *) counter, memory_order_relaxed);
+}
+
+/**
+ * Returns the monotonic clock in nanoseconds, for measuring latency.
+ */
+static inline uint64_t metrics_clock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Marks a queued buffer ending at the given queue position, queued at the
+ * given metrics_clock() time.
+ */
+static inline void metrics_track(metrics_tracker_t *tracker, uint64_t pos, uint64_t nsec)
+{
+	if (tracker->head - tracker->tail < METRICS_MARKS)
+	{
+		tracker->marks[tracker->head % METRICS_MARKS].pos = pos;
+		tracker->marks[tracker->head % METRICS_MARKS].nsec = nsec;
+		tracker->head++;
+	}
+}
+
+/**
+ * Puts the waiting time of all buffers consumed up to the given queue
+ * position into the histogram, in microseconds.
+ */
+void metrics_track_done(metrics_tracker_t *tracker, uint64_t pos, metrics_histogram_t *histogram);
+
+/**
+ * Forgets the buffers up to the given queue position without measuring them,
+ * e.g. because they were dropped.
+ */
+void metrics_track_skip(metrics_tracker_t *tracker, uint64_t pos);
+
+/**
+ * Forgets all tracked buffers.
+ */
+static inline void metrics_track_reset(metrics_tracker_t *tracker)
+{
+	tracker->tail = tracker->head;
+}
+
+/**
+ * Adds a value to a histogram, only the owning thread may do that.
+ */
+void metrics_observe(metrics_histogram_t *histogram, uint64_t value);
+
+/**
+ * Prints a value as a line "name{port="N"} value". This format is used for all
+ * metrics, so tools can sum them up across ports.
+ */
+void metrics_print_value(FILE *out, const char *name, unsigned int port, uint64_t value);
+
+/**
+ * Prints a histogram as "name_bucket{port="N",lt="2^i"} count" for every
+ * non-empty bucket, followed by "name_count" and "name_sum".
+ */
+void metrics_print_histogram(FILE *out, const char *name, unsigned int port,
+							 const metrics_histogram_t *histogram);
+
+/**
+ * Prints all counters of a port.
+ */
+void metrics_print_port(FILE *out, unsigned int port, const port_metrics_t *metrics);
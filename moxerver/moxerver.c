@@ -2,19 +2,29 @@
  * Main server application.
  * Handles client connections on specific TCP port and allows bidirectional
  * communication with a specific TTY device.
+ * With a configuration file it handles all configured port and device pairs.
  */
 
 #include <common.h>
-#include <task_threads.h>
-#include <signal.h> /* handling quit signals */
+#include <worker.h>
+#include <control.h>
+#include <signal.h> /* handling quit and reload signals */
+#include <sys/signalfd.h> /* receiving signals in the event loop */
+#include <sys/resource.h> /* raising the open file limit */
+#include <limits.h> /* range of the baud rate argument */
 
 /* ========================================================================== */
 
 /* global resources */
-server_t server;	 /* main server */
-client_t client;	 /* connected client */
-client_t new_client; /* reserved for a new client request */
-tty_t tty_dev;		 /* connected tty device */
+worker_t *workers;		 /* workers sharing the served ports */
+int worker_count;		 /* number of set up workers */
+reactor_t reactor;		 /* event loop of the main thread when the workers run in threads */
+reactor_t *main_reactor; /* event loop handling signals and the control socket */
+const char *config_path; /* configuration file, NULL when serving a single port */
+int quitting;			 /* > 0 once a quit signal arrived */
+int signal_fd = -1;		 /* delivers quit and reload signals to the event loop */
+reactor_handle_t signal_handle;
+control_t control;		 /* control socket, used if a path is given */
 
 /* ========================================================================== */
 
@@ -22,66 +32,488 @@ tty_t tty_dev;		 /* connected tty device */
 static void usage()
 {
 	//TODO maybe some styling should be done
-	fprintf(stdout, "Usage: %s -p tcp_port -t tty_path -b baud_rate [-d] [-h]\n", APPNAME);
-	fprintf(stdout, "\t-d\tturns on debug messages\n");
+	fprintf(stdout, "Usage: %s -p tcp_port -t tty_path -b baud_rate [-o key=value]... [-s socket] [-l level] [-d] [-h]\n", APPNAME);
+	fprintf(stdout, "       %s -c config_file [-w workers] [-s socket] [-l level] [-d] [-h]\n", APPNAME);
+	fprintf(stdout, "       %s -C socket command\n", APPNAME);
+	fprintf(stdout, "\t-c\tserves all ports from the configuration file in one process\n");
+	fprintf(stdout, "\t-w\tshares the ports out to this many event loop threads, each on\n"
+					"\t\tits own core (default 1, the main thread)\n");
+	fprintf(stdout, "\t-o\tsets a port option as in the configuration file, e.g.:\n");
+	fprintf(stdout, "\t\tring=<bytes>\t\t\tsize of the queue for a slow client\n");
+	fprintf(stdout, "\t\toverflow=block|drop-oldest|drop-newest\tpolicy for a full queue\n");
+	fprintf(stdout, "\t\tflow=none|rtscts|xonxoff\t\tflow control with the tty device\n");
+	fprintf(stdout, "\t\tprofile=latency|bulk\t\tI/O profile\n");
+	fprintf(stdout, "\t\tbuffer=<bytes>\t\t\tdata buffer length\n");
+	fprintf(stdout, "\t\tbatch=<usec>\t\t\tinterval between tty reads\n");
+	fprintf(stdout, "\t\tcrlf=on|off\t\t\tends a lone CR with LF for telnet clients\n");
+	fprintf(stdout, "\t\tbackspace=on|off\t\tsends DEL as BS SP BS to telnet clients\n");
+	fprintf(stdout, "\t\ttimestamp=on|off\t\tprefixes tty output lines with the time\n");
+	fprintf(stdout, "\t\tcoalesce=off|on|adaptive\tgathers tty output into larger sends\n");
+	fprintf(stdout, "\t\tcoalesce_bytes=<bytes>\t\tgathered output sent at once\n");
+	fprintf(stdout, "\t\tcoalesce_usec=<usec>\t\tlongest time output is held back\n");
+	fprintf(stdout, "\t\tcpu=<core>\t\t\tpins the event loop to a core\n");
+	fprintf(stdout, "\t\tpriority=<1..99>\t\truns the event loop with SCHED_FIFO\n");
+	fprintf(stdout, "\t\tbusy_poll=<usec>\t\tevent loop polling time before it sleeps\n");
+	fprintf(stdout, "\t\tobservers=<count>\t\tread-only clients allowed per port\n");
+	fprintf(stdout, "\t\thistory=<bytes>\t\t\ttty output replayed to new clients\n");
+	fprintf(stdout, "\t\thistory_file=<path>\t\tfile keeping the history across restarts\n");
+	fprintf(stdout, "\t\tcapture=<path>\t\t\tfile receiving a copy of all tty data\n");
+	fprintf(stdout, "\t\tcapture_size=<bytes>\t\tcapture file rotation size\n");
+	fprintf(stdout, "\t\tcapture_rotate=<seconds>\tcapture file rotation interval\n");
+	fprintf(stdout, "\t\tcapture_keep=<count>\t\trotated capture files kept\n");
+	fprintf(stdout, "\t\tcapture_queue=<bytes>\t\ttty data buffered for the capture file\n");
+	fprintf(stdout, "\t-s\tanswers commands on this local control socket\n");
+	fprintf(stdout, "\t-C\tsends a command to the server with this control socket, e.g.:\n");
+	fprintf(stdout, "\t\tstats\t\t\t\tprints the counters of all ports\n");
+	fprintf(stdout, "\t\tstatus\t\t\t\tprints the client, user and last activity of all ports\n");
+	fprintf(stdout, "\t\treload\t\t\t\treloads the configuration file, same as SIGHUP\n");
+	fprintf(stdout, "\t\treload <configuration line>\tchanges the port of a server without -c\n");
+	fprintf(stdout, "\t-l\tlog level: error, warning, info (default), debug or trace\n");
+	fprintf(stdout, "\t-d\tturns on debug messages and hexdumps of all data, same as -l trace\n");
 	fprintf(stdout, "\n");
 }
 
 /* Performs resource cleanup. */
 void cleanup()
 {
+	int i;
+
 	LOG("performing cleanup");
 
-	// TODO: maybe pthread_kill() should be used for thread cleanup?
+	/* the main event loop may be the one of the first worker */
+	control_close(&control);
+	if (signal_fd != -1)
+	{
+		reactor_remove(main_reactor, &signal_handle);
+		close(signal_fd);
+		signal_fd = -1;
+	}
+
+	/* close all sessions, worker threads close their own */
+	for (i = 0; i < worker_count; i++)
+	{
+		if (workers[i].threaded)
+		{
+			worker_stop(&workers[i]);
+		}
+		else
+		{
+			worker_close(&workers[i]);
+		}
+	}
+	free(workers);
+	workers = NULL;
+	worker_count = 0;
+
+	if (main_reactor == &reactor)
+	{
+		reactor_close(&reactor);
+	}
+	log_close();
+}
+
+/* Returns the core of a worker, the workers are spread over the cores the
+ * process may run on, -1 if they are unknown. */
+static int worker_core(int index)
+{
+	cpu_set_t cpus;
+	int cpu;
 
-	/* close the client */
-	if (client.socket != -1)
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1 || CPU_COUNT(&cpus) == 0)
 	{
-		client_close(&client);
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -1;
 	}
-	/* close the tty device */
-	if (tty_dev.fd != -1)
+	index %= CPU_COUNT(&cpus);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
 	{
-		tty_close(&tty_dev);
+		if (CPU_ISSET(cpu, &cpus) && index-- == 0)
+		{
+			return cpu;
+		}
 	}
-	/* close the server */
-	server_close(&server);
+	return -1;
 }
 
-/* Handles received quit signals, use it for all quit signals of interest. */
-void quit_handler(int signum)
+/* Shares the ports of a configuration out to the first count workers. A port
+ * stays with the worker serving it, a new port goes to the worker with the
+ * fewest ports. Fills in one configuration per worker, pointing into the
+ * returned array that the caller frees, NULL if out of memory. */
+static port_config_t* share_ports(const config_t *config, config_t *shares, int count)
 {
-    /* perform cleanup and exit with 0 */
-	LOG("received signal %d", signum);
-	exit(0);
+	port_config_t *ports;
+	int *owners;
+	int i, w, pos;
+
+	ports = calloc((config->count > 0) ? config->count : 1, sizeof(port_config_t));
+	owners = calloc((config->count > 0) ? config->count : 1, sizeof(int));
+	if (ports == NULL || owners == NULL)
+	{
+		LOG_ERROR("[@%d] out of memory", __LINE__);
+		free(ports);
+		free(owners);
+		return NULL;
+	}
+	for (w = 0; w < count; w++)
+	{
+		shares[w].count = 0;
+	}
+
+	/* served ports first, so the loads are known for the new ones */
+	for (i = 0; i < config->count; i++)
+	{
+		owners[i] = -1;
+		for (w = 0; w < count; w++)
+		{
+			if (worker_find(&workers[w], config->ports[i].tcp_port) != NULL)
+			{
+				owners[i] = w;
+				shares[w].count++;
+				break;
+			}
+		}
+	}
+	for (i = 0; i < config->count; i++)
+	{
+		if (owners[i] == -1)
+		{
+			owners[i] = 0;
+			for (w = 1; w < count; w++)
+			{
+				if (shares[w].count < shares[owners[i]].count)
+				{
+					owners[i] = w;
+				}
+			}
+			shares[owners[i]].count++;
+		}
+	}
+
+	/* the ports of a worker are kept together, in configuration order */
+	pos = 0;
+	for (w = 0; w < count; w++)
+	{
+		shares[w].ports = ports + pos;
+		shares[w].count = 0;
+		for (i = 0; i < config->count; i++)
+		{
+			if (owners[i] == w)
+			{
+				shares[w].ports[shares[w].count++] = config->ports[i];
+			}
+		}
+		pos += shares[w].count;
+	}
+	free(owners);
+	return ports;
 }
 
-void time2string(time_t time, char* timestamp)
+/* Returns the number of ports served by all workers. */
+static int served_ports()
 {
-	strftime(timestamp, TIMESTAMP_LEN, TIMESTAMP_FORMAT, localtime(&time));
+	int i, count = 0;
+
+	for (i = 0; i < worker_count; i++)
+	{
+		count += workers[i].session_count;
+	}
+	return count;
 }
 
-/* MoxaNix main program loop. */
-int main(int argc, char *argv[])
+/* A reload of one worker, run in its thread. */
+struct reload_request
+{
+	const config_t *config;	/* ports of the worker */
+	FILE *out;				/* control client, NULL for SIGHUP */
+	worker_reload_t totals;	/* changes of all workers so far */
+};
+
+/* Reloads the worker the call runs in. */
+static void reload_worker(worker_t *worker, void *arg)
 {
-	int ret;
-	unsigned int tcp_port = -1;
+	struct reload_request *request = (struct reload_request *) arg;
 
-	pthread_t tty_thread;
+	worker_reload(worker, request->config, request->out, &request->totals);
+}
+
+/* Brings all workers in line with a new configuration, one after the other.
+ * A worker only changes its own sessions, the others keep serving. */
+static void reload_workers(const config_t *config, FILE *out)
+{
+	struct reload_request request;
+	config_t *shares;
+	port_config_t *ports;
+	int i;
 
-	/* initialize tty_dev */
-	if (cfsetispeed(&(tty_dev.ttyset), B0) < 0 ||
-		cfsetospeed(&(tty_dev.ttyset), B0) < 0)
+	shares = calloc(worker_count, sizeof(config_t));
+	ports = (shares != NULL) ? share_ports(config, shares, worker_count) : NULL;
+	if (ports == NULL)
 	{
-		LOG("error configuring tty device speed");
-		return -1;
+		LOG_ERROR("[@%d] out of memory", __LINE__);
+		if (out != NULL)
+		{
+			fprintf(out, "error: out of memory\n");
+		}
+		free(shares);
+		return;
+	}
+
+	memset(&request, 0, sizeof(request));
+	request.out = out;
+	for (i = 0; i < worker_count; i++)
+	{
+		request.config = &shares[i];
+		worker_call(&workers[i], reload_worker, &request);
+	}
+	free(ports);
+	free(shares);
+
+	LOG("reload: serving %d ports, %d added, %d removed, %d restarted, "
+		"%d changed in place, %d failed", served_ports(), request.totals.added,
+		request.totals.removed, request.totals.restarted, request.totals.changed,
+		request.totals.failed);
+	if (out != NULL)
+	{
+		fprintf(out, "serving %d ports, %d added, %d removed, %d restarted, "
+				"%d changed in place, %d failed\n", served_ports(), request.totals.added,
+				request.totals.removed, request.totals.restarted, request.totals.changed,
+				request.totals.failed);
+	}
+}
+
+/* Reloads the configuration file, or applies the configuration line given to
+ * a server of a single port. */
+static void reload(const char *line, FILE *out)
+{
+	config_t config;
+	port_config_t port;
+
+	if (config_path != NULL)
+	{
+		if (line != NULL)
+		{
+			fprintf(out, "error: the configuration is reloaded from %s\n", config_path);
+			return;
+		}
+		LOG("reloading configuration from %s", config_path);
+		if (config_load(config_path, &config) < 0 || config.count == 0)
+		{
+			LOG("configuration not reloaded, the running one stays in place");
+			if (out != NULL)
+			{
+				fprintf(out, "error: %s not loaded, see the log\n", config_path);
+			}
+			config_free(&config);
+			return;
+		}
+		reload_workers(&config, out);
+		config_free(&config);
+		return;
+	}
+
+	if (line == NULL)
+	{
+		LOG("no configuration file to reload");
+		if (out != NULL)
+		{
+			fprintf(out, "error: no configuration file, give a configuration line\n");
+		}
+		return;
+	}
+	if (config_parse_line(line, &port) < 0)
+	{
+		fprintf(out, "error: invalid configuration line, see the log\n");
+		return;
+	}
+	config.ports = &port;
+	config.count = 1;
+	reload_workers(&config, out);
+}
+
+/* Handles received signals, quit signals stop the event loop and SIGHUP
+ * reloads the configuration. */
+static void signal_handler(void *context, unsigned int events)
+{
+	struct signalfd_siginfo info;
+
+	if (read(signal_fd, &info, sizeof(info)) != sizeof(info))
+	{
+		return;
+	}
+	LOG("received signal %u", info.ssi_signo);
+	if (info.ssi_signo == SIGHUP)
+	{
+		reload(NULL, NULL);
+		return;
+	}
+	/* leave the event loop, cleanup is done by the main program */
+	quitting = 1;
+	if (main_reactor == &reactor)
+	{
+		reactor_stop(&reactor);
+	}
+	else
+	{
+		worker_stop(&workers[0]);
+	}
+}
+
+/* Prints the counters of the ports of the worker the call runs in. */
+static void print_worker_stats(worker_t *worker, void *arg)
+{
+	worker_print_stats(worker, (FILE *) arg);
+}
+
+/* Prints the state of the ports of the worker the call runs in. */
+static void print_worker_status(worker_t *worker, void *arg)
+{
+	worker_print_status(worker, (FILE *) arg);
+}
+
+/* Executes a command received on the control socket. */
+static void control_handler(void *context, const char *command, FILE *out)
+{
+	int i;
+
+	if (strcmp(command, "stats") == 0)
+	{
+		for (i = 0; i < worker_count; i++)
+		{
+			worker_call(&workers[i], print_worker_stats, out);
+		}
+	}
+	else if (strcmp(command, "status") == 0)
+	{
+		for (i = 0; i < worker_count; i++)
+		{
+			worker_call(&workers[i], print_worker_status, out);
+		}
+	}
+	else if (strcmp(command, "reload") == 0)
+	{
+		reload(NULL, out);
+	}
+	else if (strncmp(command, "reload ", 7) == 0)
+	{
+		reload(command + 7, out);
 	}
-	
-	/* enable catching and handling some quit signals, SIGKILL can't be caught */
-	signal(SIGTERM, quit_handler);
-	signal(SIGQUIT, quit_handler);
-	signal(SIGINT, quit_handler);
-	
+	else
+	{
+		fprintf(out, "error: unknown command '%s'\n", command);
+	}
+}
+
+/* Blocks the quit and reload signals, threads started later inherit the
+ * blocked signals. Must run before any worker or helper thread starts. */
+static int block_signals(sigset_t *mask)
+{
+	/* a client vanishing during send() must not terminate the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* nohup ignores SIGHUP, an ignored signal never reaches the signalfd */
+	signal(SIGHUP, SIG_DFL);
+
+	/* block the signals and receive them through a file descriptor instead,
+	 * SIGKILL can't be caught */
+	sigemptyset(mask);
+	sigaddset(mask, SIGTERM);
+	sigaddset(mask, SIGQUIT);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGHUP);
+	if (sigprocmask(SIG_BLOCK, mask, NULL) == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+/* Routes the blocked signals to the event loop of the main thread. */
+static int setup_signals(const sigset_t *mask)
+{
+	signal_fd = signalfd(-1, mask, SFD_CLOEXEC);
+	if (signal_fd == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	return reactor_add(main_reactor, &signal_handle, signal_fd, REACTOR_READ,
+					   signal_handler, NULL);
+}
+
+/* Raises the open file limit, every port needs a few descriptors. */
+static void raise_file_limit()
+{
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+		{
+			LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		}
+	}
+}
+
+/* Sets up the workers and their sessions, a port that fails doesn't stop the
+ * others. A single worker runs in the main thread, more run in threads of
+ * their own. */
+static int setup_workers(const config_t *config, int count)
+{
+	config_t *shares;
+	port_config_t *ports;
+	int i, ret = 0;
+
+	workers = calloc(count, sizeof(worker_t));
+	if (workers == NULL)
+	{
+		LOG_ERROR("[@%d] out of memory", __LINE__);
+		return -ENOMEM;
+	}
+	if (count == 1)
+	{
+		ret = worker_setup(&workers[0], 0, -1, config);
+		if (ret == 0)
+		{
+			worker_count = 1;
+		}
+		return ret;
+	}
+
+	/* no worker serves anything yet, the ports are dealt out in turn */
+	shares = calloc(count, sizeof(config_t));
+	ports = (shares != NULL) ? share_ports(config, shares, count) : NULL;
+	if (ports == NULL)
+	{
+		LOG_ERROR("[@%d] out of memory", __LINE__);
+		free(shares);
+		return -ENOMEM;
+	}
+	for (i = 0; i < count && ret == 0; i++)
+	{
+		ret = worker_start(&workers[i], i, worker_core(i), &shares[i]);
+		if (ret == 0)
+		{
+			worker_count++;
+		}
+	}
+	free(ports);
+	free(shares);
+	return ret;
+}
+
+/* MoxaNix main program loop. */
+int main(int argc, char *argv[])
+{
+	int ret, i;
+	int workers_option = 1;
+	sigset_t signals;
+	const char *control_path = NULL;
+	const char *request_path = NULL;
+	config_t config;
+	port_config_t port;
+
 	/* check argument count */
 	if (argc <= 1)
 	{
@@ -89,22 +521,36 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 	/* grab arguments */
-	debug_messages = 0;
-	while ((ret = getopt(argc, argv, ":p:t:b:dh")) != -1)
+	config_set_defaults(&port);
+	while ((ret = getopt(argc, argv, ":c:w:p:t:b:o:s:C:l:dh")) != -1)
 	{
 		size_t path_len;
-		speed_t baudrate;
+		long number;
 		switch (ret)
 		{
+			/* get configuration file path */
+			case 'c':
+				config_path = optarg;
+				break;
+			/* get the number of event loop threads */
+			case 'w':
+				if (config_parse_number(optarg, 1, WORKERS_MAX, &number) < 0)
+				{
+					LOG("error, invalid worker count, should be 1 to %d\n", WORKERS_MAX);
+					usage();
+					return -1;
+				}
+				workers_option = (int) number;
+				break;
 			/* get server port number */
 			case 'p':
-				tcp_port = (unsigned int) atoi(optarg);
-				if (tcp_port < 0)
+				if (config_parse_number(optarg, 1, 65535, &number) < 0)
 				{
 					LOG("error, invalid TCP port value\n");
 					usage();
 					return -1;
 				}
+				port.tcp_port = (unsigned int) number;
 				break;
 			/* get tty device path */
 			case 't':
@@ -116,25 +562,52 @@ int main(int argc, char *argv[])
 					usage();
 					return -1;
 				}
-				/* otherwise, set tty device path in tty_dev struct */
+				/* otherwise, set tty device path in port configuration */
 				else
 				{
-					strcpy(tty_dev.path, optarg);
+					strcpy(port.tty_path, optarg);
 				}
 				break;
 			/* get tty device baud rate */
 			case 'b':
-				baudrate = baud_to_speed(atoi(optarg));
-				if (cfsetispeed(&(tty_dev.ttyset), baudrate) < 0 ||
-					cfsetospeed(&(tty_dev.ttyset), baudrate) < 0)
+				if (config_parse_number(optarg, 1, INT_MAX, &number) < 0)
 				{
-					LOG("error configuring tty device baud rate, check configuration");
+					LOG("error, invalid baud rate value\n");
+					usage();
 					return -1;
 				}
+				port.baud = (int) number;
+				break;
+			/* get optional port settings */
+			case 'o':
+				if (config_parse_option(&port, optarg) < 0)
+				{
+					usage();
+					return -1;
+				}
+				break;
+			/* get control socket path */
+			case 's':
+				control_path = optarg;
+				break;
+			/* get control socket path of a running server */
+			case 'C':
+				request_path = optarg;
+				break;
+			/* set the log level */
+			case 'l':
+				ret = log_parse_level(optarg);
+				if (ret < 0)
+				{
+					LOG_ERROR("invalid log level '%s'", optarg);
+					usage();
+					return -1;
+				}
+				log_level = ret;
 				break;
 			/* enable debug messages */
 			case 'd':
-				debug_messages = 1;
+				log_level = LOG_LEVEL_TRACE;
 				break;
 			/* print help and exit */
 			case 'h':
@@ -147,38 +620,129 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	/* start server */
-	client.socket = -1;
-	new_client.socket = -1;
-	if (server_setup(&server, tcp_port) < 0)
+	/* send a command to a running server instead of serving ports */
+	if (request_path != NULL)
 	{
-		return -1;
+		if (optind != argc - 1)
+		{
+			usage();
+			return -1;
+		}
+		return (control_request(request_path, argv[optind]) < 0) ? -1 : 0;
 	}
 
-	/* open tty device */
-	tty_dev.fd = -1;
-	if (tty_open(&tty_dev) < 0)
+	/* collect the ports to serve */
+	if (config_path != NULL)
 	{
-		LOG("error: opening of tty device at %s failed\n"
-			"\t\t-> continuing in echo mode", tty_dev.path);
-		debug_messages = 1;
+		/* all ports from the configuration file */
+		if (config_load(config_path, &config) < 0)
+		{
+			return -1;
+		}
+		if (config.count == 0)
+		{
+			LOG("no ports configured in %s", config_path);
+			config_free(&config);
+			return -1;
+		}
+		raise_file_limit();
+	}
+	else
+	{
+		/* a single port from the command line */
+		if (workers_option > 1)
+		{
+			LOG("error, workers share the ports of a configuration file\n");
+			usage();
+			return -1;
+		}
+		if (config_apply_profile(&port) < 0)
+		{
+			usage();
+			return -1;
+		}
+		config.ports = &port;
+		config.count = 1;
 	}
-	
-	LOG("Running with TCP port: %d, TTY device path: %s", tcp_port, tty_dev.path);
 
-	/* start thread function that handles tty device */
-	resources_t r = {&server, &client, &new_client, &tty_dev};
-	ret = pthread_create(&tty_thread, NULL, thread_tty_data, &r);
-	if (ret) {
-		LOG("error starting serial monitor thread, pthread_create returned %d", ret);
+	/* from here on log messages are written by the log thread */
+	log_init();
+
+	/* set up the event loops, quit signals and all sessions, the signals
+	 * are blocked before worker threads or the capture writer start */
+	ret = block_signals(&signals);
+	if (ret == 0 && workers_option > 1)
+	{
+		ret = reactor_init(&reactor);
+		if (ret == 0)
+		{
+			main_reactor = &reactor;
+			ret = setup_signals(&signals);
+		}
+		if (ret == 0)
+		{
+			ret = setup_workers(&config, workers_option);
+		}
+	}
+	else if (ret == 0)
+	{
+		ret = setup_workers(&config, 1);
+		if (ret == 0)
+		{
+			main_reactor = &workers[0].reactor;
+			ret = setup_signals(&signals);
+		}
+	}
+	if (ret == 0 && served_ports() == 0)
+	{
+		LOG("no port could be set up");
+		ret = -ENODEV;
+	}
+	if (config_path != NULL)
+	{
+		config_free(&config);
+	}
+	if (ret == 0 && control_path != NULL)
+	{
+		ret = control_open(&control, control_path, main_reactor, control_handler, NULL);
+	}
+	if (ret < 0)
+	{
+		cleanup();
 		return -1;
 	}
-	
-	/* start thread function (in this thread) that handles client data */
-	thread_client_data(&r);
-	
-	/* unexpected break from client data loop, cleanup and exit with -1 */
-	LOG("unexpected condition");
+	if (config_path == NULL && workers[0].sessions[0]->tty_dev.fd == -1)
+	{
+		LOG("error: opening of tty device at %s failed\n"
+			"\t\t-> continuing in echo mode", port.tty_path);
+		log_level = LOG_LEVEL_TRACE;
+	}
+	LOG("serving %d ports with %d workers", served_ports(), worker_count);
+
+	if (main_reactor == &reactor)
+	{
+		/* the worker threads handle the sessions, this one only signals and
+		 * control commands */
+		while ((ret = reactor_run(&reactor)) == 0 && !quitting);
+		for (i = 0; i < worker_count && ret == 0; i++)
+		{
+			ret = worker_stop(&workers[i]);
+		}
+	}
+	else
+	{
+		/* handle all sessions in this thread, returns when a quit signal
+		 * arrives */
+		worker_tune(&workers[0]);
+		ret = worker_run(&workers[0]);
+	}
+
 	cleanup();
-	return -1;
+	if (ret < 0)
+	{
+		/* unexpected break from the event loop, exit with -1 */
+		LOG("unexpected condition");
+		return -1;
+	}
+	return 0;
 }
@@ -0,0 +1,220 @@
+#include <reactor.h>
+#include <metrics.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+
+#ifndef REACTOR_IO_URING
+
+#include <sys/epoll.h>
+
+int reactor_init(reactor_t *reactor)
+{
+	reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epoll_fd == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	reactor->running = 0;
+	reactor->busy_poll_usec = 0;
+	return 0;
+}
+
+void reactor_close(reactor_t *reactor)
+{
+	if (reactor->epoll_fd != -1)
+	{
+		close(reactor->epoll_fd);
+		reactor->epoll_fd = -1;
+	}
+}
+
+int reactor_add(reactor_t *reactor, reactor_handle_t *handle, int fd,
+				unsigned int events, reactor_callback_t callback, void *context)
+{
+	struct epoll_event ev;
+
+	handle->fd = fd;
+	handle->events = events;
+	handle->callback = callback;
+	handle->context = context;
+	handle->timer = 0;
+
+	ev.events = events;
+	ev.data.ptr = handle;
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		handle->fd = -1;
+		return -errno;
+	}
+	return 0;
+}
+
+int reactor_modify(reactor_t *reactor, reactor_handle_t *handle, unsigned int events)
+{
+	struct epoll_event ev;
+
+	/* nothing to do if the watched events don't change */
+	if (handle->events == events)
+	{
+		return 0;
+	}
+
+	ev.events = events;
+	ev.data.ptr = handle;
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, handle->fd, &ev) == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	handle->events = events;
+	return 0;
+}
+
+void reactor_remove(reactor_t *reactor, reactor_handle_t *handle)
+{
+	if (handle->fd == -1)
+	{
+		return;
+	}
+	/* the kernel drops the registration on close() anyway, ignore errors */
+	epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, handle->fd, NULL);
+	handle->fd = -1;
+}
+
+void reactor_flush(reactor_t *reactor)
+{
+	/* epoll changes take effect immediately */
+}
+
+/* Polls for events without sleeping until some arrive or the busy polling
+ * time is over. Returns the number of events, 0 or -1 like epoll_wait(). */
+static int reactor_busy_poll(reactor_t *reactor, struct epoll_event *events)
+{
+	uint64_t end = metrics_clock() + (uint64_t) reactor->busy_poll_usec * 1000;
+	int n;
+
+	do
+	{
+		n = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, 0);
+	}
+	while (n == 0 && metrics_clock() < end);
+	return n;
+}
+
+int reactor_run(reactor_t *reactor)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	int i, n = 0;
+
+	reactor->running = 1;
+	while (reactor->running > 0)
+	{
+		/* no timeout, the loop only wakes up on events, unless it keeps
+		 * polling for a while to save the wakeup */
+		if (reactor->busy_poll_usec > 0)
+		{
+			n = reactor_busy_poll(reactor, events);
+		}
+		if (reactor->busy_poll_usec <= 0 || n == 0)
+		{
+			n = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+		}
+		if (n == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+			return -errno;
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			reactor_handle_t *handle = (reactor_handle_t *) events[i].data.ptr;
+			/* skip handles removed by an earlier callback in this iteration */
+			if (handle->fd == -1)
+			{
+				continue;
+			}
+			/* acknowledge timer expiration so it stops being readable */
+			if (handle->timer && !reactor_timer_ack(handle))
+			{
+				continue;
+			}
+			handle->callback(handle->context, events[i].events);
+		}
+	}
+
+	return 0;
+}
+
+#endif /* !REACTOR_IO_URING */
+
+int reactor_timer_ack(reactor_handle_t *handle)
+{
+	uint64_t expirations;
+
+	return (read(handle->fd, &expirations, sizeof(expirations)) == sizeof(expirations));
+}
+
+int reactor_timer_add(reactor_t *reactor, reactor_handle_t *handle,
+					  reactor_callback_t callback, void *context)
+{
+	int fd, ret;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		handle->fd = -1;
+		return -errno;
+	}
+	ret = reactor_add(reactor, handle, fd, REACTOR_READ, callback, context);
+	if (ret < 0)
+	{
+		close(fd);
+		return ret;
+	}
+	handle->timer = 1;
+	return 0;
+}
+
+int reactor_timer_arm(reactor_handle_t *handle, long usec)
+{
+	struct itimerspec spec;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = usec / 1000000;
+	spec.it_value.tv_nsec = (usec % 1000000) * 1000;
+	if (timerfd_settime(handle->fd, 0, &spec, NULL) == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+void reactor_timer_remove(reactor_t *reactor, reactor_handle_t *handle)
+{
+	int fd = handle->fd;
+
+	if (fd == -1)
+	{
+		return;
+	}
+	reactor_remove(reactor, handle);
+	close(fd);
+}
+
+void reactor_set_busy_poll(reactor_t *reactor, long usec)
+{
+	reactor->busy_poll_usec = usec;
+}
+
+void reactor_stop(reactor_t *reactor)
+{
+	reactor->running = 0;
+}
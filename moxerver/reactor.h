@@ -0,0 +1,146 @@
+/* Event loop dispatching readiness events of file descriptors to handlers.
+ * Uses epoll, or io_uring when built with REACTOR_IO_URING (make IO_URING=1). */
+
+#pragma once
+
+#include <common.h>
+#include <poll.h>
+
+/* event flags, values are shared with poll() and epoll() */
+#define REACTOR_READ POLLIN
+#define REACTOR_WRITE POLLOUT
+#define REACTOR_ERROR (POLLERR | POLLHUP)
+
+#define REACTOR_MAX_EVENTS 64 /* events handled in one loop iteration */
+
+/* Callback invoked with the handle context and the received event flags. */
+typedef void (*reactor_callback_t)(void *context, unsigned int events);
+
+typedef struct
+{
+	int fd;						 /* watched file descriptor, -1 if not watched */
+	unsigned int events;		 /* event flags of interest */
+	reactor_callback_t callback; /* function handling the events */
+	void *context;				 /* argument passed to the callback */
+	int timer;					 /* > 0 if the descriptor is a timer */
+#ifdef REACTOR_IO_URING
+	struct reactor_poll *poll;	 /* poll request in flight for the handle */
+#endif
+} reactor_handle_t;
+
+typedef struct
+{
+#ifdef REACTOR_IO_URING
+	struct reactor_uring *uring; /* io_uring instance */
+#else
+	int epoll_fd;				 /* epoll instance */
+#endif
+	int running;				 /* loop runs while > 0 */
+	long busy_poll_usec;		 /* time spent polling for events before sleeping */
+} reactor_t;
+
+/**
+ * Creates the event loop.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred
+ */
+int reactor_init(reactor_t *reactor);
+
+/**
+ * Releases the event loop resources.
+ */
+void reactor_close(reactor_t *reactor);
+
+/**
+ * Starts watching a file descriptor for the requested events.
+ * The handle must stay valid until it is removed from the loop.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred
+ */
+int reactor_add(reactor_t *reactor, reactor_handle_t *handle, int fd,
+				unsigned int events, reactor_callback_t callback, void *context);
+
+/**
+ * Changes the events watched on an already added handle.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred
+ */
+int reactor_modify(reactor_t *reactor, reactor_handle_t *handle, unsigned int events);
+
+/**
+ * Stops watching the file descriptor of a handle.
+ * Pending events of the handle are not dispatched after removal.
+ */
+void reactor_remove(reactor_t *reactor, reactor_handle_t *handle);
+
+/**
+ * Hands queued changes of watched descriptors to the kernel right away instead
+ * of with the next loop iteration. With io_uring a removed descriptor stays
+ * referenced by its poll request until then, e.g. a closed server socket keeps
+ * its TCP port. Does nothing with epoll.
+ */
+void reactor_flush(reactor_t *reactor);
+
+/**
+ * Creates a one-shot timer handled by the event loop. The callback is invoked
+ * with REACTOR_READ when the armed timer expires.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred
+ */
+int reactor_timer_add(reactor_t *reactor, reactor_handle_t *handle,
+					  reactor_callback_t callback, void *context);
+
+/**
+ * Arms the timer to expire after the given number of microseconds,
+ * 0 disarms it.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred
+ */
+int reactor_timer_arm(reactor_handle_t *handle, long usec);
+
+/**
+ * Removes the timer from the event loop and releases it.
+ */
+void reactor_timer_remove(reactor_t *reactor, reactor_handle_t *handle);
+
+/**
+ * Reads the expiration count of a timer handle, so it stops being readable.
+ * Used by the event loop before a timer callback is invoked.
+ *
+ * Returns:
+ * - 1 if the timer expired
+ * - 0 if there was no expiration
+ */
+int reactor_timer_ack(reactor_handle_t *handle);
+
+/**
+ * Runs the event loop, dispatching events to the handle callbacks.
+ * Blocks until reactor_stop() is called or an error occurs.
+ *
+ * Returns:
+ * - 0 when stopped
+ * - negative errno value if an error occurred
+ */
+int reactor_run(reactor_t *reactor);
+
+/**
+ * Makes the event loop keep polling for new events for up to the given time
+ * after handling events, before it goes to sleep. Trades CPU time for the
+ * wakeup latency of the thread, 0 turns it off.
+ */
+void reactor_set_busy_poll(reactor_t *reactor, long usec);
+
+/**
+ * Makes the event loop return after the current iteration.
+ */
+void reactor_stop(reactor_t *reactor);
@@ -0,0 +1,462 @@
+#ifdef REACTOR_IO_URING
+
+#include <reactor.h>
+#include <metrics.h>
+#include <stdint.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define REACTOR_URING_ENTRIES 256 /* submission queue entries */
+#define REACTOR_URING_CQ_ENTRIES 4096 /* completion queue entries */
+
+/*
+ * Every watched handle has one poll request, its address is the io_uring user
+ * data. Polls are one-shot and armed again after the callback, so a handle is
+ * reported as long as it stays ready, like with level triggered epoll. New
+ * polls, event changes and removals are only queued and reach the kernel
+ * together with the wait for the next events, in a single system call.
+ */
+struct reactor_poll
+{
+	reactor_handle_t *handle;	/* watched handle, NULL once removed */
+	int armed;					/* > 0 while the poll is in the kernel */
+};
+
+struct reactor_uring
+{
+	int fd;						/* io_uring instance */
+	unsigned int *sq_head;		/* submission queue, consumed by the kernel */
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;		/* completion queue, consumed by the loop */
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_map;				/* mapped ring memory */
+	size_t sq_map_len;
+	void *cq_map;
+	size_t cq_map_len;
+	size_t sqes_len;
+	unsigned int queued;		/* queued requests not submitted yet */
+};
+
+static int reactor_uring_enter(struct reactor_uring *uring, unsigned int to_submit,
+							   unsigned int min_complete, unsigned int flags)
+{
+	return (int) syscall(__NR_io_uring_enter, uring->fd, to_submit, min_complete,
+						 flags, NULL, 0);
+}
+
+/* Returns a free submission queue entry, submits the queued ones if needed. */
+static struct io_uring_sqe* reactor_uring_sqe(struct reactor_uring *uring)
+{
+	unsigned int head, tail;
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	tail = *uring->sq_tail;
+	head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head == uring->sq_entries)
+	{
+		ret = reactor_uring_enter(uring, uring->queued, 0, 0);
+		if (ret < 0)
+		{
+			LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+			return NULL;
+		}
+		uring->queued -= ret;
+		head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head == uring->sq_entries)
+		{
+			return NULL;
+		}
+	}
+	sqe = &uring->sqes[tail & *uring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* Hands a filled entry over to the kernel with the next submission. */
+static void reactor_uring_queue(struct reactor_uring *uring)
+{
+	unsigned int tail = *uring->sq_tail;
+
+	uring->sq_array[tail & *uring->sq_mask] = tail & *uring->sq_mask;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring->queued++;
+}
+
+/* Converts event flags to the poll mask of a request, errors are always
+ * reported like with epoll. */
+static uint32_t reactor_uring_mask(unsigned int events)
+{
+	uint32_t mask = events | REACTOR_ERROR;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	mask = (mask << 16) | (mask >> 16);
+#endif
+	return mask;
+}
+
+/* Queues the poll request of a handle. */
+static int reactor_uring_arm(struct reactor_uring *uring, struct reactor_poll *poll)
+{
+	struct io_uring_sqe *sqe = reactor_uring_sqe(uring);
+
+	if (sqe == NULL)
+	{
+		return -EBUSY;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = poll->handle->fd;
+	sqe->poll32_events = reactor_uring_mask(poll->handle->events);
+	sqe->user_data = (uint64_t) (uintptr_t) poll;
+	reactor_uring_queue(uring);
+	poll->armed = 1;
+	return 0;
+}
+
+int reactor_init(reactor_t *reactor)
+{
+	struct reactor_uring *uring;
+	struct io_uring_params params;
+
+	reactor->running = 0;
+	reactor->busy_poll_usec = 0;
+	uring = calloc(1, sizeof(*uring));
+	if (uring == NULL)
+	{
+		LOG_ERROR("[@%d] out of memory", __LINE__);
+		return -ENOMEM;
+	}
+
+	/* task work only runs when the loop waits anyway, fall back for old kernels */
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = REACTOR_URING_CQ_ENTRIES;
+	uring->fd = (int) syscall(__NR_io_uring_setup, REACTOR_URING_ENTRIES, &params);
+	if (uring->fd == -1 && errno == EINVAL)
+	{
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = REACTOR_URING_CQ_ENTRIES;
+		uring->fd = (int) syscall(__NR_io_uring_setup, REACTOR_URING_ENTRIES, &params);
+	}
+	if (uring->fd == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		free(uring);
+		return -errno;
+	}
+
+	/* map the queues, a single mapping holds both on newer kernels */
+	uring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (uring->cq_map_len > uring->sq_map_len)
+		{
+			uring->sq_map_len = uring->cq_map_len;
+		}
+		uring->cq_map_len = 0;
+	}
+	uring->sq_map = mmap(NULL, uring->sq_map_len, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sq_map == MAP_FAILED)
+	{
+		goto error;
+	}
+	uring->cq_map = uring->sq_map;
+	if (uring->cq_map_len > 0)
+	{
+		uring->cq_map = mmap(NULL, uring->cq_map_len, PROT_READ | PROT_WRITE,
+							 MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+		if (uring->cq_map == MAP_FAILED)
+		{
+			munmap(uring->sq_map, uring->sq_map_len);
+			goto error;
+		}
+	}
+	uring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE,
+					   MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED)
+	{
+		if (uring->cq_map_len > 0)
+		{
+			munmap(uring->cq_map, uring->cq_map_len);
+		}
+		munmap(uring->sq_map, uring->sq_map_len);
+		goto error;
+	}
+
+	uring->sq_head = (unsigned int *) ((char *) uring->sq_map + params.sq_off.head);
+	uring->sq_tail = (unsigned int *) ((char *) uring->sq_map + params.sq_off.tail);
+	uring->sq_mask = (unsigned int *) ((char *) uring->sq_map + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned int *) ((char *) uring->sq_map + params.sq_off.array);
+	uring->sq_entries = params.sq_entries;
+	uring->cq_head = (unsigned int *) ((char *) uring->cq_map + params.cq_off.head);
+	uring->cq_tail = (unsigned int *) ((char *) uring->cq_map + params.cq_off.tail);
+	uring->cq_mask = (unsigned int *) ((char *) uring->cq_map + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *) ((char *) uring->cq_map + params.cq_off.cqes);
+	reactor->uring = uring;
+	LOG("event loop uses io_uring");
+	return 0;
+
+error:
+	LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+	close(uring->fd);
+	free(uring);
+	return -ENOMEM;
+}
+
+void reactor_close(reactor_t *reactor)
+{
+	struct reactor_uring *uring = reactor->uring;
+
+	if (uring == NULL)
+	{
+		return;
+	}
+	munmap(uring->sqes, uring->sqes_len);
+	if (uring->cq_map_len > 0)
+	{
+		munmap(uring->cq_map, uring->cq_map_len);
+	}
+	munmap(uring->sq_map, uring->sq_map_len);
+	/* closing the instance cancels the polls still in flight */
+	close(uring->fd);
+	free(uring);
+	reactor->uring = NULL;
+}
+
+int reactor_add(reactor_t *reactor, reactor_handle_t *handle, int fd,
+				unsigned int events, reactor_callback_t callback, void *context)
+{
+	struct reactor_poll *poll;
+
+	handle->fd = fd;
+	handle->events = events;
+	handle->callback = callback;
+	handle->context = context;
+	handle->timer = 0;
+
+	poll = calloc(1, sizeof(*poll));
+	if (poll == NULL)
+	{
+		LOG_ERROR("[@%d] out of memory", __LINE__);
+		handle->fd = -1;
+		return -ENOMEM;
+	}
+	poll->handle = handle;
+	if (reactor_uring_arm(reactor->uring, poll) < 0)
+	{
+		free(poll);
+		handle->fd = -1;
+		return -EBUSY;
+	}
+	handle->poll = poll;
+	return 0;
+}
+
+int reactor_modify(reactor_t *reactor, reactor_handle_t *handle, unsigned int events)
+{
+	struct io_uring_sqe *sqe;
+
+	/* nothing to do if the watched events don't change */
+	if (handle->events == events)
+	{
+		return 0;
+	}
+	handle->events = events;
+	if (handle->poll == NULL)
+	{
+		return -EBADF;
+	}
+
+	/* a poll being dispatched is armed with the new events afterwards */
+	if (!handle->poll->armed)
+	{
+		return 0;
+	}
+	sqe = reactor_uring_sqe(reactor->uring);
+	if (sqe == NULL)
+	{
+		return -EBUSY;
+	}
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = (uint64_t) (uintptr_t) handle->poll;
+	sqe->len = IORING_POLL_UPDATE_EVENTS;
+	sqe->poll32_events = reactor_uring_mask(events);
+	sqe->user_data = 0;
+	reactor_uring_queue(reactor->uring);
+	return 0;
+}
+
+void reactor_remove(reactor_t *reactor, reactor_handle_t *handle)
+{
+	struct reactor_poll *poll = handle->poll;
+	struct io_uring_sqe *sqe;
+
+	if (handle->fd == -1)
+	{
+		return;
+	}
+	handle->fd = -1;
+	handle->poll = NULL;
+	poll->handle = NULL;
+
+	/* the poll is released with its last completion, or after the callback
+	 * when the handle is removed while being dispatched */
+	if (poll->armed)
+	{
+		sqe = reactor_uring_sqe(reactor->uring);
+		if (sqe != NULL)
+		{
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->addr = (uint64_t) (uintptr_t) poll;
+			sqe->user_data = 0;
+			reactor_uring_queue(reactor->uring);
+		}
+	}
+}
+
+void reactor_flush(reactor_t *reactor)
+{
+	struct reactor_uring *uring = reactor->uring;
+	int ret;
+
+	if (uring->queued == 0)
+	{
+		return;
+	}
+	ret = reactor_uring_enter(uring, uring->queued, 0, 0);
+	if (ret < 0)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return;
+	}
+	uring->queued -= ret;
+}
+
+/* Dispatches one completion to the callback of its handle. */
+static void reactor_uring_dispatch(struct reactor_uring *uring, struct io_uring_cqe *cqe)
+{
+	struct reactor_poll *poll = (struct reactor_poll *) (uintptr_t) cqe->user_data;
+	reactor_handle_t *handle;
+	unsigned int events;
+
+	/* results of event changes and removals need no handling */
+	if (poll == NULL)
+	{
+		return;
+	}
+	poll->armed = 0;
+	handle = poll->handle;
+	if (handle == NULL)
+	{
+		free(poll);
+		return;
+	}
+
+	/* an event change can arrive after the poll completed, drop stale events */
+	events = (cqe->res < 0) ? REACTOR_ERROR :
+			 ((unsigned int) cqe->res & (handle->events | REACTOR_ERROR));
+	if (events != 0 && !(handle->timer && !reactor_timer_ack(handle)))
+	{
+		handle->callback(handle->context, events);
+	}
+
+	/* the callback may have removed the handle */
+	if (poll->handle == NULL)
+	{
+		free(poll);
+		return;
+	}
+	if (reactor_uring_arm(uring, poll) < 0)
+	{
+		LOG("problem watching file descriptor %d, no more events", handle->fd);
+	}
+}
+
+/* Submits the queued requests and polls for completions without sleeping
+ * until some arrive or the busy polling time is over. Completions of deferred
+ * task work are only posted inside io_uring_enter(), so the ring is entered
+ * each time instead of just watching the completion queue.
+ * Returns 1 if completions are ready, 0 otherwise. */
+static int reactor_uring_busy_poll(reactor_t *reactor)
+{
+	struct reactor_uring *uring = reactor->uring;
+	uint64_t end = metrics_clock() + (uint64_t) reactor->busy_poll_usec * 1000;
+	int ret;
+
+	do
+	{
+		ret = reactor_uring_enter(uring, uring->queued, 0, IORING_ENTER_GETEVENTS);
+		if (ret < 0)
+		{
+			return 0;
+		}
+		uring->queued -= ret;
+		if (*uring->cq_head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			return 1;
+		}
+	}
+	while (metrics_clock() < end);
+	return 0;
+}
+
+int reactor_run(reactor_t *reactor)
+{
+	struct reactor_uring *uring = reactor->uring;
+	unsigned int head, tail;
+	int ret;
+
+	reactor->running = 1;
+	while (reactor->running > 0)
+	{
+		/* submit all queued requests and wait for events in one call, unless
+		 * polling for a while already found some */
+		if (reactor->busy_poll_usec > 0 && reactor_uring_busy_poll(reactor))
+		{
+			ret = 0;
+		}
+		else
+		{
+			ret = reactor_uring_enter(uring, uring->queued, 1, IORING_ENTER_GETEVENTS);
+		}
+		if (ret < 0)
+		{
+			/* with a full completion queue just handle the completions */
+			if (errno != EINTR && errno != EBUSY && errno != EAGAIN)
+			{
+				LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+				return -errno;
+			}
+		}
+		else
+		{
+			uring->queued -= ret;
+		}
+
+		head = *uring->cq_head;
+		tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail && reactor->running > 0)
+		{
+			struct io_uring_cqe cqe = uring->cqes[head & *uring->cq_mask];
+			/* free the entry before the callback queues new requests */
+			head++;
+			__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+			reactor_uring_dispatch(uring, &cqe);
+		}
+	}
+
+	return 0;
+}
+
+#endif /* REACTOR_IO_URING */
@@ -0,0 +1,155 @@
+#include <ring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RING_FILE_MAGIC 0x474e4952 /* "RING" */
+
+/* Header in front of the data of a file backed ring. */
+struct ring_file
+{
+	uint32_t magic;		/* RING_FILE_MAGIC once the header is valid */
+	uint32_t reserved;
+	uint64_t size;		/* ring capacity the file was created with */
+	uint64_t head;		/* head position, updated with every write */
+};
+
+int ring_init(ring_t *ring, size_t size)
+{
+	ring->data = malloc(size);
+	if (ring->data == NULL)
+	{
+		ring->size = 0;
+		return -ENOMEM;
+	}
+	ring->size = size;
+	ring->head = 0;
+	ring->file = NULL;
+	return 0;
+}
+
+int ring_init_file(ring_t *ring, size_t size, const char *path)
+{
+	size_t map_len = sizeof(struct ring_file) + size;
+	struct ring_file *file;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	if (fd == -1)
+	{
+		LOG("error opening ring file %s: %s", path, strerror(errno));
+		return -errno;
+	}
+	/* a file of another size holds no usable ring, start over */
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size != map_len)
+	{
+		if (ftruncate(fd, 0) == -1 || ftruncate(fd, map_len) == -1)
+		{
+			LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+			close(fd);
+			return -errno;
+		}
+	}
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+
+	file = (struct ring_file *) map;
+	if (file->magic != RING_FILE_MAGIC || file->size != size)
+	{
+		memset(file, 0, sizeof(*file));
+		file->size = size;
+		file->magic = RING_FILE_MAGIC;
+	}
+	ring->data = (char *) map + sizeof(struct ring_file);
+	ring->size = size;
+	ring->head = file->head;
+	ring->file = file;
+	return 0;
+}
+
+void ring_free(ring_t *ring)
+{
+	if (ring->file != NULL)
+	{
+		munmap(ring->file, sizeof(struct ring_file) + ring->size);
+		ring->file = NULL;
+		ring->data = NULL;
+		ring->size = 0;
+		return;
+	}
+	free(ring->data);
+	ring->data = NULL;
+	ring->size = 0;
+}
+
+void ring_write(ring_t *ring, const char *databuf, size_t datalen)
+{
+	size_t offset, chunk;
+
+	/* only the newest data fits if there is more than the ring size */
+	if (datalen > ring->size)
+	{
+		ring->head += datalen - ring->size;
+		databuf += datalen - ring->size;
+		datalen = ring->size;
+	}
+
+	/* copy up to the ring end, then wrap around */
+	offset = ring->head % ring->size;
+	chunk = ring->size - offset;
+	if (chunk > datalen)
+	{
+		chunk = datalen;
+	}
+	memcpy(ring->data + offset, databuf, chunk);
+	memcpy(ring->data, databuf + chunk, datalen - chunk);
+	ring->head += datalen;
+	/* publish the head only after the data, the file is read after a crash */
+	if (ring->file != NULL)
+	{
+		ring->file->head = ring->head;
+	}
+}
+
+uint64_t ring_catch_up(const ring_t *ring, uint64_t *pos)
+{
+	uint64_t lost = 0;
+
+	if (ring_pending(ring, *pos) > ring->size)
+	{
+		lost = ring_pending(ring, *pos) - ring->size;
+		*pos += lost;
+	}
+	return lost;
+}
+
+int ring_peek(const ring_t *ring, uint64_t pos, struct iovec iov[2])
+{
+	size_t pending = (size_t) ring_pending(ring, pos);
+	size_t offset, chunk;
+
+	if (pending == 0)
+	{
+		return 0;
+	}
+
+	offset = pos % ring->size;
+	chunk = ring->size - offset;
+	if (chunk >= pending)
+	{
+		iov[0].iov_base = ring->data + offset;
+		iov[0].iov_len = pending;
+		return 1;
+	}
+	iov[0].iov_base = ring->data + offset;
+	iov[0].iov_len = chunk;
+	iov[1].iov_base = ring->data;
+	iov[1].iov_len = pending - chunk;
+	return 2;
+}
@@ -0,0 +1,97 @@
+/* Byte ring buffer queueing data for readers at their own pace. */
+
+#pragma once
+
+#include <common.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Positions are absolute byte counts since the ring was created, so a reader
+ * only keeps its own 64-bit position and the writer never has to know about
+ * readers. The ring always accepts data by overwriting the oldest bytes, a
+ * reader that lags more than the ring size has lost data.
+ */
+typedef struct
+{
+	char *data;				/* ring storage */
+	size_t size;			/* capacity in bytes */
+	uint64_t head;			/* position after the last written byte */
+	struct ring_file *file;	/* header of a file backed ring, NULL otherwise */
+} ring_t;
+
+/**
+ * Allocates the ring storage.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative ENOMEM value (-ENOMEM) if the storage can't be allocated
+ */
+int ring_init(ring_t *ring, size_t size);
+
+/**
+ * Maps the ring storage from a file, so the ring content and head position
+ * survive a restart. A file that doesn't match the ring size is reset.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if the file can't be created or mapped
+ */
+int ring_init_file(ring_t *ring, size_t size, const char *path);
+
+/**
+ * Releases the ring storage.
+ */
+void ring_free(ring_t *ring);
+
+/**
+ * Appends data to the ring, overwriting the oldest data if needed.
+ */
+void ring_write(ring_t *ring, const char *databuf, size_t datalen);
+
+/**
+ * Returns the number of bytes queued for a reader at the given position.
+ * The result can exceed the ring size if the reader has lost data.
+ */
+static inline uint64_t ring_pending(const ring_t *ring, uint64_t pos)
+{
+	return ring->head - pos;
+}
+
+/**
+ * Returns the number of bytes that can be written before the data of a reader
+ * at the given position gets overwritten.
+ */
+static inline size_t ring_space(const ring_t *ring, uint64_t pos)
+{
+	uint64_t pending = ring_pending(ring, pos);
+	return (pending >= ring->size) ? 0 : (size_t) (ring->size - pending);
+}
+
+/**
+ * Returns the position of the oldest data still in the ring, limited to at
+ * most the given number of bytes before the head.
+ */
+static inline uint64_t ring_tail(const ring_t *ring, size_t max_len)
+{
+	uint64_t len = (ring->head < ring->size) ? ring->head : ring->size;
+	return ring->head - ((len < max_len) ? len : max_len);
+}
+
+/**
+ * Moves a lagging reader position to the oldest data still in the ring.
+ *
+ * Returns:
+ * - number of bytes the reader has lost
+ */
+uint64_t ring_catch_up(const ring_t *ring, uint64_t *pos);
+
+/**
+ * Describes the data queued for a reader at the given position with up to two
+ * buffers, the second one is used when the data wraps around the ring end.
+ * The reader position must not lag more than the ring size.
+ *
+ * Returns:
+ * - number of used buffers (0, 1 or 2)
+ */
+int ring_peek(const ring_t *ring, uint64_t pos, struct iovec iov[2]);
@@ -16,7 +16,7 @@ int server_setup(server_t *server, unsigned int port)
 	server->socket = socket(AF_INET, SOCK_STREAM, 0);
 	if (server->socket == -1)
 	{
-		LOG("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
 		return -errno;
 	}
 	LOG("socket created");
@@ -25,21 +25,21 @@ int server_setup(server_t *server, unsigned int port)
 	opt = 1; /* true value for setsockopt option */
 	if (setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) == -1)
 	{
-		LOG("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
 		return -errno;
 	}
 	/* turn off Nagle algorithm */
 	opt = 1; /* true value for setsockopt option */
 	if (setsockopt(server->socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int)) == -1)
 	{
-		LOG("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
 		return -errno;
 	}
 	
 	/* bind server address to a socket */
 	if (bind(server->socket, (struct sockaddr *) &server->address, sizeof(server->address)) == -1)
 	{
-		LOG("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
 		return -errno;
 	}
 	LOG("bind successful");
@@ -51,7 +51,7 @@ int server_setup(server_t *server, unsigned int port)
 	/* listen for a client connection, allow (max-1) connections in queue */
 	if (listen(server->socket, (SERVER_MAX_CONNECTIONS - 1)) == -1)
 	{
-		LOG("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
 		return -errno;
 	}
 	
@@ -84,13 +84,13 @@ int server_accept(server_t *server, client_t *accepted_client)
 	accepted_client->socket = accept(server->socket, (struct sockaddr *) &accepted_client->address, (socklen_t *) &namelen);
 	if (accepted_client->socket == -1)
 	{
-		LOG("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
 		return -errno;
 	}
 	/* make the client socket non-blocking */
 	if (fcntl(accepted_client->socket, F_SETFL, O_NONBLOCK) == -1)
 	{
-		LOG("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
 		return -errno;
 	}
 	
@@ -0,0 +1,1502 @@
+#include <session.h>
+#include <telnet.h>
+
+/* forward declarations of event handlers */
+static void session_handle_client(void *context, unsigned int events);
+static void session_flush_client(session_t *session);
+static void session_handle_observer(void *context, unsigned int events);
+
+/* Watches the tty device for data only if it is neither paused nor batching,
+ * and for space in its output queue while client data waits for it. */
+static void session_update_tty(session_t *session)
+{
+	if (session->tty_dev.fd != -1)
+	{
+		reactor_modify(session->reactor, &session->tty_handle,
+					   ((session->tty_paused || session->tty_batching) ? 0 : REACTOR_READ) |
+					   (session->tty_queued > 0 ? REACTOR_WRITE : 0));
+	}
+}
+
+/* Continues reading the tty device. */
+static void session_resume_tty(session_t *session)
+{
+	session->tty_paused = 0;
+	session_update_tty(session);
+}
+
+/* Moves a reader position that landed inside an escaped IAC pair, e.g. at the
+ * oldest data of the ring, to the end of the pair, a lone IAC would swallow
+ * the byte after it. Encoded IACs only come in pairs and the ring head always
+ * ends one, so an odd run of IACs from the position on starts mid-pair.
+ * Returns the number of skipped bytes. */
+static uint64_t session_align_output(session_t *session, uint64_t *pos)
+{
+	struct iovec iov[2];
+	size_t run = 0, i;
+	int count, k;
+
+	if (session->encode_buf == NULL)
+	{
+		return 0;
+	}
+	count = ring_peek(&session->output, *pos, iov);
+	for (k = 0; k < count; k++)
+	{
+		for (i = 0; i < iov[k].iov_len && ((unsigned char *) iov[k].iov_base)[i] == 0xFF; i++);
+		run += i;
+		if (i < iov[k].iov_len)
+		{
+			break;
+		}
+	}
+	if (run % 2 == 0)
+	{
+		return 0;
+	}
+	(*pos)++;
+	return 1;
+}
+
+/* Moves a lagging reader position to the oldest data still in the ring, see
+ * ring_catch_up(), without splitting an escaped IAC.
+ * Returns the number of bytes the reader has lost. */
+static uint64_t session_catch_up(session_t *session, uint64_t *pos)
+{
+	uint64_t lost = ring_catch_up(&session->output, pos);
+
+	if (lost > 0)
+	{
+		lost += session_align_output(session, pos);
+	}
+	return lost;
+}
+
+/* Returns the position new readers start at, the configured history before
+ * the newest data, see ring_tail(). */
+static uint64_t session_history_start(session_t *session)
+{
+	uint64_t pos = ring_tail(&session->output, session->config.history);
+
+	session_align_output(session, &pos);
+	return pos;
+}
+
+/* Checks if new tty data goes to the client through the splice pipe. Observers
+ * need the data in the output ring, so splicing pauses while any are connected
+ * and resumes once the client received everything queued in the ring. */
+static int session_splicing(session_t *session)
+{
+	return (session->splice_pipe[0] != -1 && session->client.socket != -1 &&
+			session->observer_count == 0 &&
+			ring_pending(&session->output, session->client.output_pos) == 0);
+}
+
+/* Closes the splice pipe, tty data then goes through the output ring. */
+static void session_close_splice(session_t *session)
+{
+	if (session->splice_pipe[0] != -1)
+	{
+		close(session->splice_pipe[0]);
+		close(session->splice_pipe[1]);
+		session->splice_pipe[0] = -1;
+		session->splice_pipe[1] = -1;
+	}
+	session->splice_pending = 0;
+}
+
+/* Discards data left in the splice pipe. */
+static size_t session_drain_splice(session_t *session)
+{
+	size_t drained = session->splice_pending;
+	char buf[BUFFER_LEN];
+
+	while (session->splice_pending > 0)
+	{
+		ssize_t ret = read(session->splice_pipe[0], buf,
+						   session->splice_pending < sizeof(buf) ?
+						   session->splice_pending : sizeof(buf));
+		if (ret <= 0)
+		{
+			/* the pipe state is unknown, stop splicing */
+			session_close_splice(session);
+			break;
+		}
+		session->splice_pending -= ret;
+	}
+	return drained;
+}
+
+/* Moves data left in the splice pipe into the output ring, the client then
+ * receives it from there in order. */
+static void session_unsplice(session_t *session)
+{
+	client_t *client = &session->client;
+	char buf[BUFFER_LEN];
+	ssize_t ret;
+
+	client->output_pos = session->output.head;
+	while (session->splice_pending > 0)
+	{
+		ret = read(session->splice_pipe[0], buf,
+				   session->splice_pending < sizeof(buf) ?
+				   session->splice_pending : sizeof(buf));
+		if (ret <= 0)
+		{
+			/* the pipe state is unknown, stop splicing */
+			session_close_splice(session);
+			break;
+		}
+		ring_write(&session->output, buf, ret);
+		session->splice_pending -= ret;
+	}
+	/* a pipe larger than the ring loses its oldest data */
+	metrics_add(&session->metrics.output_dropped_bytes,
+				session_catch_up(session, &client->output_pos));
+	/* the moved data keeps the time it was read */
+	if (session->splice_since != 0)
+	{
+		metrics_track(&session->output_tracker, session->output.head, session->splice_since);
+		session->splice_since = 0;
+	}
+}
+
+/* Returns the events to watch on a client or observer socket. Queued output,
+ * e.g. replayed history after the admission dialog, is sent once the socket is
+ * writable. The client isn't read while its data waits for the tty device, so
+ * a full tty output queue slows the client down through TCP flow control. */
+static unsigned int session_client_events(session_t *session, client_t *client)
+{
+	unsigned int events = REACTOR_READ;
+
+	if (client == &session->client)
+	{
+		if (session->tty_queued > 0)
+		{
+			events = 0;
+		}
+		if (session->splice_pending > 0)
+		{
+			events |= REACTOR_WRITE;
+		}
+	}
+	if (ring_pending(&session->output, client->output_pos) > 0)
+	{
+		events |= REACTOR_WRITE;
+	}
+	return events;
+}
+
+/* Closes the connected client and stops watching its socket. */
+static void session_drop_client(session_t *session)
+{
+	uint64_t unsent = ring_pending(&session->output, session->client.output_pos);
+
+	if (session->splice_pending > 0)
+	{
+		unsent += session_drain_splice(session);
+	}
+	reactor_remove(session->reactor, &session->client_handle);
+	metrics_observe(&session->metrics.session_seconds, time(NULL) - session->client_since);
+	metrics_track_reset(&session->output_tracker);
+	session->splice_since = 0;
+	strcpy(session->last_client_ip, session->client.ip_string);
+	client_close(&session->client);
+	if (unsent > 0 || metrics_get(&session->metrics.output_dropped_bytes) > 0)
+	{
+		LOG("port %u: %llu bytes left unsent, %llu bytes dropped so far",
+			session->config.tcp_port, (unsigned long long) unsent,
+			(unsigned long long) metrics_get(&session->metrics.output_dropped_bytes));
+	}
+	/* nothing is waiting for queue space anymore, neither on the client
+	 * socket nor on the tty device */
+	session->tty_queued = 0;
+	session_resume_tty(session);
+}
+
+/* Closes the tty device after an unrecoverable error. */
+static void session_drop_tty(session_t *session)
+{
+	reactor_remove(session->reactor, &session->tty_handle);
+	tty_close(&session->tty_dev);
+	session->tty_paused = 0;
+	session->tty_batching = 0;
+	/* data waiting for the device is lost, the client is read again */
+	if (session->tty_queued > 0)
+	{
+		session->tty_queued = 0;
+		if (session->client.socket != -1)
+		{
+			reactor_modify(session->reactor, &session->client_handle,
+						   session_client_events(session, &session->client));
+		}
+	}
+}
+
+/* Closes an observer and frees its slot. */
+static void session_drop_observer(session_t *session, observer_t *observer)
+{
+	reactor_remove(session->reactor, &observer->handle);
+	if (observer->dropped > 0)
+	{
+		LOG("observer %s was too slow for %llu bytes", observer->client.ip_string,
+			(unsigned long long) observer->dropped);
+	}
+	client_close(&observer->client);
+	session->observer_count--;
+}
+
+/* Adds the new client as a read-only observer, it receives tty data from now on. */
+static int session_connect_observer(session_t *session, client_t *client)
+{
+	observer_t *observer = NULL;
+	char msg[BUFFER_LEN];
+	int i;
+
+	for (i = 0; i < session->config.observers; i++)
+	{
+		if (session->observers[i].client.socket == -1)
+		{
+			observer = &session->observers[i];
+			break;
+		}
+	}
+	if (observer == NULL)
+	{
+		/* raw clients don't expect any text from the server */
+		if (client->telnet)
+		{
+			snprintf(msg, sizeof(msg), "\nNo more observers allowed on port %u.\n",
+					 session->config.tcp_port);
+			client_write(client, msg, strlen(msg));
+		}
+		LOG("rejected observer %s, all %d slots taken", client->ip_string,
+			session->config.observers);
+		metrics_add(&session->metrics.client_rejects, 1);
+		client_close(client);
+		return -EBUSY;
+	}
+
+	/* observers read the output ring, move data still in the splice pipe there */
+	if (session->splice_pending > 0)
+	{
+		session_unsplice(session);
+	}
+
+	memcpy(&observer->client, client, sizeof(client_t));
+	observer->client.output_pos = session_history_start(session);
+	observer->dropped = 0;
+	observer->session = session;
+	if (reactor_add(session->reactor, &observer->handle, observer->client.socket,
+					session_client_events(session, &observer->client),
+					session_handle_observer, observer) != 0)
+	{
+		client_close(&observer->client);
+		return -1;
+	}
+	session->observer_count++;
+	metrics_add(&session->metrics.observer_connects, 1);
+	LOG("observer %s connected, %d watching port %u", observer->client.ip_string,
+		session->observer_count, session->config.tcp_port);
+	return 0;
+}
+
+/* Makes the new client the connected client, it receives the history and
+ * tty data from now on. */
+static int session_connect_client(session_t *session, client_t *client)
+{
+	memcpy(&session->client, client, sizeof(client_t));
+	/* measures how long client data waits for the event loop */
+	client_timestamp_arrivals(&session->client);
+	session->client.output_pos = session_history_start(session);
+	if (reactor_add(session->reactor, &session->client_handle, session->client.socket,
+					session_client_events(session, &session->client),
+					session_handle_client, session) != 0)
+	{
+		client_close(&session->client);
+		return -1;
+	}
+	LOG("client %s connected", session->client.ip_string);
+	session->client_since = time(NULL);
+	metrics_add(&session->metrics.client_connects, 1);
+	if (strcmp(session->client.ip_string, session->last_client_ip) == 0)
+	{
+		metrics_add(&session->metrics.client_reconnects, 1);
+	}
+
+	/* with the block policy new tty data must not overwrite the history */
+	if (session->config.overflow == OVERFLOW_BLOCK &&
+		ring_space(&session->output, session->client.output_pos) < session->output_max)
+	{
+		session->tty_paused = 1;
+		session_update_tty(session);
+	}
+	return 0;
+}
+
+/* Arms the admission timer for the earliest answer due, or disarms it. */
+static void session_arm_admission_timer(session_t *session)
+{
+	uint64_t now = metrics_clock();
+	uint64_t next = 0;
+	int i;
+
+	for (i = 0; i < SESSION_ADMISSIONS; i++)
+	{
+		if (session->admissions[i].client.socket != -1 &&
+			(next == 0 || session->admissions[i].deadline < next))
+		{
+			next = session->admissions[i].deadline;
+		}
+	}
+	reactor_timer_arm(&session->admission_timer,
+					  (next == 0) ? 0 : (next > now) ? (long) ((next - now) / 1000) + 1 : 1);
+}
+
+/* Takes a client out of the login dialog and frees its slot, the client
+ * itself is left open. */
+static void session_end_admission(session_t *session, admission_t *a)
+{
+	reactor_remove(session->reactor, &a->handle);
+	a->client.socket = -1;
+	session->admission_count--;
+}
+
+/* Closes a client in the login dialog and frees its slot. */
+static void session_reject_admission(session_t *session, admission_t *a, const char *reason)
+{
+	char timestamp[TIMESTAMP_LEN];
+
+	reactor_remove(session->reactor, &a->handle);
+	client_close(&a->client);
+	session->admission_count--;
+	time2string(time(NULL), timestamp);
+	LOG("rejected new client request %s @ %s, %s", a->client.ip_string, timestamp, reason);
+	metrics_add(&session->metrics.client_rejects, 1);
+}
+
+/* Asks a new client if the connected client should be dropped. */
+static void session_ask_takeover(session_t *session, admission_t *a)
+{
+	client_t *client = &a->client;
+	char msg[BUFFER_LEN];
+	char timestamp[TIMESTAMP_LEN];
+
+	/* inform the new client that the port is already in use */
+	time2string(session->client.last_active, timestamp);
+	snprintf(msg, sizeof(msg), "\nPort %u is already being used!\n"
+			 "Current user and last activity:\n%s @ %s\n",
+			 session->config.tcp_port, session->client.username, timestamp);
+	client_write(client, msg, strlen(msg));
+
+	/* ask the new client if the current client should be dropped */
+	snprintf(msg, sizeof(msg), "\nDo you want to drop the current user?\n"
+			 "If yes then please type YES DROP (in uppercase):\n");
+	client_write(client, msg, strlen(msg));
+
+	if (session->config.observers > 0)
+	{
+		snprintf(msg, sizeof(msg), "To only watch the port type WATCH:\n");
+		client_write(client, msg, strlen(msg));
+	}
+	client_write(client, "> ", 2);
+}
+
+/* Gives the port to a client that finished the login dialog, or lets it watch. */
+static void session_admit(session_t *session, admission_t *a)
+{
+	client_t client;
+	char timestamp[TIMESTAMP_LEN];
+	char msg[TELNET_MSG_LEN_CHARMODE];
+
+	memcpy(&client, &a->client, sizeof(client_t));
+	session_end_admission(session, a);
+
+	/* character mode keeps the telnet client from echoing its input */
+	telnet_message_set_character_mode(msg);
+
+	/* observers leave the connected client alone */
+	if (a->observe)
+	{
+		client_write(&client, msg, TELNET_MSG_LEN_CHARMODE);
+		session_connect_observer(session, &client);
+		return;
+	}
+
+	/* drop the currently connected client, the new one asked for it or
+	 * the client got the port while the new one was logging in */
+	if (session->client.socket != -1)
+	{
+		time2string(time(NULL), timestamp);
+		LOG("dropped client %s @ %s", session->client.ip_string, timestamp);
+		metrics_add(&session->metrics.client_takeovers, 1);
+		session_drop_client(session);
+	}
+
+	if (session_connect_client(session, &client) == 0)
+	{
+		client_write(&session->client, msg, TELNET_MSG_LEN_CHARMODE);
+	}
+}
+
+/* Handles the answers of a client in the login dialog. */
+static void session_handle_admission(void *context, unsigned int events)
+{
+	admission_t *a = (admission_t *) context;
+	session_t *session = a->session;
+	int ret;
+
+	ret = client_read_line(&a->client, a->line, &a->line_len, sizeof(a->line));
+	if (ret < 0)
+	{
+		session_reject_admission(session, a, "disconnected");
+		session_arm_admission_timer(session);
+		return;
+	}
+
+	/* answers typed ahead arrive together, they are taken one by one */
+	while (ret > 0)
+	{
+		if (a->state == ADMISSION_USERNAME)
+		{
+			client_set_username(&a->client, a->line);
+			session_admit(session, a);
+			break;
+		}
+		else if (session->config.observers > 0 && strncmp(a->line, "WATCH", 5) == 0)
+		{
+			a->observe = 1;
+			a->state = ADMISSION_USERNAME;
+			a->deadline = metrics_clock() + SESSION_ADMISSION_SEC * 1000000000ULL;
+			client_ask_username(&a->client);
+		}
+		else if (strncmp(a->line, "YES DROP", 8) == 0)
+		{
+			a->state = ADMISSION_USERNAME;
+			a->deadline = metrics_clock() + SESSION_ADMISSION_SEC * 1000000000ULL;
+			client_ask_username(&a->client);
+		}
+		else
+		{
+			session_reject_admission(session, a, "not confirmed");
+			break;
+		}
+		ret = client_next_line(&a->client, a->line, &a->line_len, sizeof(a->line));
+	}
+	session_arm_admission_timer(session);
+}
+
+/* Closes clients in the login dialog that didn't answer in time. */
+static void session_handle_admission_timer(void *context, unsigned int events)
+{
+	session_t *session = (session_t *) context;
+	uint64_t now = metrics_clock();
+	int i;
+
+	for (i = 0; i < SESSION_ADMISSIONS; i++)
+	{
+		if (session->admissions[i].client.socket != -1 && session->admissions[i].deadline <= now)
+		{
+			session_reject_admission(session, &session->admissions[i], "no answer");
+		}
+	}
+	session_arm_admission_timer(session);
+}
+
+/* Handles new connection requests on the server socket. */
+static void session_handle_server(void *context, unsigned int events)
+{
+	session_t *session = (session_t *) context;
+	admission_t *a = NULL;
+	client_t client;
+	char msg[BUFFER_LEN];
+	char timestamp[TIMESTAMP_LEN];
+	int i;
+
+	LOG("received client connection request on port %u", session->config.tcp_port);
+
+	if (client_init(&client, session->config.buffer_len) < 0)
+	{
+		LOG_ERROR("[@%d] out of memory", __LINE__);
+		return;
+	}
+
+	/* accept new connection request */
+	if (server_accept(&session->server, &client) != 0)
+	{
+		free(client.data);
+		return;
+	}
+
+	/* raw clients are machines, they get the port if it is free and watch otherwise */
+	if (session->config.mode == MODE_RAW)
+	{
+		client.telnet = 0;
+		if (session->client.socket == -1)
+		{
+			session_connect_client(session, &client);
+		}
+		else if (session->config.observers > 0)
+		{
+			session_connect_observer(session, &client);
+		}
+		else
+		{
+			client_close(&client);
+			time2string(time(NULL), timestamp);
+			LOG("rejected new client request %s @ %s, port in use",
+				client.ip_string, timestamp);
+			metrics_add(&session->metrics.client_rejects, 1);
+		}
+		return;
+	}
+
+	/* telnet clients go through the login dialog, a few at a time */
+	for (i = 0; i < SESSION_ADMISSIONS; i++)
+	{
+		if (session->admissions[i].client.socket == -1)
+		{
+			a = &session->admissions[i];
+			break;
+		}
+	}
+	if (a == NULL)
+	{
+		snprintf(msg, sizeof(msg), "\nToo many connection requests, please try later.\n");
+		client_write(&client, msg, strlen(msg));
+		client_close(&client);
+
+		time2string(time(NULL), timestamp);
+		LOG("rejected new client request %s @ %s", client.ip_string, timestamp);
+		metrics_add(&session->metrics.client_rejects, 1);
+		return;
+	}
+
+	memcpy(&a->client, &client, sizeof(client_t));
+	a->session = session;
+	a->observe = 0;
+	a->line_len = 0;
+	a->deadline = metrics_clock() + SESSION_ADMISSION_SEC * 1000000000ULL;
+	if (reactor_add(session->reactor, &a->handle, a->client.socket, REACTOR_READ,
+					session_handle_admission, a) != 0)
+	{
+		client_close(&a->client);
+		return;
+	}
+	session->admission_count++;
+
+	/* a port in use needs a confirmation first, then everyone gives a username */
+	if (session->client.socket != -1)
+	{
+		a->state = ADMISSION_CONFIRM;
+		session_ask_takeover(session, a);
+	}
+	else
+	{
+		a->state = ADMISSION_USERNAME;
+		client_ask_username(&a->client);
+	}
+	session_arm_admission_timer(session);
+}
+
+/* Sends the data in the splice pipe to the client as far as the socket accepts it. */
+static void session_flush_pipe(session_t *session)
+{
+	client_t *client = &session->client;
+	ssize_t ret;
+
+	while (session->splice_pending > 0)
+	{
+		ret = splice(session->splice_pipe[0], NULL, client->socket, NULL,
+					 session->splice_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret == -1)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+			{
+				break;
+			}
+			LOG("problem writing to client %s, closing", client->ip_string);
+			session_drop_client(session);
+			return;
+		}
+		session->splice_pending -= ret;
+		metrics_add(&session->metrics.client_sent_bytes, ret);
+		metrics_observe(&session->metrics.client_write_size, ret);
+	}
+
+	/* wait for the socket to become writable only while data is queued */
+	reactor_modify(session->reactor, &session->client_handle,
+				   session_client_events(session, &session->client));
+
+	/* spliced data is measured from the oldest read until the pipe is empty */
+	if (session->splice_pending == 0 && session->splice_since != 0)
+	{
+		metrics_observe(&session->metrics.tty_to_client_usec,
+						(metrics_clock() - session->splice_since) / 1000);
+		session->splice_since = 0;
+	}
+
+	/* the pipe has room again once it is empty */
+	if (session->tty_paused && session->splice_pending == 0)
+	{
+		session_resume_tty(session);
+	}
+}
+
+/* Sends tty data queued in the output ring to a client or observer as far as
+ * its socket accepts it, both parts of wrapped data go in one gather write.
+ * Returns 0 or a negative errno value if writing failed. */
+static int session_send_ring(session_t *session, client_t *client, reactor_handle_t *handle)
+{
+	port_metrics_t *metrics = &session->metrics;
+	struct iovec iov[2];
+	int n, ret;
+
+	n = ring_peek(&session->output, client->output_pos, iov);
+	if (n > 0)
+	{
+		ret = client_writev(client, iov, n);
+		if (ret < 0)
+		{
+			if (ret != -EAGAIN && ret != -EWOULDBLOCK)
+			{
+				return ret;
+			}
+			if (client == &session->client)
+			{
+				metrics_add(&metrics->client_eagain, 1);
+			}
+		}
+		else
+		{
+			client->output_pos += ret;
+			if (client != &session->client)
+			{
+				metrics_add(&metrics->observer_sent_bytes, ret);
+			}
+			else
+			{
+				metrics_add(&metrics->client_sent_bytes, ret);
+				metrics_observe(&metrics->client_write_size, ret);
+				metrics_track_done(&session->output_tracker, client->output_pos,
+								   &metrics->tty_to_client_usec);
+				if ((size_t) ret < iov[0].iov_len + (n > 1 ? iov[1].iov_len : 0))
+				{
+					metrics_add(&metrics->client_short_writes, 1);
+				}
+			}
+		}
+	}
+
+	/* wait for the socket to become writable only while data is queued */
+	reactor_modify(session->reactor, handle, session_client_events(session, client));
+	return 0;
+}
+
+/* Sends queued tty data to the client as far as the socket accepts it. */
+static void session_flush_client(session_t *session)
+{
+	client_t *client = &session->client;
+
+	if (session->splice_pending > 0)
+	{
+		session_flush_pipe(session);
+		return;
+	}
+
+	if (session_send_ring(session, client, &session->client_handle) < 0)
+	{
+		LOG("problem writing to client %s, closing", client->ip_string);
+		session_drop_client(session);
+		return;
+	}
+
+	/* resume blocked tty reads once the output of a full read fits again */
+	if (session->tty_paused &&
+		ring_space(&session->output, client->output_pos) >= session->output_max)
+	{
+		session_resume_tty(session);
+	}
+}
+
+/* Sends new tty output to the client, or holds it back to go out together
+ * with the following reads as the coalescing policy says. Held output is sent
+ * once coalesce_bytes are queued or when the deadline timer expires. */
+static void session_send_client(session_t *session)
+{
+	port_config_t *config = &session->config;
+	uint64_t deadline = (uint64_t) config->coalesce_usec * 1000;
+	uint64_t now, gap;
+	size_t pending;
+	int gather = (config->coalesce == COALESCE_ON);
+
+	if (config->coalesce == COALESCE_OFF)
+	{
+		session_flush_client(session);
+		return;
+	}
+
+	if (config->coalesce == COALESCE_ADAPTIVE)
+	{
+		/* average over about 8 reads, a long pause counts as twice the
+		 * deadline so a new burst is recognized after a few reads */
+		now = metrics_clock();
+		gap = now - session->last_read;
+		if (gap > 2 * deadline)
+		{
+			gap = 2 * deadline;
+		}
+		session->read_gap += gap / 8 - session->read_gap / 8;
+		session->last_read = now;
+		/* holding output back only pays off if more arrives before the deadline */
+		gather = (session->read_gap < deadline);
+	}
+
+	pending = (session->splice_pending > 0) ? session->splice_pending :
+			  ring_pending(&session->output, session->client.output_pos);
+	if (!gather || pending >= config->coalesce_bytes)
+	{
+		if (session->coalescing)
+		{
+			reactor_timer_arm(&session->coalesce_timer, 0);
+			session->coalescing = 0;
+		}
+		session_flush_client(session);
+		return;
+	}
+	if (!session->coalescing)
+	{
+		reactor_timer_arm(&session->coalesce_timer, config->coalesce_usec);
+		session->coalescing = 1;
+	}
+}
+
+/* Sends the output held back by coalescing once the deadline expired. */
+static void session_handle_coalesce_timer(void *context, unsigned int events)
+{
+	session_t *session = (session_t *) context;
+
+	session->coalescing = 0;
+	if (session->client.socket != -1)
+	{
+		session_flush_client(session);
+	}
+}
+
+/* Sends queued tty data to an observer. A slow observer skips the data
+ * overwritten in the meantime, it never holds back the tty device. */
+static void session_flush_observer(session_t *session, observer_t *observer)
+{
+	uint64_t dropped = session_catch_up(session, &observer->client.output_pos);
+
+	observer->dropped += dropped;
+	metrics_add(&session->metrics.observer_dropped_bytes, dropped);
+	if (session_send_ring(session, &observer->client, &observer->handle) < 0)
+	{
+		LOG("problem writing to observer %s, closing", observer->client.ip_string);
+		session_drop_observer(session, observer);
+	}
+}
+
+/* Passes new tty data to the observers. Observers waiting for their socket to
+ * become writable are skipped, they catch up once it is. */
+static void session_flush_observers(session_t *session)
+{
+	int i;
+
+	for (i = 0; i < session->config.observers && session->observer_count > 0; i++)
+	{
+		observer_t *observer = &session->observers[i];
+		if (observer->client.socket != -1 && !(observer->handle.events & REACTOR_WRITE))
+		{
+			session_flush_observer(session, observer);
+		}
+	}
+}
+
+/* Handles events of an observer socket. */
+static void session_handle_observer(void *context, unsigned int events)
+{
+	observer_t *observer = (observer_t *) context;
+	session_t *session = observer->session;
+	int ret;
+
+	/* send queued tty data */
+	if (events & REACTOR_WRITE)
+	{
+		session_flush_observer(session, observer);
+		if (observer->client.socket == -1 || !(events & (REACTOR_READ | REACTOR_ERROR)))
+		{
+			return;
+		}
+	}
+
+	/* observers are read-only, their input is only read to notice disconnects */
+	ret = client_read(&observer->client);
+	if (ret == -ENODATA)
+	{
+		LOG("observer %s disconnected", observer->client.ip_string);
+		session_drop_observer(session, observer);
+	}
+	else if (ret < 0 && ret != -EAGAIN && ret != -EWOULDBLOCK && ret != -EINTR)
+	{
+		LOG("problem reading from observer %s, closing", observer->client.ip_string);
+		session_drop_observer(session, observer);
+	}
+}
+
+/* Queues tty data for the client according to the overflow policy. */
+static void session_queue_output(session_t *session, const char *databuf, size_t datalen)
+{
+	client_t *client = &session->client;
+	size_t space, iacs;
+	uint64_t dropped;
+
+	/* without a client the ring simply keeps the newest data */
+	if (client->socket == -1)
+	{
+		ring_write(&session->output, databuf, datalen);
+		return;
+	}
+
+	if (session->config.overflow == OVERFLOW_DROP_NEWEST)
+	{
+		space = ring_space(&session->output, client->output_pos);
+		if (datalen > space)
+		{
+			/* don't cut an escaped IAC in half, encoded IACs come in pairs */
+			for (iacs = 0; session->encode_buf != NULL && iacs < space &&
+				 (unsigned char) databuf[space - iacs - 1] == 0xFF; iacs++);
+			space -= iacs % 2;
+			metrics_add(&session->metrics.output_dropped_bytes, datalen - space);
+			datalen = space;
+		}
+	}
+	ring_write(&session->output, databuf, datalen);
+	/* with drop-oldest the client skips data overwritten in the meantime */
+	dropped = session_catch_up(session, &client->output_pos);
+	if (dropped > 0)
+	{
+		metrics_add(&session->metrics.output_dropped_bytes, dropped);
+		metrics_track_skip(&session->output_tracker, client->output_pos);
+	}
+}
+
+/* Writes the client data waiting for the tty device as far as its output
+ * queue takes it. The client is read again once everything was written, until
+ * then the device is watched for queue space, so a device held back by flow
+ * control slows the client down instead of losing its data. */
+static void session_flush_tty(session_t *session)
+{
+	int ret;
+
+	ret = tty_write(&session->tty_dev, session->client.data + session->tty_queue_pos,
+					session->tty_queued);
+	if (ret < 0)
+	{
+		/* the data can't be written anymore, a vanished device is closed
+		 * when it reports the error */
+		session->tty_queued = 0;
+	}
+	else
+	{
+		metrics_add(&session->metrics.tty_written_bytes, ret);
+		session->tty_queue_pos += ret;
+		session->tty_queued -= ret;
+		if (session->tty_queued == 0)
+		{
+			metrics_observe(&session->metrics.client_to_tty_usec,
+							(metrics_clock() - session->tty_queue_since) / 1000);
+		}
+		else if (session->tty_queue_pos == (size_t) ret)
+		{
+			/* counted once for every read that has to wait */
+			metrics_add(&session->metrics.tty_write_stalls, 1);
+		}
+	}
+	session_update_tty(session);
+	if (session->client.socket != -1)
+	{
+		reactor_modify(session->reactor, &session->client_handle,
+					   session_client_events(session, &session->client));
+	}
+}
+
+/* Passes data from the connected client to the tty device. */
+static void session_handle_client(void *context, unsigned int events)
+{
+	session_t *session = (session_t *) context;
+	int ret;
+
+	/* send queued tty data */
+	if (events & REACTOR_WRITE)
+	{
+		session_flush_client(session);
+		if (session->client.socket == -1 || !(events & (REACTOR_READ | REACTOR_ERROR)))
+		{
+			return;
+		}
+	}
+
+	/* the client data buffer is still in use, the client is only read once
+	 * the tty device took it all */
+	if (session->tty_queued > 0)
+	{
+		if (events & REACTOR_ERROR)
+		{
+			LOG("client %s disconnected", session->client.ip_string);
+			session_drop_client(session);
+		}
+		return;
+	}
+
+	/* read client data */
+	ret = client_read(&session->client);
+	/* check if client disconnected */
+	if (ret == -ENODATA)
+	{
+		LOG("client %s disconnected", session->client.ip_string);
+		session_drop_client(session);
+		return;
+	}
+	if (ret < 0)
+	{
+		/* spurious wakeups are fine, other errors end the connection */
+		if (ret != -EAGAIN && ret != -EWOULDBLOCK && ret != -EINTR)
+		{
+			LOG("problem reading from client %s, closing", session->client.ip_string);
+			session_drop_client(session);
+		}
+		return;
+	}
+	metrics_add(&session->metrics.client_read_bytes, ret);
+	/* kernel timestamps use the realtime clock, skip readings across a step */
+	if (session->client.arrival != 0)
+	{
+		struct timespec ts;
+		uint64_t now;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		now = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		if (now >= session->client.arrival)
+		{
+			metrics_observe(&session->metrics.client_wakeup_usec,
+							(now - session->client.arrival) / 1000);
+		}
+	}
+	/* pass received client data to the tty device */
+	if (session->tty_dev.fd != -1 && ret > 0)
+	{
+		session->tty_queued = ret;
+		session->tty_queue_pos = 0;
+		session->tty_queue_since = metrics_clock();
+		session_flush_tty(session);
+	}
+}
+
+/* Moves tty data into the splice pipe and on to the client socket.
+ * Returns the number of moved bytes or a negative errno value. */
+static int session_splice_tty(session_t *session)
+{
+	ssize_t ret;
+
+	ret = splice(session->tty_dev.fd, NULL, session->splice_pipe[1], NULL,
+				 session->tty_dev.data_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (ret == -1)
+	{
+		/* with data in the pipe, EAGAIN may also mean the pipe is full */
+		if (errno == EAGAIN && session->splice_pending > 0)
+		{
+			session->tty_paused = 1;
+			return 0;
+		}
+		return -errno;
+	}
+	if (ret == 0)
+	{
+		return -EIO;
+	}
+	if (session->splice_pending == 0)
+	{
+		session->splice_since = metrics_clock();
+	}
+	session->splice_pending += ret;
+	metrics_add(&session->metrics.tty_read_bytes, ret);
+	metrics_observe(&session->metrics.tty_read_size, ret);
+	session_send_client(session);
+	return (int) ret;
+}
+
+/* Reads the tty device and passes the data to the connected client. */
+static void session_read_tty(session_t *session)
+{
+	const char *data;
+	uint64_t read_time;
+	size_t len;
+	int ret;
+
+	if (session_splicing(session))
+	{
+		ret = session_splice_tty(session);
+		/* not every device supports splice(), fall back to reading */
+		if (ret == -EINVAL || ret == -ENOSYS)
+		{
+			LOG("tty device %s doesn't support splice, using reads",
+				session->tty_dev.path);
+			session_close_splice(session);
+		}
+		else if (ret >= 0)
+		{
+			goto batch;
+		}
+	}
+
+	if (!session_splicing(session))
+	{
+		ret = tty_read(&session->tty_dev);
+	}
+	if (ret <= 0)
+	{
+		if (ret == -EAGAIN || ret == -EINTR)
+		{
+			/* nothing arrived while batching, wait for the device again */
+			session->tty_batching = 0;
+			session_update_tty(session);
+			return;
+		}
+		/* a vanished device would keep the loop busy, stop watching it */
+		LOG("tty device %s failed, closing", session->tty_dev.path);
+		session_drop_tty(session);
+		return;
+	}
+
+	read_time = metrics_clock();
+	metrics_add(&session->metrics.tty_read_bytes, ret);
+	metrics_observe(&session->metrics.tty_read_size, ret);
+	data = session->tty_dev.data;
+	len = ret;
+	/* timestamps go into everything the tty data is copied to */
+	if (session->stamp_buf != NULL)
+	{
+		data = stamp_lines(&session->stamp, data, &len, session->stamp_buf);
+	}
+	if (session->capture.data != NULL)
+	{
+		capture_write(&session->capture, data, len);
+	}
+	/* encode once for all readers, the ring holds what clients receive */
+	if (session->encode_buf != NULL)
+	{
+		data = telnet_filter_client_write(&session->encoder, data, &len,
+										  session->encode_buf);
+	}
+	session_queue_output(session, data, len);
+	if (session->client.socket != -1)
+	{
+		metrics_track(&session->output_tracker, session->output.head, read_time);
+	}
+	session_flush_observers(session);
+	if (session->client.socket != -1)
+	{
+		session_send_client(session);
+
+		/* with the block policy stop reading when the next read might not fit */
+		if (session->client.socket != -1 &&
+			session->config.overflow == OVERFLOW_BLOCK &&
+			ring_space(&session->output, session->client.output_pos) < session->output_max)
+		{
+			session->tty_paused = 1;
+		}
+	}
+
+batch:
+	/* let the kernel collect more data before the next read, unless the read
+	 * filled half the buffer and more data is probably waiting already */
+	if (session->config.batch_usec > 0 && (size_t) ret < session->tty_dev.data_len / 2)
+	{
+		session->tty_batching = 1;
+		reactor_timer_arm(&session->batch_timer, session->config.batch_usec);
+	}
+	else
+	{
+		session->tty_batching = 0;
+	}
+	session_update_tty(session);
+}
+
+/* Handles events of the tty device. */
+static void session_handle_tty(void *context, unsigned int events)
+{
+	session_t *session = (session_t *) context;
+
+	/* write client data once the output queue has space again */
+	if (events & REACTOR_WRITE)
+	{
+		if (session->tty_queued > 0)
+		{
+			session_flush_tty(session);
+		}
+		if (session->tty_dev.fd == -1 || !(events & (REACTOR_READ | REACTOR_ERROR)))
+		{
+			return;
+		}
+	}
+
+	/* a paused device only reports errors, e.g. when it vanished */
+	if (session->tty_paused)
+	{
+		LOG("tty device %s failed, closing", session->tty_dev.path);
+		session_drop_tty(session);
+		return;
+	}
+	session_read_tty(session);
+}
+
+/* Reads the tty device at the end of a batching interval. */
+static void session_handle_batch_timer(void *context, unsigned int events)
+{
+	session_t *session = (session_t *) context;
+
+	if (!session->tty_batching || session->tty_dev.fd == -1)
+	{
+		return;
+	}
+	/* a blocked device is resumed by the client flush instead */
+	if (session->tty_paused)
+	{
+		session->tty_batching = 0;
+		return;
+	}
+	session_read_tty(session);
+}
+
+int session_setup(session_t *session, const port_config_t *config, reactor_t *reactor)
+{
+	int i, ret;
+
+	memset(session, 0, sizeof(*session));
+	session->config = *config;
+	session->reactor = reactor;
+	session->client.socket = -1;
+	session->tty_dev.fd = -1;
+	session->server.socket = -1;
+	session->server_handle.fd = -1;
+	session->client_handle.fd = -1;
+	session->tty_handle.fd = -1;
+	session->admission_timer.fd = -1;
+	for (i = 0; i < SESSION_ADMISSIONS; i++)
+	{
+		session->admissions[i].client.socket = -1;
+		session->admissions[i].handle.fd = -1;
+	}
+	session->batch_timer.fd = -1;
+	session->coalesce_timer.fd = -1;
+	session->splice_pipe[0] = -1;
+	session->splice_pipe[1] = -1;
+
+	/* configure tty device */
+	strcpy(session->tty_dev.path, config->tty_path);
+	session->tty_dev.data_len = config->buffer_len;
+	if (tty_set_baud(&session->tty_dev, config->baud) < 0)
+	{
+		LOG("error configuring tty device baud rate %d, check configuration",
+			config->baud);
+		return -EINVAL;
+	}
+	tty_set_flow(&session->tty_dev, config->flow);
+
+	/* queue for tty data the client hasn't received yet, also keeps the history */
+	if (config->history_file[0] != '\0')
+	{
+		ret = ring_init_file(&session->output, config->ring_size, config->history_file);
+		if (ret < 0)
+		{
+			return ret;
+		}
+		LOG("port %u: %llu bytes of history restored from %s", config->tcp_port,
+			(unsigned long long) (session->output.head -
+								  ring_tail(&session->output, config->history)),
+			config->history_file);
+	}
+	else if (ring_init(&session->output, config->ring_size) < 0)
+	{
+		LOG_ERROR("[@%d] out of memory", __LINE__);
+		return -ENOMEM;
+	}
+
+	/* telnet clients get IAC escaped data, sized for the worst case expansion */
+	session->output_max = config_output_max(config);
+	if (config->mode == MODE_TELNET)
+	{
+		telnet_encoder_init(&session->encoder, config_telnet_flags(config));
+		session->encode_buf = malloc(session->output_max);
+		if (session->encode_buf == NULL)
+		{
+			LOG_ERROR("[@%d] out of memory", __LINE__);
+			return -ENOMEM;
+		}
+	}
+
+	/* buffer for tty data with timestamps, sized for a read of empty lines */
+	if (config->timestamp)
+	{
+		stamp_init(&session->stamp);
+		session->stamp_buf = malloc(stamp_max(config->buffer_len));
+		if (session->stamp_buf == NULL)
+		{
+			LOG_ERROR("[@%d] out of memory", __LINE__);
+			return -ENOMEM;
+		}
+	}
+
+	/* slots for read-only observers, taken and freed by the event loop only */
+	if (config->observers > 0)
+	{
+		session->observers = calloc(config->observers, sizeof(observer_t));
+		if (session->observers == NULL)
+		{
+			LOG_ERROR("[@%d] out of memory", __LINE__);
+			return -ENOMEM;
+		}
+		for (i = 0; i < config->observers; i++)
+		{
+			session->observers[i].client.socket = -1;
+			session->observers[i].handle.fd = -1;
+		}
+	}
+
+	/* copy of all tty data written to disk by the capture writer */
+	if (config->capture[0] != '\0')
+	{
+		ret = capture_open(&session->capture, config);
+		if (ret < 0)
+		{
+			return ret;
+		}
+	}
+
+	/* timer closing telnet clients that don't answer the login dialog */
+	if (config->mode == MODE_TELNET)
+	{
+		ret = reactor_timer_add(reactor, &session->admission_timer,
+								session_handle_admission_timer, session);
+		if (ret < 0)
+		{
+			return ret;
+		}
+	}
+
+	/* pipe moving tty data to raw clients inside the kernel */
+	if (config->zerocopy)
+	{
+		if (pipe2(session->splice_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+		{
+			LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+			return -errno;
+		}
+		/* the pipe takes the role of the output ring, size it alike */
+		fcntl(session->splice_pipe[1], F_SETPIPE_SZ, (int) config->ring_size);
+	}
+
+	/* timer ending the batching intervals of tty reads */
+	if (config->batch_usec > 0)
+	{
+		ret = reactor_timer_add(reactor, &session->batch_timer,
+								session_handle_batch_timer, session);
+		if (ret < 0)
+		{
+			return ret;
+		}
+	}
+
+	/* timer sending client output held back by coalescing, the adaptive policy
+	 * starts out sending right away */
+	if (config->coalesce != COALESCE_OFF)
+	{
+		session->read_gap = 2 * (uint64_t) config->coalesce_usec * 1000;
+		ret = reactor_timer_add(reactor, &session->coalesce_timer,
+								session_handle_coalesce_timer, session);
+		if (ret < 0)
+		{
+			return ret;
+		}
+	}
+
+	/* start server */
+	ret = server_setup(&session->server, config->tcp_port);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	ret = reactor_add(reactor, &session->server_handle, session->server.socket,
+					  REACTOR_READ, session_handle_server, session);
+	if (ret < 0)
+	{
+		return ret;
+	}
+
+	/* open tty device, keep serving the port if it is not available */
+	if (tty_open(&session->tty_dev) < 0)
+	{
+		LOG("error: opening of tty device at %s failed", session->tty_dev.path);
+	}
+	else if (reactor_add(reactor, &session->tty_handle, session->tty_dev.fd,
+						 REACTOR_READ, session_handle_tty, session) < 0)
+	{
+		tty_close(&session->tty_dev);
+	}
+
+	LOG("Running with TCP port: %u, TTY device path: %s",
+		config->tcp_port, session->tty_dev.path);
+	return 0;
+}
+
+int session_reconfigure(session_t *session, const port_config_t *config)
+{
+	port_config_t current = session->config;
+	int ret;
+
+	/* everything but the baud rate and flow control is built into the session */
+	current.baud = config->baud;
+	current.flow = config->flow;
+	if (!config_equal(&current, config))
+	{
+		return -EBUSY;
+	}
+	if (config->baud == session->config.baud && config->flow == session->config.flow)
+	{
+		return 0;
+	}
+
+	ret = tty_set_baud(&session->tty_dev, config->baud);
+	tty_set_flow(&session->tty_dev, config->flow);
+	if (ret == 0 && session->tty_dev.fd != -1)
+	{
+		ret = tty_apply(&session->tty_dev);
+	}
+	if (ret < 0)
+	{
+		LOG("port %u: error changing baud rate to %d, flow control to %s",
+			config->tcp_port, config->baud, tty_flow_name(config->flow));
+		/* part of the new settings may have reached the device already,
+		 * bring it back to the settings the session reports */
+		tty_set_baud(&session->tty_dev, session->config.baud);
+		tty_set_flow(&session->tty_dev, session->config.flow);
+		if (session->tty_dev.fd != -1 && tty_apply(&session->tty_dev) < 0)
+		{
+			LOG("port %u: error restoring %d baud, flow control %s, the tty device "
+				"runs with unknown settings", config->tcp_port, session->config.baud,
+				tty_flow_name(session->config.flow));
+		}
+		return ret;
+	}
+	LOG("port %u: tty settings changed from %d baud, flow control %s to %d baud, "
+		"flow control %s", config->tcp_port, session->config.baud,
+		tty_flow_name(session->config.flow), config->baud, tty_flow_name(config->flow));
+	session->config.baud = config->baud;
+	session->config.flow = config->flow;
+	return 1;
+}
+
+void session_print_stats(session_t *session, FILE *out)
+{
+	unsigned int port = session->config.tcp_port;
+	uint64_t queued = 0;
+
+	if (session->client.socket != -1)
+	{
+		queued = ring_pending(&session->output, session->client.output_pos) +
+				 session->splice_pending;
+	}
+	metrics_print_port(out, port, &session->metrics);
+	metrics_print_value(out, "client_connected", port, session->client.socket != -1);
+	metrics_print_value(out, "observers_connected", port, session->observer_count);
+	metrics_print_value(out, "clients_logging_in", port, session->admission_count);
+	metrics_print_value(out, "output_queued_bytes", port, queued);
+	metrics_print_value(out, "tty_open", port, session->tty_dev.fd != -1);
+	metrics_print_value(out, "tty_paused", port, session->tty_paused);
+	metrics_print_value(out, "tty_write_queued_bytes", port, session->tty_queued);
+	if (session->capture.data != NULL)
+	{
+		metrics_print_value(out, "capture_written_bytes", port,
+							atomic_load(&session->capture.written));
+		metrics_print_value(out, "capture_dropped_bytes", port,
+							atomic_load(&session->capture.dropped));
+	}
+}
+
+void session_print_status(session_t *session, FILE *out)
+{
+	char since[TIMESTAMP_LEN];
+	char active[TIMESTAMP_LEN];
+
+	fprintf(out, "port=%u pid=%d tty=%s tty_open=%d observers=%d logging_in=%d",
+			session->config.tcp_port, (int) getpid(), session->config.tty_path,
+			session->tty_dev.fd != -1, session->observer_count, session->admission_count);
+	if (session->client.socket == -1)
+	{
+		fprintf(out, " state=idle\n");
+		return;
+	}
+	time2string(session->client_since, since);
+	time2string(session->client.last_active, active);
+	fprintf(out, " state=connected ip=%s since=%s last_activity=%s user=%s\n",
+			session->client.ip_string, since, active, session->client.username);
+}
+
+void session_close(session_t *session)
+{
+	int i;
+
+	/* close the client and observers */
+	if (session->client.socket != -1)
+	{
+		session_drop_client(session);
+	}
+	for (i = 0; session->observers != NULL && i < session->config.observers; i++)
+	{
+		if (session->observers[i].client.socket != -1)
+		{
+			session_drop_observer(session, &session->observers[i]);
+		}
+	}
+	/* the observer slots hold event loop handles, see session_free() */
+	/* close the tty device */
+	if (session->tty_dev.fd != -1)
+	{
+		session_drop_tty(session);
+	}
+	/* close the server */
+	if (session->server.socket != -1)
+	{
+		reactor_remove(session->reactor, &session->server_handle);
+		server_close(&session->server);
+		session->server.socket = -1;
+	}
+	/* close clients in the login dialog */
+	for (i = 0; i < SESSION_ADMISSIONS; i++)
+	{
+		if (session->admissions[i].client.socket != -1)
+		{
+			reactor_remove(session->reactor, &session->admissions[i].handle);
+			client_close(&session->admissions[i].client);
+		}
+	}
+	session->admission_count = 0;
+	reactor_timer_remove(session->reactor, &session->admission_timer);
+	reactor_timer_remove(session->reactor, &session->batch_timer);
+	reactor_timer_remove(session->reactor, &session->coalesce_timer);
+	session->coalescing = 0;
+	session_close_splice(session);
+	capture_close(&session->capture);
+	free(session->encode_buf);
+	session->encode_buf = NULL;
+	free(session->stamp_buf);
+	session->stamp_buf = NULL;
+	ring_free(&session->output);
+}
+
+void session_free(session_t *session)
+{
+	free(session->observers);
+	free(session);
+}
@@ -0,0 +1,146 @@
+/* Handles the session between one TCP port and one tty device. */
+
+#pragma once
+
+#include <common.h>
+#include <client.h>
+#include <server.h>
+#include <tty.h>
+#include <config.h>
+#include <reactor.h>
+#include <ring.h>
+#include <capture.h>
+#include <telnet.h>
+#include <stamp.h>
+#include <metrics.h>
+
+#define SESSION_ADMISSIONS 4		/* new clients in the login dialog at the same time */
+#define SESSION_ADMISSION_SEC 15	/* time a new client gets to answer a prompt */
+#define SESSION_LINE_LEN 64			/* longest answer to a prompt */
+
+struct session;
+
+/* steps of the login dialog with a new telnet client */
+typedef enum
+{
+	ADMISSION_CONFIRM,	/* port in use, waiting for YES DROP or WATCH */
+	ADMISSION_USERNAME,	/* waiting for the username */
+} admission_state_t;
+
+/* A new telnet client in the login dialog. The dialog is driven by the event
+ * loop, a client that doesn't answer in time is closed. */
+typedef struct
+{
+	struct session *session;	/* session the client asked for */
+	client_t client;			/* the new client, socket is -1 if the slot is free */
+	admission_state_t state;	/* prompt the client has to answer */
+	int observe;				/* > 0 if the client only watches */
+	char line[SESSION_LINE_LEN];/* answer received so far */
+	size_t line_len;			/* bytes of the answer */
+	uint64_t deadline;			/* metrics_clock() time the answer is due */
+	reactor_handle_t handle;	/* event loop handle of the client socket */
+} admission_t;
+
+/* A read-only client watching the tty output of a session. */
+typedef struct
+{
+	struct session *session;	/* session being watched */
+	client_t client;			/* the observer, socket is -1 if the slot is free */
+	uint64_t dropped;			/* tty bytes the observer was too slow for */
+	reactor_handle_t handle;	/* event loop handle of the observer socket */
+} observer_t;
+
+typedef struct session
+{
+	port_config_t config;	/* port configuration */
+	reactor_t *reactor;		/* event loop handling the session */
+	server_t server;		/* server listening for clients */
+	client_t client;		/* connected client */
+	tty_t tty_dev;			/* connected tty device */
+	admission_t admissions[SESSION_ADMISSIONS]; /* clients in the login dialog */
+	int admission_count;	/* number of clients in the login dialog */
+	ring_t output;			/* tty data queued for the client */
+	int tty_paused;			/* > 0 while tty reads wait for queue space */
+	int tty_batching;		/* > 0 while tty data is collected by the kernel */
+	size_t tty_queued;		/* client data the tty output queue didn't take yet */
+	size_t tty_queue_pos;	/* offset of that data in the client data buffer */
+	uint64_t tty_queue_since; /* metrics_clock() time the queued data was read */
+	int splice_pipe[2];		/* moves tty data to raw clients, -1 if unused */
+	size_t splice_pending;	/* bytes waiting in the splice pipe */
+	observer_t *observers;	/* observer slots, config.observers of them */
+	int observer_count;		/* number of connected observers */
+	capture_t capture;		/* tty data capture, used if config.capture is set */
+	telnet_encoder_t encoder;/* encodes tty data for telnet clients */
+	char *encode_buf;		/* encoded tty data, NULL if data is sent unchanged */
+	stamp_t stamp;			/* prefixes tty output lines with the time */
+	char *stamp_buf;		/* timestamped tty data, NULL if timestamps are off */
+	size_t output_max;		/* largest output of one tty read */
+	port_metrics_t metrics;	/* traffic counters of the port */
+	metrics_tracker_t output_tracker; /* tty reads waiting in the ring for the client */
+	uint64_t splice_since;	/* time the splice pipe got its oldest data, 0 if empty */
+	int coalescing;			/* > 0 while client output is held back until the deadline */
+	uint64_t read_gap;		/* average nsec between tty reads, for adaptive coalescing */
+	uint64_t last_read;		/* metrics_clock() time of the latest tty read */
+	time_t client_since;	/* time the connected client got the port */
+	char last_client_ip[INET_ADDRSTRLEN]; /* address of the previous client */
+
+	/* event loop handles */
+	reactor_handle_t server_handle;
+	reactor_handle_t client_handle;
+	reactor_handle_t tty_handle;
+	reactor_handle_t admission_timer;
+	reactor_handle_t batch_timer;
+	reactor_handle_t coalesce_timer;
+} session_t;
+
+/**
+ * Sets up the session server and tty device and adds them to the event loop.
+ * A tty device that can't be opened is reported, but the server keeps
+ * accepting clients.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred
+ */
+int session_setup(session_t *session, const port_config_t *config, reactor_t *reactor);
+
+/**
+ * Applies a changed port configuration to a running session without closing
+ * its clients. Only a new baud rate and flow control can be applied in place,
+ * the tty device is reconfigured right away.
+ *
+ * Returns:
+ * - 1 if the baud rate or flow control was changed
+ * - 0 if the configuration is the same
+ * - negative EBUSY value (-EBUSY) if other settings changed, the session has
+ *   to be closed and set up again
+ * - negative errno value if the tty device could not be reconfigured
+ */
+int session_reconfigure(session_t *session, const port_config_t *config);
+
+/**
+ * Prints the counters of the session and its current state, one metric per
+ * line, see metrics.h for the format.
+ */
+void session_print_stats(session_t *session, FILE *out);
+
+/**
+ * Prints the state of the session in one line of key=value fields: TCP port,
+ * server PID, tty device, whether a client is connected and, if so, its
+ * address, username, connection time and last activity. The username comes
+ * last, it may contain spaces.
+ */
+void session_print_status(session_t *session, FILE *out);
+
+/**
+ * Closes the client, tty device and server of the session. Event loop handles
+ * stay in memory, events of the current iteration may still refer to them,
+ * until session_free() is called.
+ */
+void session_close(session_t *session);
+
+/**
+ * Releases a heap allocated session closed with session_close(),
+ * once the event loop can't dispatch events fetched while it was open.
+ */
+void session_free(session_t *session);
@@ -0,0 +1,92 @@
+#include <stamp.h>
+
+void stamp_init(stamp_t *stamp)
+{
+	memset(stamp, 0, sizeof(*stamp));
+	stamp->line_start = 1;
+	stamp->second = -1;
+	/* localtime_r() doesn't read the time zone by itself */
+	tzset();
+}
+
+size_t stamp_max(size_t datalen)
+{
+	return datalen * (STAMP_LEN + 1);
+}
+
+/* Brings the cached prefix to the given time. The date and time are only
+ * formatted when the second changes, the microseconds are patched in. */
+static void stamp_update(stamp_t *stamp, const struct timespec *now)
+{
+	struct tm tm;
+	long usec;
+	int i;
+
+	if (now->tv_sec != stamp->second)
+	{
+		localtime_r(&now->tv_sec, &tm);
+		stamp->prefix[0] = '[';
+		strftime(stamp->prefix + 1, TIMESTAMP_LEN, TIMESTAMP_FORMAT, &tm);
+		memcpy(stamp->prefix + STAMP_USEC_OFFSET - 1, ".000000] ", 9);
+		stamp->second = now->tv_sec;
+	}
+	usec = now->tv_nsec / 1000;
+	for (i = STAMP_USEC_OFFSET + 5; i >= STAMP_USEC_OFFSET; i--)
+	{
+		stamp->prefix[i] = '0' + usec % 10;
+		usec /= 10;
+	}
+}
+
+const char* stamp_lines(stamp_t *stamp, const char *databuf, size_t *datalen, char *outbuf)
+{
+	struct timespec now;
+	const char *lf;
+	size_t in = 0;
+	size_t newlen = 0;
+	size_t len;
+
+	if (*datalen == 0)
+	{
+		return databuf;
+	}
+	/* the common case at high rates, a read in the middle of a line */
+	lf = memchr(databuf, '\n', *datalen);
+	if (!stamp->line_start && (lf == NULL || lf + 1 == databuf + *datalen))
+	{
+		stamp->line_start = (lf != NULL);
+		return databuf;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	stamp_update(stamp, &now);
+
+	/* copy whole lines as blocks, memchr() scans for the ends with vector
+	 * instructions */
+	while (in < *datalen)
+	{
+		if (stamp->line_start)
+		{
+			memcpy(outbuf + newlen, stamp->prefix, STAMP_LEN);
+			newlen += STAMP_LEN;
+			stamp->line_start = 0;
+		}
+		if (lf == NULL)
+		{
+			len = *datalen - in;
+		}
+		else
+		{
+			len = lf + 1 - (databuf + in);
+			stamp->line_start = 1;
+		}
+		memcpy(outbuf + newlen, databuf + in, len);
+		newlen += len;
+		in += len;
+		lf = (in < *datalen) ? memchr(databuf + in, '\n', *datalen - in) : NULL;
+	}
+
+	/* update data length */
+	*datalen = newlen;
+	return outbuf;
+}
@@ -0,0 +1,38 @@
+/* Prefixes lines of tty output with the time they were received. */
+
+#pragma once
+
+#include <common.h>
+
+/* prefix "[YYYY-MM-DDTHH:MM:SS.uuuuuu] ", date and time as in TIMESTAMP_FORMAT */
+#define STAMP_LEN 29
+#define STAMP_USEC_OFFSET 21 /* position of the microsecond digits in the prefix */
+
+/* Timestamping state kept between reads, a line can span several reads. */
+typedef struct
+{
+	int line_start;				/* > 0 if the next byte begins a line */
+	time_t second;				/* second the cached prefix was formatted for */
+	char prefix[STAMP_LEN + 1];	/* cached prefix, only the microseconds change */
+} stamp_t;
+
+/**
+ * Sets up the timestamping state, the next byte begins a line.
+ */
+void stamp_init(stamp_t *stamp);
+
+/**
+ * Returns the largest output stamp_lines() can produce for the given amount
+ * of data, reached when every byte is a newline.
+ */
+size_t stamp_max(size_t datalen);
+
+/**
+ * Inserts the current time in front of every line beginning in the data.
+ * All lines of one call get the same time, taken once. The output buffer must
+ * hold stamp_max(*datalen) bytes. Data without a line beginning is not copied.
+ *
+ * Returns:
+ * - the data to use, either databuf or outbuf, *datalen is updated
+ */
+const char* stamp_lines(stamp_t *stamp, const char *databuf, size_t *datalen, char *outbuf);
@@ -1,4 +1,7 @@
 #include <telnet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* structure for holding telnet option name and value */
 typedef struct
@@ -22,6 +25,111 @@ telnet_option_t telnet_options[] =
 	/* this list must end with {NULL, 0} */
 };
 
+/* telnet command bytes */
+#define TELNET_IAC 255
+#define TELNET_SB 250
+#define TELNET_SE 240
+#define TELNET_CR '\r'
+#define TELNET_LF '\n'
+#define TELNET_DEL 127
+#define TELNET_BS 8
+
+/* parser states */
+enum
+{
+	TELNET_STATE_DATA,		/* plain data */
+	TELNET_STATE_IAC,		/* after IAC */
+	TELNET_STATE_OPTION,	/* after IAC WILL/WONT/DO/DONT, expecting the option */
+	TELNET_STATE_SB,		/* after IAC SB, expecting the option */
+	TELNET_STATE_SB_DATA,	/* inside a subnegotiation */
+	TELNET_STATE_SB_IAC,	/* after IAC inside a subnegotiation */
+	TELNET_STATES
+};
+
+/* classes of bytes the parser distinguishes */
+enum
+{
+	TELNET_CLASS_OTHER,
+	TELNET_CLASS_IAC,
+	TELNET_CLASS_SB,
+	TELNET_CLASS_SE,
+	TELNET_CLASS_OPTION_COMMAND,
+	TELNET_CLASSES
+};
+
+/* parser actions, combined with the next state in the transition table */
+#define TELNET_STATE_MASK 0x0f
+#define TELNET_EMIT 0x10		/* pass the byte on as data */
+#define TELNET_COMMAND 0x20		/* remember the byte as option command */
+#define TELNET_OPTION 0x40		/* the byte completes an option command */
+#define TELNET_SB_OPTION 0x80	/* the byte starts a subnegotiation */
+
+static const unsigned char telnet_byte_class[256] =
+{
+	[TELNET_IAC] = TELNET_CLASS_IAC,
+	[TELNET_SB] = TELNET_CLASS_SB,
+	[TELNET_SE] = TELNET_CLASS_SE,
+	[251] = TELNET_CLASS_OPTION_COMMAND,
+	[252] = TELNET_CLASS_OPTION_COMMAND,
+	[253] = TELNET_CLASS_OPTION_COMMAND,
+	[254] = TELNET_CLASS_OPTION_COMMAND,
+};
+
+static const unsigned char telnet_transitions[TELNET_STATES][TELNET_CLASSES] =
+{
+	[TELNET_STATE_DATA] =
+	{
+		[TELNET_CLASS_OTHER] = TELNET_STATE_DATA | TELNET_EMIT,
+		[TELNET_CLASS_IAC] = TELNET_STATE_IAC,
+		[TELNET_CLASS_SB] = TELNET_STATE_DATA | TELNET_EMIT,
+		[TELNET_CLASS_SE] = TELNET_STATE_DATA | TELNET_EMIT,
+		[TELNET_CLASS_OPTION_COMMAND] = TELNET_STATE_DATA | TELNET_EMIT,
+	},
+	/* IAC IAC is an escaped data byte, other two byte commands are dropped */
+	[TELNET_STATE_IAC] =
+	{
+		[TELNET_CLASS_OTHER] = TELNET_STATE_DATA,
+		[TELNET_CLASS_IAC] = TELNET_STATE_DATA | TELNET_EMIT,
+		[TELNET_CLASS_SB] = TELNET_STATE_SB,
+		[TELNET_CLASS_SE] = TELNET_STATE_DATA,
+		[TELNET_CLASS_OPTION_COMMAND] = TELNET_STATE_OPTION | TELNET_COMMAND,
+	},
+	[TELNET_STATE_OPTION] =
+	{
+		[TELNET_CLASS_OTHER] = TELNET_STATE_DATA | TELNET_OPTION,
+		[TELNET_CLASS_IAC] = TELNET_STATE_DATA | TELNET_OPTION,
+		[TELNET_CLASS_SB] = TELNET_STATE_DATA | TELNET_OPTION,
+		[TELNET_CLASS_SE] = TELNET_STATE_DATA | TELNET_OPTION,
+		[TELNET_CLASS_OPTION_COMMAND] = TELNET_STATE_DATA | TELNET_OPTION,
+	},
+	[TELNET_STATE_SB] =
+	{
+		[TELNET_CLASS_OTHER] = TELNET_STATE_SB_DATA | TELNET_SB_OPTION,
+		[TELNET_CLASS_IAC] = TELNET_STATE_SB_IAC,
+		[TELNET_CLASS_SB] = TELNET_STATE_SB_DATA | TELNET_SB_OPTION,
+		[TELNET_CLASS_SE] = TELNET_STATE_SB_DATA | TELNET_SB_OPTION,
+		[TELNET_CLASS_OPTION_COMMAND] = TELNET_STATE_SB_DATA | TELNET_SB_OPTION,
+	},
+	/* subnegotiation parameters are dropped until IAC SE */
+	[TELNET_STATE_SB_DATA] =
+	{
+		[TELNET_CLASS_OTHER] = TELNET_STATE_SB_DATA,
+		[TELNET_CLASS_IAC] = TELNET_STATE_SB_IAC,
+		[TELNET_CLASS_SB] = TELNET_STATE_SB_DATA,
+		[TELNET_CLASS_SE] = TELNET_STATE_SB_DATA,
+		[TELNET_CLASS_OPTION_COMMAND] = TELNET_STATE_SB_DATA,
+	},
+	/* IAC IAC is an escaped parameter byte, anything but SE is tolerated */
+	[TELNET_STATE_SB_IAC] =
+	{
+		[TELNET_CLASS_OTHER] = TELNET_STATE_SB_DATA,
+		[TELNET_CLASS_IAC] = TELNET_STATE_SB_DATA,
+		[TELNET_CLASS_SB] = TELNET_STATE_SB_DATA,
+		[TELNET_CLASS_SE] = TELNET_STATE_DATA,
+		[TELNET_CLASS_OPTION_COMMAND] = TELNET_STATE_SB_DATA,
+	},
+};
+
 /* Returns the name of a telnet option based on the value. */
 static const char* telnet_option_name(int value)
 {
@@ -34,7 +142,7 @@ static const char* telnet_option_name(int value)
 		}
 	}
 	/* default value */
-	return '\0';
+	return "UNKNOWN";
 }
 
 /* Returns the value of a telnet option based on the name. */
@@ -52,19 +160,6 @@ static char telnet_option_value(const char* name)
 	return 0;
 }
 
-/* Handles a received telnet option command. */
-static void telnet_handle_command(char *databuf, int datalen)
-{
-	/* just print received commands:
-	 * we set the client, we don't adapt to client commands */
-	if (databuf[0] == telnet_option_value("IAC"))
-	{
-		LOG("received %s %s",
-			telnet_option_name(databuf[1]),
-			telnet_option_name(databuf[2]));
-	}
-}
-
 void telnet_message_set_character_mode(char *databuf)
 {
 	/* send a predefined set of commands proven to work */
@@ -85,69 +180,194 @@ void telnet_message_set_character_mode(char *databuf)
 	//TODO Do we verify client response? What do we do if the response is not how we expected?
 }
 
-void telnet_filter_client_read(char *databuf, int *datalen)
+void telnet_parser_init(telnet_parser_t *parser)
 {
-	int i;
-	char newdata[BUFFER_LEN];
-	int newlen = 0;
-	
-	/* process data using a new buffer */
-	for (i = 0; i < *datalen; i++)
+	memset(parser, 0, sizeof(*parser));
+	parser->state = TELNET_STATE_DATA;
+}
+
+void telnet_filter_client_read(telnet_parser_t *parser, char *databuf, int *datalen)
+{
+	unsigned char *data = (unsigned char *) databuf;
+	unsigned char *iac;
+	unsigned char byte, next;
+	int in = 0;
+	int out = 0;
+	int len;
+
+	/* process data in place, the filtered data is never longer */
+	while (in < *datalen)
 	{
-		/* handle and discard telnet commands */
-		if (databuf[i] == telnet_option_value("IAC"))
+		/* pass plain data up to the next IAC as one block, data without
+		 * commands isn't touched at all */
+		if (parser->state == TELNET_STATE_DATA)
+		{
+			iac = memchr(data + in, TELNET_IAC, *datalen - in);
+			len = (iac != NULL) ? (int) (iac - (data + in)) : *datalen - in;
+			if (out != in)
+			{
+				memmove(data + out, data + in, len);
+			}
+			in += len;
+			out += len;
+			if (iac == NULL)
+			{
+				break;
+			}
+		}
+
+		/* walk through commands one byte at a time */
+		byte = data[in++];
+		next = telnet_transitions[parser->state][telnet_byte_class[byte]];
+		if (next & TELNET_EMIT)
 		{
-			telnet_handle_command((databuf+i), 3);
-			i += 2;
+			data[out++] = byte;
 		}
-		/* let other data pass through */
-		else
+		if (next & TELNET_COMMAND)
 		{
-			newdata[newlen++] = databuf[i];
+			parser->command = byte;
 		}
-	}
-	/* overwrite the data with the new buffer */
-	for (i = 0; i < newlen; i++)
-	{
-		databuf[i] = newdata[i];
+		/* just print received commands:
+		 * we set the client, we don't adapt to client commands */
+		if (next & TELNET_OPTION)
+		{
+			LOG("received %s %s", telnet_option_name((char) parser->command),
+				telnet_option_name((char) byte));
+		}
+		if (next & TELNET_SB_OPTION)
+		{
+			parser->option = byte;
+			LOG("received SB %s", telnet_option_name((char) byte));
+		}
+		parser->state = next & TELNET_STATE_MASK;
 	}
 	/* update data length */
-	*datalen = newlen;
+	*datalen = out;
 }
 
-void telnet_filter_client_write(char *databuf, int *datalen)
+void telnet_encoder_init(telnet_encoder_t *encoder, int flags)
 {
-	int i;
-	char newdata[BUFFER_LEN]; // TODO: maybe use realloc, this is risky
-	int newlen = 0;
-	
-	/* process data using a new buffer */
-	for (i = 0; i < *datalen; i++)
+	encoder->flags = flags;
+	encoder->pending_cr = 0;
+}
+
+size_t telnet_encode_max(size_t datalen, int flags)
+{
+	/* IAC and CR double, DEL grows to three bytes, a pending CR adds its LF */
+	return datalen * ((flags & TELNET_ENCODE_BACKSPACE) ? 3 : 2) + 1;
+}
+
+/* Returns the offset of the first byte the encoder has to change. */
+static size_t telnet_encode_scan(const unsigned char *data, size_t datalen, int flags)
+{
+	const unsigned char cr = (flags & TELNET_ENCODE_CRLF) ? TELNET_CR : TELNET_IAC;
+	const unsigned char del = (flags & TELNET_ENCODE_BACKSPACE) ? TELNET_DEL : TELNET_IAC;
+	const unsigned char *iac;
+	size_t i = 0;
+
+	/* plain IAC escaping only looks for one byte value */
+	if (flags == 0)
 	{
-		/* pressed ENTER */
-		if (databuf[i] == 13)
+		iac = memchr(data, TELNET_IAC, datalen);
+		return (iac != NULL) ? (size_t) (iac - data) : datalen;
+	}
+
+#ifdef __SSE2__
+	/* compare 16 bytes at once against all three values */
+	{
+		const __m128i v_iac = _mm_set1_epi8((char) TELNET_IAC);
+		const __m128i v_cr = _mm_set1_epi8((char) cr);
+		const __m128i v_del = _mm_set1_epi8((char) del);
+
+		for (; i + 16 <= datalen; i += 16)
 		{
-			LOG("handling ENTER");
-			newdata[newlen++] = '\r';
-			newdata[newlen++] = '\n';
+			__m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+			int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, v_iac),
+										 _mm_or_si128(_mm_cmpeq_epi8(v, v_cr),
+													  _mm_cmpeq_epi8(v, v_del))));
+			if (mask != 0)
+			{
+				return i + __builtin_ctz(mask);
+			}
 		}
-		/* pressed BACKSPACE */
-		if (databuf[i] == 127)
+	}
+#endif
+	for (; i < datalen; i++)
+	{
+		if (data[i] == TELNET_IAC || data[i] == cr || data[i] == del)
 		{
-			LOG("handling BACKSPACE");
-			newdata[newlen++] = 8;
-			newdata[newlen++] = ' ';
-			newdata[newlen++] = 8;
+			break;
 		}
-		else {
-			newdata[newlen++] = databuf[i];
+	}
+	return i;
+}
+
+const char* telnet_filter_client_write(telnet_encoder_t *encoder, const char *databuf,
+									   size_t *datalen, char *outbuf)
+{
+	const unsigned char *data = (const unsigned char *) databuf;
+	unsigned char *out = (unsigned char *) outbuf;
+	size_t in = 0;
+	size_t newlen = 0;
+	size_t len;
+
+	/* the common case, nothing to change and nothing to copy */
+	len = telnet_encode_scan(data, *datalen, encoder->flags);
+	if (len == *datalen && !encoder->pending_cr)
+	{
+		return databuf;
+	}
+
+	/* a CR ending the previous write gets its LF if the next byte isn't one */
+	if (encoder->pending_cr && *datalen > 0)
+	{
+		if (data[0] != TELNET_LF)
+		{
+			out[newlen++] = TELNET_LF;
 		}
+		encoder->pending_cr = 0;
 	}
-	/* overwrite the data with the new buffer */
-	for (i = 0; i < newlen; i++)
+
+	/* copy plain runs as blocks and expand the bytes between them */
+	for (;;)
 	{
-		databuf[i] = newdata[i];
+		memcpy(out + newlen, data + in, len);
+		newlen += len;
+		in += len;
+		if (in == *datalen)
+		{
+			break;
+		}
+		switch (data[in])
+		{
+			case TELNET_IAC:
+				out[newlen++] = TELNET_IAC;
+				out[newlen++] = TELNET_IAC;
+				break;
+			/* pressed ENTER */
+			case TELNET_CR:
+				out[newlen++] = TELNET_CR;
+				if (in + 1 == *datalen)
+				{
+					encoder->pending_cr = 1;
+				}
+				else if (data[in + 1] != TELNET_LF)
+				{
+					out[newlen++] = TELNET_LF;
+				}
+				break;
+			/* pressed BACKSPACE */
+			case TELNET_DEL:
+				out[newlen++] = TELNET_BS;
+				out[newlen++] = ' ';
+				out[newlen++] = TELNET_BS;
+				break;
+		}
+		in++;
+		len = telnet_encode_scan(data + in, *datalen - in, encoder->flags);
 	}
+
 	/* update data length */
 	*datalen = newlen;
+	return outbuf;
 }
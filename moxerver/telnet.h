@@ -6,6 +6,41 @@
 
 #define TELNET_MSG_LEN_CHARMODE 9
 
+/* Parser state kept between reads, commands can be split across reads. */
+typedef struct
+{
+	unsigned char state;	/* position inside a telnet command */
+	unsigned char command;	/* pending option command (WILL, WONT, DO, DONT) */
+	unsigned char option;	/* option of a running subnegotiation */
+} telnet_parser_t;
+
+/* translations applied to data sent to the client, besides IAC escaping */
+#define TELNET_ENCODE_CRLF 0x01		 /* a CR not followed by LF gets one */
+#define TELNET_ENCODE_BACKSPACE 0x02 /* DEL erases the previous character */
+
+/* Encoder state kept between writes, a CR can end one write. */
+typedef struct
+{
+	int flags;		/* TELNET_ENCODE_* translations */
+	int pending_cr;	/* > 0 if the last byte was a CR */
+} telnet_encoder_t;
+
+/**
+ * Resets the parser to plain data.
+ */
+void telnet_parser_init(telnet_parser_t *parser);
+
+/**
+ * Sets up the encoder with the given TELNET_ENCODE_* translations.
+ */
+void telnet_encoder_init(telnet_encoder_t *encoder, int flags);
+
+/**
+ * Returns the largest size data of the given length can grow to when it is
+ * encoded with the given TELNET_ENCODE_* translations.
+ */
+size_t telnet_encode_max(size_t datalen, int flags);
+
 /**
  * Creates a telnet protocol message that tells client to go into "character"
  * mode. The passed data buffer must be big enough to hold the message payload
@@ -16,14 +51,22 @@ void telnet_message_set_character_mode(char *databuf);
 
 /**
  * Handles special characters in the data buffer after receiving them from the
- * client. Used to filter out the handshake commands of telnet protocol.
+ * client. Filters out telnet commands and subnegotiations, also when they are
+ * split across reads, and turns escaped IAC IAC into a single data byte.
  * Operates directly on the passed data buffer and modifies the payload length.
  */
-void telnet_filter_client_read(char *databuf, int *datalen);
+void telnet_filter_client_read(telnet_parser_t *parser, char *databuf, int *datalen);
 
 /**
  * Handles special characters in the data buffer before sending them to the
- * client. Used to correctly echo the characters to the telnet client.
- * Operates directly on the passed data buffer and modifies the payload length.
+ * client. Escapes IAC so binary data passes unchanged and applies the
+ * translations of the encoder. Data that needs no changes is not copied.
+ * The output buffer must hold telnet_encode_max() bytes for the data length.
+ *
+ * Returns:
+ * - the passed data buffer if nothing had to be changed
+ * - the output buffer holding the encoded data otherwise
+ * The data length is updated to the length of the returned data.
  */
-void telnet_filter_client_write(char *databuf, int *datalen);
+const char* telnet_filter_client_write(telnet_encoder_t *encoder, const char *databuf,
+									   size_t *datalen, char *outbuf);
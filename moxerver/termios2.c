@@ -0,0 +1,41 @@
+#include <termios2.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+/* termios2 is known by the ioctls and the flag selecting arbitrary rates */
+#if defined(TCGETS2) && defined(BOTHER) && defined(IBSHIFT)
+#define TERMIOS2_SUPPORTED 1
+#else
+#define TERMIOS2_SUPPORTED 0
+#endif
+
+int termios2_set_baud(int fd, int baud)
+{
+#if TERMIOS2_SUPPORTED
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tio.c_ispeed = baud;
+	tio.c_ospeed = baud;
+	if (ioctl(fd, TCSETS2, &tio) < 0 ||
+		ioctl(fd, TCGETS2, &tio) < 0)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	return (int) tio.c_ospeed;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+int termios2_supported()
+{
+	return TERMIOS2_SUPPORTED;
+}
@@ -0,0 +1,30 @@
+/* Sets tty baud rates without a speed_t constant through termios2 on Linux. */
+
+#pragma once
+
+#include <common.h>
+
+/*
+ * The kernel's struct termios2 and BOTHER differ between architectures and
+ * are only found in <asm/termbits.h>, which can't be included next to
+ * <termios.h> because both define struct termios. This translation unit
+ * includes the kernel header alone and only passes plain values.
+ */
+
+/**
+ * Sets the input and output baud rate of an open tty device to any rate.
+ * Real UARTs use the nearest rate their clock allows, the rate the device
+ * runs at is read back.
+ *
+ * Returns:
+ * - the baud rate the device runs at on success
+ * - negative EOPNOTSUPP value (-EOPNOTSUPP) if arbitrary rates are not
+ *   supported on this system
+ * - negative errno value if an error occurred
+ */
+int termios2_set_baud(int fd, int baud);
+
+/**
+ * Returns 1 if arbitrary baud rates can be set on this system, 0 otherwise.
+ */
+int termios2_supported();
@@ -1,56 +1,185 @@
 #include <tty.h>
+#include <termios2.h>
 
 #define TTY_DEFAULT_BAUDRATE B115200
 
+/* Sets a baud rate that has no speed_t constant. Real UARTs use the nearest
+ * rate their clock allows, so the result is read back and reported. */
+static int tty_set_custom_baud(tty_t *tty_dev)
+{
+	int ret = termios2_set_baud(tty_dev->fd, tty_dev->baud);
+
+	if (ret == -EOPNOTSUPP)
+	{
+		LOG("baud rate %d is not supported on this system", tty_dev->baud);
+		return ret;
+	}
+	if (ret < 0)
+	{
+		return ret;
+	}
+	if (ret != tty_dev->baud)
+	{
+		LOG("tty device %s runs at %d baud instead of %d", tty_dev->path,
+			ret, tty_dev->baud);
+	}
+	return 0;
+}
+
+int tty_set_baud(tty_t *tty_dev, int baud)
+{
+	speed_t speed;
+
+	if (baud < 0)
+	{
+		return -EINVAL;
+	}
+
+	speed = (baud == 0) ? TTY_DEFAULT_BAUDRATE : baud_to_speed(baud);
+	if (speed == B0)
+	{
+		if (!termios2_supported())
+		{
+			return -EINVAL;
+		}
+		/* applied by tty_apply() through termios2 */
+		tty_dev->baud = baud;
+		speed = TTY_DEFAULT_BAUDRATE;
+	}
+	else
+	{
+		tty_dev->baud = 0;
+	}
+	if (cfsetispeed(&(tty_dev->ttyset), speed) < 0 ||
+		cfsetospeed(&(tty_dev->ttyset), speed) < 0)
+	{
+		return -EINVAL;
+	}
+	return 0;
+}
+
 int tty_open(tty_t *tty_dev)
 {
-	/* open tty device to get the file descriptor */
-	tty_dev->fd = open (tty_dev->path, O_RDWR | O_NOCTTY | O_SYNC);
+	int ret;
+
+	/* allocate the data buffer */
+	if (tty_dev->data_len == 0)
+	{
+		tty_dev->data_len = BUFFER_LEN;
+	}
+	tty_dev->data = malloc(tty_dev->data_len);
+	if (tty_dev->data == NULL)
+	{
+		return -ENOMEM;
+	}
+
+	/* open tty device to get the file descriptor, reads are driven by the
+	 * event loop so they must never block */
+	tty_dev->fd = open (tty_dev->path, O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK);
 	if (tty_dev->fd < 0)
 	{
+		int err = errno;
 		tty_dev->fd = -1;
-		return -errno;
+		free(tty_dev->data);
+		tty_dev->data = NULL;
+		return -err;
 	}
 
 	/* store default termios settings */
 	if (tcgetattr(tty_dev->fd, &(tty_dev->ttysetold)))
 	{
-		LOG("[@%d] error reading device default config\n"
+		LOG_ERROR("[@%d] error reading device default config\n"
 			"\t\t-> default config will not be restored upon exit", __LINE__);
 	}
 
 	/* set tty device parameters */
+	/* flow control flags are set by tty_set_flow() */
 	tty_dev->ttyset.c_iflag &= ~(IGNBRK | BRKINT | ICRNL | INLCR |
-							 	 PARMRK | INPCK | ISTRIP | IXON);
+							 	 PARMRK | INPCK | ISTRIP);
 	tty_dev->ttyset.c_oflag &= ~(OCRNL | ONLCR | ONLRET |
 							 	 ONOCR | OFILL | OLCUC | OPOST);
 	tty_dev->ttyset.c_lflag &= ~(ECHO | ECHONL | ICANON | IEXTEN | ISIG);
 	tty_dev->ttyset.c_cflag &= ~(CSIZE | PARENB);
 	tty_dev->ttyset.c_cflag |= CS8 | CREAD;
+	/* reads are non-blocking, batching of tty data is done by the caller */
 	tty_dev->ttyset.c_cc[VMIN]  = 1;
-	tty_dev->ttyset.c_cc[VTIME] = 5;
+	tty_dev->ttyset.c_cc[VTIME] = 0;
 
 	/* if speed is set to B0 (e.g. cfg file not provided), use default values */
 	if (cfgetispeed(&(tty_dev->ttyset)) == baud_to_speed(0) && 
 		cfsetispeed(&(tty_dev->ttyset), TTY_DEFAULT_BAUDRATE) < 0)
 	{
 		LOG("error configuring tty device speed");
-		return -errno;
+		ret = -errno;
+		goto error;
 	}
 	if (cfgetospeed(&(tty_dev->ttyset)) == baud_to_speed(0) && 
 		cfsetospeed(&(tty_dev->ttyset), TTY_DEFAULT_BAUDRATE) < 0)
 	{
 		LOG("error configuring tty device speed");
-		return -errno;
+		ret = -errno;
+		goto error;
    	}
 
 	/* apply tty device settings */
-   	if (tcsetattr(tty_dev->fd, TCSANOW, &(tty_dev->ttyset)) < 0)
-   	{
+	ret = tty_apply(tty_dev);
+	if (ret < 0)
+	{
+		goto error;
+	}
+	return 0;
+
+error:
+	/* a device that isn't fully set up is not used, settings applied so far
+	 * are undone */
+	tcsetattr(tty_dev->fd, TCSANOW, &(tty_dev->ttysetold));
+	close(tty_dev->fd);
+	tty_dev->fd = -1;
+	free(tty_dev->data);
+	tty_dev->data = NULL;
+	return ret;
+}
+
+void tty_set_flow(tty_t *tty_dev, tty_flow_t flow)
+{
+	tty_dev->flow = flow;
+	tty_dev->ttyset.c_cflag &= ~CRTSCTS;
+	tty_dev->ttyset.c_iflag &= ~(IXON | IXOFF | IXANY);
+	if (flow == TTY_FLOW_RTSCTS)
+	{
+		tty_dev->ttyset.c_cflag |= CRTSCTS;
+	}
+	else if (flow == TTY_FLOW_XONXOFF)
+	{
+		/* IXON obeys the device, IXOFF throttles it */
+		tty_dev->ttyset.c_iflag |= IXON | IXOFF;
+	}
+}
+
+const char* tty_flow_name(tty_flow_t flow)
+{
+	switch (flow)
+	{
+	case TTY_FLOW_RTSCTS:
+		return "rtscts";
+	case TTY_FLOW_XONXOFF:
+		return "xonxoff";
+	default:
+		return "none";
+	}
+}
+
+int tty_apply(tty_t *tty_dev)
+{
+	if (tcsetattr(tty_dev->fd, TCSANOW, &(tty_dev->ttyset)) < 0)
+	{
 		LOG("error configuring tty device");
 		return -errno;
-   	}
-
+	}
+	if (tty_dev->baud > 0)
+	{
+		return tty_set_custom_baud(tty_dev);
+	}
 	return 0;
 }
 
@@ -60,10 +189,15 @@ int tty_close(tty_t *tty_dev)
 	tty_dev->fd = -1;
 
 	LOG("closing tty device");
+
+	free(tty_dev->data);
+	tty_dev->data = NULL;
 	
 	if (tcsetattr(fd, TCSANOW, &(tty_dev->ttysetold)) < 0)
 	{
-		LOG("[@%d] error restoring tty device default config", __LINE__);
+		LOG_ERROR("[@%d] error restoring tty device default config", __LINE__);
+		/* still release the file descriptor */
+		close(fd);
 		return -errno;
    	}
 
@@ -79,51 +213,49 @@ int tty_read(tty_t *tty_dev)
 {
 	int len;
 
-	len = read(tty_dev->fd, tty_dev->data, BUFFER_LEN);
+	len = read(tty_dev->fd, tty_dev->data, tty_dev->data_len);
 	if (len == -1)
 	{
-		LOG("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
-		return -errno;
-	}
-
-	//TODO let's print received bytes during development phase...
-	if (debug_messages)
-	{
-		int i;
-		for(i = 0; i < len; i++)
+		if (errno != EAGAIN)
 		{
-			LOG("tty <- %u '%c'",
-				(unsigned char) tty_dev->data[i],
-				(unsigned char) tty_dev->data[i]);
+			LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
 		}
+		return -errno;
 	}
 
+	LOG_DUMP(tty_dev->data, len, "tty %s <- %d bytes", tty_dev->path, len);
+
 	return len;
 }
 
 int tty_write(tty_t *tty_dev, char *databuf, int datalen)
 {
-	int len;
-
-	len = write(tty_dev->fd, databuf, datalen);
-	if (len == -1)
-	{
-		LOG("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
-		return -errno;
-	}
+	int len = 0;
+	int ret;
 
-	//TODO let's print received bytes during development phase...
-	if (debug_messages)
+	while (len < datalen)
 	{
-		int i;
-		for(i = 0; i < datalen; i++)
+		ret = write(tty_dev->fd, databuf + len, datalen - len);
+		if (ret == -1)
 		{
-			LOG("tty -> %u '%c'",
-				(unsigned char) databuf[i],
-				(unsigned char) databuf[i]);
+			/* the device output queue is full, the caller waits until it
+			 * drains, e.g. while flow control holds the device back */
+			if (errno == EAGAIN)
+			{
+				break;
+			}
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+			return -errno;
 		}
+		len += ret;
 	}
 
+	LOG_DUMP(databuf, len, "tty %s -> %d bytes", tty_dev->path, len);
+
 	return len;
 }
 
@@ -167,8 +299,60 @@ int speed_to_baud(speed_t speed)
 		return 57600;
 	case B115200:
 		return 115200;
+#ifdef B230400
+	case B230400:
+		return 230400;
+#endif
+#ifdef B460800
+	case B460800:
+		return 460800;
+#endif
+#ifdef B500000
+	case B500000:
+		return 500000;
+#endif
+#ifdef B576000
+	case B576000:
+		return 576000;
+#endif
+#ifdef B921600
+	case B921600:
+		return 921600;
+#endif
+#ifdef B1000000
+	case B1000000:
+		return 1000000;
+#endif
+#ifdef B1152000
+	case B1152000:
+		return 1152000;
+#endif
+#ifdef B1500000
+	case B1500000:
+		return 1500000;
+#endif
+#ifdef B2000000
+	case B2000000:
+		return 2000000;
+#endif
+#ifdef B2500000
+	case B2500000:
+		return 2500000;
+#endif
+#ifdef B3000000
+	case B3000000:
+		return 3000000;
+#endif
+#ifdef B3500000
+	case B3500000:
+		return 3500000;
+#endif
+#ifdef B4000000
+	case B4000000:
+		return 4000000;
+#endif
 	default:
-		return 115200;
+		return -1;
 	}
 }
 
@@ -212,7 +396,59 @@ speed_t baud_to_speed(int baud)
 		return B57600;
 	case 115200:
 		return B115200;
+#ifdef B230400
+	case 230400:
+		return B230400;
+#endif
+#ifdef B460800
+	case 460800:
+		return B460800;
+#endif
+#ifdef B500000
+	case 500000:
+		return B500000;
+#endif
+#ifdef B576000
+	case 576000:
+		return B576000;
+#endif
+#ifdef B921600
+	case 921600:
+		return B921600;
+#endif
+#ifdef B1000000
+	case 1000000:
+		return B1000000;
+#endif
+#ifdef B1152000
+	case 1152000:
+		return B1152000;
+#endif
+#ifdef B1500000
+	case 1500000:
+		return B1500000;
+#endif
+#ifdef B2000000
+	case 2000000:
+		return B2000000;
+#endif
+#ifdef B2500000
+	case 2500000:
+		return B2500000;
+#endif
+#ifdef B3000000
+	case 3000000:
+		return B3000000;
+#endif
+#ifdef B3500000
+	case 3500000:
+		return B3500000;
+#endif
+#ifdef B4000000
+	case 4000000:
+		return B4000000;
+#endif
 	default:
-		return B115200;
+		return B0;
 	}
 }
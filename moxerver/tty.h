@@ -7,28 +7,74 @@
 
 #define TTY_DEV_PATH_LEN 128
 
+/* Flow control between the device and the tty driver. */
+typedef enum
+{
+	TTY_FLOW_NONE,		/* the device and the driver send whenever they have data */
+	TTY_FLOW_RTSCTS,	/* hardware flow control with the RTS and CTS lines */
+	TTY_FLOW_XONXOFF	/* software flow control with XON and XOFF characters */
+} tty_flow_t;
+
 typedef struct
 {
 	int fd;						 /* tty device file descriptor */
 	struct termios ttysetold;	 /* previous termios settings */
 	struct termios ttyset;		 /* current termios settings */
 	char path[TTY_DEV_PATH_LEN]; /* tty device path */
-	char data[BUFFER_LEN];		 /* buffer for received data */
+	char *data;					 /* buffer for received data */
+	size_t data_len;			 /* length of the data buffer, BUFFER_LEN if 0 */
+	int baud;					 /* rate without a speed_t constant, 0 if none */
+	tty_flow_t flow;			 /* flow control with the device */
 } tty_t;
 
 /**
- * Opens the tty device and configures it.
- * The old device settings are saved.
+ * Opens the tty device in non-blocking mode and configures it.
+ * The old device settings are saved and the data buffer is allocated.
  *
  * Returns:
  * - 0 on success
- * - negative errno value if an error occurred
+ * - negative errno value if an error occurred, the device is closed again
  */
 int tty_open(tty_t *tty_dev);
 
+/**
+ * Sets the baud rate tty_open() and tty_apply() configure, 0 selects the
+ * default of 115200.
+ * Rates without a speed_t constant are set through termios2 on Linux.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative EINVAL value (-EINVAL) if the rate is not supported
+ */
+int tty_set_baud(tty_t *tty_dev, int baud);
+
+/**
+ * Sets the flow control tty_open() and tty_apply() configure. Once the driver's
+ * input queue fills up because the device isn't read, it stops the device by
+ * dropping RTS or sending XOFF. CTS or XOFF from the device stop the driver's
+ * output, writes then find the output queue full. With XON/XOFF these two
+ * characters can't be passed as data.
+ */
+void tty_set_flow(tty_t *tty_dev, tty_flow_t flow);
+
+/**
+ * Returns the configuration name of a flow control setting.
+ */
+const char* tty_flow_name(tty_flow_t flow);
+
+/**
+ * Applies the current settings to the open tty device right away, e.g. a baud
+ * rate changed with tty_set_baud(). Data in transit is not flushed.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred
+ */
+int tty_apply(tty_t *tty_dev);
+
 /**
  * Closes the tty device connection.
- * Also applies the old device settings.
+ * Also applies the old device settings and releases the data buffer.
  *
  * Returns:
  * - 0 on success
@@ -41,15 +87,18 @@ int tty_close(tty_t *tty_dev);
  *
  * Returns:
  * - number of read bytes on success,
- * - negative errno value set by an error while reading
+ * - negative errno value set by an error while reading, -EAGAIN if no data
+ *   is available
  */
 int tty_read(tty_t *tty_dev);
 
 /**
- * Sends data from a buffer to tty device.
+ * Sends data from a buffer to tty device as far as its output queue takes it,
+ * never waits. The rest has to be sent again once the device is writable.
  *
  * Returns:
- * - number of sent bytes on success,
+ * - number of sent bytes on success, less than datalen or 0 if the output
+ *   queue is full
  * - negative errno value set by an error while sending
  */
 int tty_write(tty_t *tty_dev, char *databuf, int datalen);
@@ -57,10 +106,16 @@ int tty_write(tty_t *tty_dev, char *databuf, int datalen);
 /**
  * Converts POSIX speed_t to a baud rate.
  * The values of the constants for speed_t are not themselves portable.
+ *
+ * Returns:
+ * - the baud rate, -1 for an unknown speed
  */
 int speed_to_baud(speed_t speed);
 
 /**
  * Converts a numeric baud rate to a POSIX speed_t.
+ *
+ * Returns:
+ * - the speed_t constant, B0 if the system has none for the rate
  */
 speed_t baud_to_speed(int baud);
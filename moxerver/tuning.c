@@ -0,0 +1,111 @@
+#include <tuning.h>
+#include <sys/mman.h>
+
+static cpu_set_t tuning_default_cpus;	/* cores the process started with */
+static int tuning_default_error;		/* errno value if they could not be read */
+static pthread_once_t tuning_default_once = PTHREAD_ONCE_INIT;
+
+/* Saves the cores the process started with, once for all event loop threads. */
+static void tuning_save_default()
+{
+	if (sched_getaffinity(0, sizeof(tuning_default_cpus), &tuning_default_cpus) == -1)
+	{
+		tuning_default_error = errno;
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+	}
+}
+
+void tuning_init(tuning_t *tuning)
+{
+	memset(tuning, 0, sizeof(*tuning));
+	CPU_ZERO(&tuning->cpus);
+}
+
+void tuning_add_port(tuning_t *tuning, const port_config_t *port)
+{
+	if (port->cpu >= 0)
+	{
+		CPU_SET(port->cpu, &tuning->cpus);
+	}
+	if (port->priority > tuning->priority)
+	{
+		tuning->priority = port->priority;
+	}
+	if (port->busy_poll_usec > tuning->busy_poll_usec)
+	{
+		tuning->busy_poll_usec = port->busy_poll_usec;
+	}
+}
+
+int tuning_apply(const tuning_t *tuning, reactor_t *reactor)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	int err, ret = 0;
+
+	/* the cores of the ports, or back to the ones of the process */
+	pthread_once(&tuning_default_once, tuning_save_default);
+	if (tuning_default_error != 0)
+	{
+		return -tuning_default_error;
+	}
+	cpus = (CPU_COUNT(&tuning->cpus) > 0) ? tuning->cpus : tuning_default_cpus;
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+	{
+		ret = -errno;
+		LOG_ERROR("error pinning the event loop to its cores: %s", strerror(errno));
+	}
+
+	/* a realtime thread is never preempted by normal processes, a page fault
+	 * would still stop it, so the memory in use is locked */
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = tuning->priority;
+	err = pthread_setschedparam(pthread_self(),
+								(tuning->priority > 0) ? SCHED_FIFO : SCHED_OTHER, &param);
+	if (err != 0)
+	{
+		ret = (ret < 0) ? ret : -err;
+		LOG_ERROR("error setting the event loop scheduling: %s", strerror(err));
+	}
+	else if (tuning->priority > 0 && mlockall(MCL_CURRENT) == -1)
+	{
+		LOG_WARNING("memory of the realtime event loop not locked: %s", strerror(errno));
+	}
+
+	reactor_set_busy_poll(reactor, tuning->busy_poll_usec);
+
+	if (CPU_COUNT(&tuning->cpus) > 0 || tuning->priority > 0 || tuning->busy_poll_usec > 0)
+	{
+		LOG("event loop tuned: %d pinned cores, SCHED_FIFO priority %d, "
+			"busy polling %ld usec", CPU_COUNT(&tuning->cpus), tuning->priority,
+			tuning->busy_poll_usec);
+	}
+	return ret;
+}
+
+int tuning_helper_attr(pthread_attr_t *attr)
+{
+	struct sched_param param;
+	int err;
+
+	pthread_once(&tuning_default_once, tuning_save_default);
+	err = pthread_attr_init(attr);
+	if (err != 0)
+	{
+		return -err;
+	}
+	/* explicit settings, a realtime creator would pass on SCHED_FIFO */
+	memset(&param, 0, sizeof(param));
+	if ((err = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED)) != 0 ||
+		(err = pthread_attr_setschedpolicy(attr, SCHED_OTHER)) != 0 ||
+		(err = pthread_attr_setschedparam(attr, &param)) != 0 ||
+		(tuning_default_error == 0 &&
+		 (err = pthread_attr_setaffinity_np(attr, sizeof(tuning_default_cpus),
+											&tuning_default_cpus)) != 0))
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, err, strerror(err));
+		pthread_attr_destroy(attr);
+		return -err;
+	}
+	return 0;
+}
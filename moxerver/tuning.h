@@ -0,0 +1,57 @@
+/* Tunes the thread running an event loop for low latency. */
+
+#pragma once
+
+#include <common.h>
+#include <config.h>
+#include <reactor.h>
+#include <sched.h>
+#include <pthread.h>
+
+/* Scheduling of an event loop thread, combined from the settings of the
+ * ports it serves. */
+typedef struct
+{
+	cpu_set_t cpus;			/* cores the thread runs on, none set for any core */
+	int priority;			/* SCHED_FIFO priority, 0 for normal scheduling */
+	long busy_poll_usec;	/* time the event loop spins for events before sleeping */
+} tuning_t;
+
+/**
+ * Sets up tuning without any settings, the thread is scheduled normally.
+ */
+void tuning_init(tuning_t *tuning);
+
+/**
+ * Adds the settings of a port served by the thread. The thread may run on the
+ * cores of all its ports and takes the highest priority and the longest busy
+ * polling time of any of them.
+ */
+void tuning_add_port(tuning_t *tuning, const port_config_t *port);
+
+/**
+ * Applies the tuning to the calling thread and its event loop. Settings left
+ * out restore the core affinity the process started with and normal
+ * scheduling. A setting that can't be applied, e.g. realtime scheduling
+ * without permission, is logged and the others still take effect.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value of the first setting that failed
+ */
+int tuning_apply(const tuning_t *tuning, reactor_t *reactor);
+
+/**
+ * Sets up the attributes of a helper thread that must not inherit the tuning
+ * of the thread creating it, e.g. the capture writer started by a tuned event
+ * loop. The helper thread gets normal scheduling and the cores the process
+ * started with. The attributes are destroyed with pthread_attr_destroy().
+ * The signal mask is not part of the attributes, the caller blocks all
+ * signals around pthread_create() so the helper never takes the quit and
+ * reload signals meant for the main program.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred, nothing is left to destroy
+ */
+int tuning_helper_attr(pthread_attr_t *attr);
@@ -0,0 +1,483 @@
+#include <worker.h>
+#include <tuning.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
+/* Releases the sessions removed by reloads, the event loop must not be
+ * dispatching events it fetched while they were open. */
+static void worker_free_retired(worker_t *worker)
+{
+	int i;
+
+	for (i = 0; i < worker->retired_count; i++)
+	{
+		session_free(worker->retired[i]);
+	}
+	free(worker->retired);
+	worker->retired = NULL;
+	worker->retired_count = 0;
+}
+
+/* Closes all sessions, the event loop stays open. */
+static void worker_close_sessions(worker_t *worker)
+{
+	int i;
+
+	for (i = 0; i < worker->session_count; i++)
+	{
+		session_close(worker->sessions[i]);
+		session_free(worker->sessions[i]);
+	}
+	free(worker->sessions);
+	worker->sessions = NULL;
+	worker->session_count = 0;
+	worker_free_retired(worker);
+}
+
+/* Sets up the event loop and the sessions of the given ports in the calling
+ * thread, a port that fails doesn't stop the others. */
+static int worker_open(worker_t *worker, const config_t *config)
+{
+	int ret;
+	int i;
+
+	ret = reactor_init(&worker->reactor);
+	if (ret < 0)
+	{
+		return ret;
+	}
+
+	/* sessions are allocated one by one, event loop handles point into them
+	 * and a reload replaces single sessions */
+	worker->sessions = calloc((config->count > 0) ? config->count : 1, sizeof(session_t *));
+	if (worker->sessions == NULL)
+	{
+		LOG_ERROR("[@%d] out of memory", __LINE__);
+		reactor_close(&worker->reactor);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < config->count; i++)
+	{
+		session_t *session = calloc(1, sizeof(session_t));
+		if (session == NULL)
+		{
+			LOG_ERROR("[@%d] out of memory", __LINE__);
+			worker_close_sessions(worker);
+			reactor_close(&worker->reactor);
+			return -ENOMEM;
+		}
+		if (session_setup(session, &config->ports[i], &worker->reactor) < 0)
+		{
+			LOG("error setting up port %u, skipping it", config->ports[i].tcp_port);
+			session_close(session);
+			session_free(session);
+			continue;
+		}
+		worker->sessions[worker->session_count++] = session;
+	}
+	return 0;
+}
+
+int worker_setup(worker_t *worker, int index, int cpu, const config_t *config)
+{
+	memset(worker, 0, sizeof(*worker));
+	worker->index = index;
+	worker->cpu = cpu;
+	worker->wake_fd = -1;
+	return worker_open(worker, config);
+}
+
+/* Runs a call from another thread, woken up by its eventfd. */
+static void worker_handle_wake(void *context, unsigned int events)
+{
+	worker_t *worker = (worker_t *) context;
+	uint64_t value;
+
+	if (read(worker->wake_fd, &value, sizeof(value)) != sizeof(value))
+	{
+		return;
+	}
+	pthread_mutex_lock(&worker->lock);
+	if (worker->call != NULL)
+	{
+		worker->call(worker, worker->call_arg);
+		worker->call = NULL;
+		pthread_cond_broadcast(&worker->cond);
+	}
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/* Thread function setting up the worker and running its event loop. */
+static void* worker_thread(void *args)
+{
+	worker_t *worker = (worker_t *) args;
+	int ret;
+
+	/* the event loop is created by the thread that runs it */
+	ret = worker_open(worker, worker->config);
+	if (ret == 0)
+	{
+		ret = reactor_add(&worker->reactor, &worker->wake_handle, worker->wake_fd,
+						  REACTOR_READ, worker_handle_wake, worker);
+		if (ret < 0)
+		{
+			worker_close_sessions(worker);
+			reactor_close(&worker->reactor);
+		}
+	}
+	pthread_mutex_lock(&worker->lock);
+	worker->config = NULL;
+	worker->result = ret;
+	worker->running = (ret == 0);
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+	if (ret < 0)
+	{
+		return (void *) 0;
+	}
+
+	LOG("worker %d serving %d ports", worker->index, worker->session_count);
+	worker_tune(worker);
+	ret = worker_run(worker);
+	if (ret < 0)
+	{
+		/* the server can't go on without the ports of this worker */
+		LOG("worker %d stopped unexpectedly", worker->index);
+		kill(getpid(), SIGTERM);
+	}
+
+	/* a call arriving from now on is not run */
+	pthread_mutex_lock(&worker->lock);
+	worker->result = ret;
+	worker->running = 0;
+	worker_close_sessions(worker);
+	reactor_remove(&worker->reactor, &worker->wake_handle);
+	reactor_close(&worker->reactor);
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+	return (void *) 0;
+}
+
+int worker_start(worker_t *worker, int index, int cpu, const config_t *config)
+{
+	int ret;
+
+	memset(worker, 0, sizeof(*worker));
+	worker->index = index;
+	worker->cpu = cpu;
+	worker->config = config;
+	worker->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (worker->wake_fd == -1)
+	{
+		LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+		return -errno;
+	}
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+
+	if (pthread_create(&worker->thread, NULL, worker_thread, worker) != 0)
+	{
+		LOG("problem with starting worker %d", index);
+		ret = -EAGAIN;
+	}
+	else
+	{
+		/* wait until the thread has set up its sessions */
+		pthread_mutex_lock(&worker->lock);
+		while (worker->config != NULL)
+		{
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		}
+		ret = worker->result;
+		pthread_mutex_unlock(&worker->lock);
+		if (ret == 0)
+		{
+			worker->threaded = 1;
+			return 0;
+		}
+		pthread_join(worker->thread, NULL);
+	}
+
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+	close(worker->wake_fd);
+	worker->wake_fd = -1;
+	return ret;
+}
+
+void worker_tune(worker_t *worker)
+{
+	tuning_t tuning;
+	int i;
+
+	tuning_init(&tuning);
+	for (i = 0; i < worker->session_count; i++)
+	{
+		tuning_add_port(&tuning, &worker->sessions[i]->config);
+	}
+	if (CPU_COUNT(&tuning.cpus) == 0 && worker->cpu >= 0)
+	{
+		CPU_SET(worker->cpu, &tuning.cpus);
+	}
+	tuning_apply(&tuning, &worker->reactor);
+}
+
+int worker_run(worker_t *worker)
+{
+	int ret;
+
+	/* returns when the worker is stopped or a reload removed sessions, they
+	 * are released between iterations */
+	while ((ret = reactor_run(&worker->reactor)) == 0 && !worker->quitting)
+	{
+		worker_free_retired(worker);
+	}
+	return ret;
+}
+
+void worker_call(worker_t *worker, worker_call_t call, void *arg)
+{
+	uint64_t value = 1;
+
+	if (!worker->threaded)
+	{
+		call(worker, arg);
+		return;
+	}
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->running)
+	{
+		worker->call = call;
+		worker->call_arg = arg;
+		if (write(worker->wake_fd, &value, sizeof(value)) != sizeof(value))
+		{
+			LOG_ERROR("[@%d] error %d: %s", __LINE__, errno, strerror(errno));
+			worker->call = NULL;
+		}
+		while (worker->call != NULL && worker->running)
+		{
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		}
+		worker->call = NULL;
+	}
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/* Returns the session serving a TCP port from a list, NULL if there is none. */
+static session_t* find_session(session_t **list, int count, unsigned int tcp_port)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (list[i]->config.tcp_port == tcp_port)
+		{
+			return list[i];
+		}
+	}
+	return NULL;
+}
+
+session_t* worker_find(worker_t *worker, unsigned int tcp_port)
+{
+	session_t *session;
+
+	if (!worker->threaded)
+	{
+		return find_session(worker->sessions, worker->session_count, tcp_port);
+	}
+	pthread_mutex_lock(&worker->lock);
+	session = find_session(worker->sessions, worker->session_count, tcp_port);
+	pthread_mutex_unlock(&worker->lock);
+	return session;
+}
+
+/* Reports a port changed by a reload in the log and to the control client. */
+static void reload_report(FILE *out, unsigned int tcp_port, const char *change)
+{
+	LOG("reload: port %u %s", tcp_port, change);
+	if (out != NULL)
+	{
+		fprintf(out, "port %u %s\n", tcp_port, change);
+	}
+}
+
+/* Closes a session whose events may still be waiting in the current event
+ * loop iteration, its memory is released once the iteration is over. */
+static void retire_session(worker_t *worker, session_t *session)
+{
+	session_close(session);
+	worker->retired[worker->retired_count++] = session;
+	/* release the TCP port and tty device for a session set up next */
+	reactor_flush(&worker->reactor);
+}
+
+void worker_reload(worker_t *worker, const config_t *config, FILE *out,
+				   worker_reload_t *totals)
+{
+	session_t **updated;
+	session_t **grown;
+	session_t *session;
+	int count = 0;
+	int i, ret;
+
+	updated = calloc((config->count > 0) ? config->count : 1, sizeof(session_t *));
+	/* every running session can end up retired */
+	grown = realloc(worker->retired,
+					(worker->retired_count + worker->session_count) * sizeof(session_t *));
+	if (updated == NULL || (grown == NULL && worker->retired_count + worker->session_count > 0))
+	{
+		LOG_ERROR("[@%d] out of memory", __LINE__);
+		if (out != NULL)
+		{
+			fprintf(out, "error: out of memory\n");
+		}
+		free(updated);
+		totals->failed += config->count;
+		return;
+	}
+	worker->retired = grown;
+
+	/* close the ports that are gone first, their devices may be reused */
+	for (i = 0; i < worker->session_count; i++)
+	{
+		int j;
+		for (j = 0; j < config->count; j++)
+		{
+			if (config->ports[j].tcp_port == worker->sessions[i]->config.tcp_port)
+			{
+				break;
+			}
+		}
+		if (j == config->count)
+		{
+			reload_report(out, worker->sessions[i]->config.tcp_port, "removed");
+			retire_session(worker, worker->sessions[i]);
+			totals->removed++;
+		}
+	}
+
+	for (i = 0; i < config->count; i++)
+	{
+		const port_config_t *port = &config->ports[i];
+		int restart = 0;
+
+		session = find_session(worker->sessions, worker->session_count, port->tcp_port);
+		if (session != NULL)
+		{
+			ret = session_reconfigure(session, port);
+			if (ret == 1)
+			{
+				reload_report(out, port->tcp_port, "tty settings changed");
+				totals->changed++;
+			}
+			if (ret >= 0)
+			{
+				updated[count++] = session;
+				continue;
+			}
+			if (ret != -EBUSY)
+			{
+				/* the device keeps running with the old settings */
+				reload_report(out, port->tcp_port, "error: tty settings not changed");
+				updated[count++] = session;
+				totals->failed++;
+				continue;
+			}
+			retire_session(worker, session);
+			restart = 1;
+		}
+
+		/* a new port, or one whose session has to be set up again */
+		session = calloc(1, sizeof(session_t));
+		if (session == NULL || session_setup(session, port, &worker->reactor) < 0)
+		{
+			if (session != NULL)
+			{
+				session_close(session);
+				session_free(session);
+			}
+			reload_report(out, port->tcp_port, "error: setup failed");
+			totals->failed++;
+			continue;
+		}
+		updated[count++] = session;
+		if (restart)
+		{
+			reload_report(out, port->tcp_port, "restarted");
+			totals->restarted++;
+		}
+		else
+		{
+			reload_report(out, port->tcp_port, "added");
+			totals->added++;
+		}
+	}
+
+	free(worker->sessions);
+	worker->sessions = updated;
+	worker->session_count = count;
+	worker_tune(worker);
+
+	/* the event loop returns after this iteration, then the removed sessions
+	 * can be released */
+	if (worker->retired_count > 0)
+	{
+		reactor_stop(&worker->reactor);
+	}
+}
+
+void worker_print_stats(worker_t *worker, FILE *out)
+{
+	int i;
+
+	for (i = 0; i < worker->session_count; i++)
+	{
+		session_print_stats(worker->sessions[i], out);
+	}
+}
+
+void worker_print_status(worker_t *worker, FILE *out)
+{
+	int i;
+
+	for (i = 0; i < worker->session_count; i++)
+	{
+		session_print_status(worker->sessions[i], out);
+	}
+}
+
+/* Makes the event loop of the worker return for good. */
+static void worker_quit(worker_t *worker, void *arg)
+{
+	worker->quitting = 1;
+	reactor_stop(&worker->reactor);
+}
+
+int worker_stop(worker_t *worker)
+{
+	int ret;
+
+	worker_call(worker, worker_quit, NULL);
+	if (!worker->threaded)
+	{
+		return 0;
+	}
+
+	pthread_join(worker->thread, NULL);
+	ret = worker->result;
+	worker->threaded = 0;
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+	close(worker->wake_fd);
+	worker->wake_fd = -1;
+	return ret;
+}
+
+void worker_close(worker_t *worker)
+{
+	worker_close_sessions(worker);
+	reactor_close(&worker->reactor);
+}
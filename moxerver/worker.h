@@ -0,0 +1,152 @@
+/* Runs the event loop of a share of the served ports. */
+
+#pragma once
+
+#include <common.h>
+#include <config.h>
+#include <reactor.h>
+#include <session.h>
+#include <pthread.h>
+
+#define WORKERS_MAX 256	/* most worker threads of one server */
+
+/*
+ * Every port is served by exactly one worker. A worker owns its event loop
+ * and the sessions on it, nothing of a session is touched by another thread,
+ * so workers never lock each other out. A worker runs either in a thread of
+ * its own or in the calling thread; other threads only reach it through
+ * worker_call(), which runs a function inside the worker thread between two
+ * event loop iterations.
+ */
+
+struct worker;
+
+/* Function executed inside the worker thread by worker_call(). */
+typedef void (*worker_call_t)(struct worker *worker, void *arg);
+
+/* Changes made by a reload, added up over the workers. */
+typedef struct
+{
+	int added;		/* new ports */
+	int removed;	/* ports that are gone */
+	int restarted;	/* ports set up again */
+	int changed;	/* ports with new tty settings applied in place */
+	int failed;		/* ports that could not be changed */
+} worker_reload_t;
+
+typedef struct worker
+{
+	int index;					/* worker number used in the log */
+	int cpu;					/* core of a worker without pinned ports, -1 for any */
+	reactor_t reactor;			/* event loop of the worker */
+	session_t **sessions;		/* sessions of the served ports */
+	int session_count;			/* number of sessions */
+	session_t **retired;		/* sessions removed by a reload, freed outside the event loop */
+	int retired_count;			/* number of removed sessions */
+	int quitting;				/* > 0 once the worker was told to stop */
+
+	/* used while the worker runs in a thread of its own */
+	int threaded;				/* > 0 if started with worker_start() */
+	pthread_t thread;			/* worker thread */
+	pthread_mutex_t lock;		/* protects the fields below */
+	pthread_cond_t cond;		/* signals a finished call or thread state change */
+	int running;				/* > 0 while the worker thread serves its ports */
+	int result;					/* result of the setup, then of the event loop */
+	int wake_fd;				/* eventfd waking the worker for a call */
+	reactor_handle_t wake_handle;
+	worker_call_t call;			/* function to run in the worker thread, NULL if none */
+	void *call_arg;				/* argument of the call */
+	const config_t *config;		/* ports set up by the worker thread when it starts */
+} worker_t;
+
+/**
+ * Sets up the worker in the calling thread: its event loop and sessions for
+ * the given ports. A port that fails is logged and skipped, a worker without
+ * ports keeps running and can get ports from a reload.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred, nothing is left open
+ */
+int worker_setup(worker_t *worker, int index, int cpu, const config_t *config);
+
+/**
+ * Starts the worker in a thread of its own, which sets it up as
+ * worker_setup() does and then runs its event loop. Returns once the
+ * sessions are set up.
+ *
+ * Returns:
+ * - 0 on success
+ * - negative errno value if an error occurred, the thread is gone
+ */
+int worker_start(worker_t *worker, int index, int cpu, const config_t *config);
+
+/**
+ * Applies the latency settings of the served ports to the worker thread,
+ * a worker with none of its ports pinned is pinned to its own core.
+ * Runs inside the worker thread.
+ */
+void worker_tune(worker_t *worker);
+
+/**
+ * Runs the event loop of a worker set up with worker_setup() in the calling
+ * thread, until worker_stop() is called.
+ *
+ * Returns:
+ * - 0 when stopped
+ * - negative errno value if an error occurred
+ */
+int worker_run(worker_t *worker);
+
+/**
+ * Runs a function inside the worker thread between two event loop iterations
+ * and waits until it is done. Without a worker thread the function runs
+ * right away. Nothing runs once the worker thread is gone.
+ */
+void worker_call(worker_t *worker, worker_call_t call, void *arg);
+
+/**
+ * Returns the session serving a TCP port, NULL if there is none. Other
+ * threads may look up sessions, but only use the result to tell whether the
+ * port is served.
+ */
+session_t* worker_find(worker_t *worker, unsigned int tcp_port);
+
+/**
+ * Brings the sessions of the worker in line with its share of a new
+ * configuration. Ports are matched by their TCP port, unchanged ports keep
+ * their clients and new tty settings are applied in place. Ports with other
+ * changes are set up again, ports that are gone are closed. Every change is
+ * reported to out, if given, and added to the totals. Runs inside the
+ * worker thread, see worker_call().
+ */
+void worker_reload(worker_t *worker, const config_t *config, FILE *out,
+				   worker_reload_t *totals);
+
+/**
+ * Prints the counters of all served ports, see session_print_stats().
+ * Runs inside the worker thread, see worker_call().
+ */
+void worker_print_stats(worker_t *worker, FILE *out);
+
+/**
+ * Prints the state of all served ports, one line each, see
+ * session_print_status(). Runs inside the worker thread, see worker_call().
+ */
+void worker_print_status(worker_t *worker, FILE *out);
+
+/**
+ * Makes the worker leave its event loop. A worker thread is waited for and
+ * closes its sessions itself.
+ *
+ * Returns:
+ * - 0 if the worker stopped normally
+ * - negative errno value the event loop of a worker thread failed with
+ */
+int worker_stop(worker_t *worker);
+
+/**
+ * Closes all sessions and the event loop of a worker set up with
+ * worker_setup(), once its event loop returned.
+ */
+void worker_close(worker_t *worker);